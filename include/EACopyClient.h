@@ -17,6 +17,7 @@ enum : uint {
 
 enum FileFlags { FileFlags_Data = 1, FileFlags_Attributes = 2, FileFlags_Timestamps = 4 };
 enum UseServer { UseServer_Automatic, UseServer_Required, UseServer_Disabled };
+enum CopyOrder { CopyOrder_Discovery, CopyOrder_FileId, CopyOrder_PhysicalOffset }; // FileId/PhysicalOffset sort queued files in batches to make source reads closer to sequential on rotational storage
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -27,6 +28,7 @@ struct ClientSettings
 
 	WString				sourceDirectory;
 	WString				destDirectory;
+	StringList			additionalDestDirectories; // Files are read once and written to destDirectory and all of these. Destination server is not used when set
 	StringList			filesOrWildcards;
 	StringList			filesOrWildcardsFiles;
 	StringList			filesExcludeFiles;
@@ -36,6 +38,7 @@ struct ClientSettings
 	uint				includeAttributes			= 0;
 	StringList			optionalWildcards; // Will not causes error if source file fulfill optionalWildcards
 	uint				threadCount					= 0;
+	uint				deviceConcurrency			= 0; // Max files copied at the same time per source/dest device. Zero means threadCount is the only limit
 	uint				retryWaitTimeMs				= 30 * 1000;
 	uint				retryCount					= 1000000;
 	int					dirCopyFlags				= FileFlags_Data | FileFlags_Attributes;
@@ -54,14 +57,29 @@ struct ClientSettings
 	bool				logProgress					= true;
 	bool				logDebug					= false;
 	UseBufferedIO		useBufferedIO				= UseBufferedIO_Auto;
+	UseMappedIO			useMappedIO					= UseMappedIO_Auto;
 	bool				replaceSymLinksAtDestination= true; // When writing to destination and a directory is a symlink we remove symlink and create real directory
 	bool				useOptimizedWildCardFileSearch = true;
+	bool				useDestDirectorySnapshot	= true; // Once destination turns out to have files, each destination directory is enumerated once for skip checks instead of getting info per file
 	u64					useLinksThreshold			= ~u64(0);
 	bool				useLinksRelativePath		= true;
 	bool				useOdx						= false;
 	bool				useSystemCopy				= false;
+	u64					splitFileThreshold			= ~u64(0); // Files bigger than this are split in parts that all workers help copying (local copies only)
+	uint				ioRingQueueDepth			= 0; // Zero means io_uring is not used when copying files. When used, small files are also copied in batches (linux only)
+	bool				tuneIoRingQueueDepth		= false; // ioRingQueueDepth was not set explicitly and is tuned when useCopyTuner is set
+	uint				copyChunkSize				= 0; // Chunk size used when reading/writing/sending files. Zero means each copy path uses its own default, or that it is tuned when useCopyTuner is set
+	bool				useCopyTuner				= false; // Tune copyChunkSize and ioRingQueueDepth on the first large files copied. Values set explicitly are never tuned
+	bool				useTempFiles				= false; // Write files to temp file and move them in place when complete. Each temp file is flushed to disk by the worker that wrote it before it is moved
+	CopyOrder			copyOrder					= CopyOrder_Discovery;
+	bool				verifyCopies				= false; // Read back each copied file and compare it with source. Runs on its own thread overlapping the copying
+	UseBufferedIO		verifyBufferedIO			= UseBufferedIO_Auto;
+	bool				dedupeDestination			= false; // After copying, identical files written by job share data through reflinks. Content is compared byte by byte first
 	StringList			additionalLinkDirectories;
 	WString				linkDatabaseFile;
+	WString				scanCacheFile; // Listings of unchanged source directories are read from this file instead of enumerating them. Size and write time of files are cached too, so only valid for sources where files are replaced, not modified in place
+	bool				watchSource					= false; // After the first pass, keep copying files as they change in source until stopWatch is called (linux only, local source)
+	uint				watchDebounceMs				= 500; // A changed file is copied when it has had no new events for this long
 };
 
 
@@ -96,6 +114,16 @@ struct ClientStats
 	u64					deltaCompressionTime		= 0;
 	u64					hashTime					= 0;
 	u64					hashCount					= 0;
+	u64					verifyCount					= 0;
+	u64					verifySize					= 0;
+	u64					verifyTime					= 0;
+	u64					verifyFailCount				= 0;
+	u64					dedupeTime					= 0;
+	u64					dedupeCount					= 0;
+	u64					dedupeSize					= 0; // Bytes reclaimed by dedupe
+	uint				chunkSize					= 0; // Chunk size that was used after tuning (zero if defaults were used)
+	uint				ioRingQueueDepth			= 0;
+	uint				deviceMaxActive				= 0; // Most files in flight on one device at the same time (only tracked with deviceConcurrency)
 	u64					netSecretGuid				= 0;
 	u64					netWriteResponseTime[WriteResponseCount] = { 0 };
 	u64					netWriteResponseCount[WriteResponseCount] = { 0 };
@@ -111,6 +139,16 @@ struct ClientStats
 	u64					readLinkDbEntries			= 0;
 	u64					writeLinkDbTime				= 0;
 	u64					writeLinkDbEntries			= 0;
+	u64					readScanCacheTime			= 0;
+	u64					readScanCacheEntries		= 0;
+	u64					writeScanCacheTime			= 0;
+	u64					writeScanCacheEntries		= 0;
+	u64					scanCacheHitCount			= 0; // Directories that were not enumerated because they had not changed
+	u64					watchEventCount				= 0;
+	u64					watchRescanCount			= 0; // Full rescans done because the event queue overflowed
+	u64					watchCopyCount				= 0; // Files handled because of watch events
+	u64					watchLatencyTime			= 0; // Summed time from first event of a file until it was copied
+	u64					watchMaxLatency				= 0;
 
 	IOStats				ioStats;
 
@@ -128,8 +166,9 @@ struct ClientStats
 class Client
 {
 public:
-						// Ctor
+						// Ctor / Dtor
 						Client(const ClientSettings& settings);
+						~Client();
 
 						// Process files from source to dest
 	int					process(Log& log);
@@ -138,26 +177,61 @@ public:
 						// Report server status using destination path
 	int					reportServerStatus(Log& log);
 
+						// Make process return after the first pass when watchSource is set. Can be called from any thread and from signal handlers
+	void				stopWatch();
+
+						// Make first SIGINT or SIGTERM call stopWatch, second one terminates as usual. Lasts until client is destroyed (linux only)
+	void				stopWatchOnSignal();
+
 private:
 
 	// Types
-	struct				CopyEntry { WString src; WString dst; FileInfo srcInfo; uint attributes = 0u; };
+	struct				SplitFile;
+	struct				CopyEntry { WString src; WString dst; FileInfo srcInfo; uint attributes = 0u; SplitFile* split = nullptr; u64 partOffset = 0u; uint srcDevice = 0u; uint dstDevice = 0u; int destIndex = -1; };
 	struct				DirEntry { 	WString sourceDir; WString destDir; WString wildcard; int depthLeft = 0; };
 	using				HandleFileOrWildcardFunc = Function<bool(char*)>;
 	using				CopyEntries = List<CopyEntry>;
-	using				DirEntries = List<DirEntry>;
+	using				DirEntries = Deque<DirEntry>;
+	struct				DirQueue { CriticalSection cs; DirEntries entries; }; // One per worker. Owner takes newest entry, idle workers steal oldest
 	using				CachedFindFileEntries = std::map<WString, Set<WString, NoCaseWStringLess>, NoCaseWStringLess>;
 	class				Connection;
 	struct				NameAndFileInfo { WString name; FileInfo info; uint attributes = 0u; };
+	struct				VerifyEntry { WString src; WString fullDst; u64 fileSize = 0u; };
+	using				VerifyEntries = List<VerifyEntry>;
+	struct				WrittenFile { WString fullDst; FileInfo info; Hash hash; };
+	using				WrittenFiles = List<WrittenFile>;
+	using				DestDirSnapshot = std::shared_ptr<const Vector<NameAndFileInfo>>; // Sorted by name. Shared since watch clears snapshots while workers search them
+	using				DestDirSnapshots = std::map<WString, DestDirSnapshot, NoCaseWStringLess>;
+	struct				WatchDir { WString sourceDir; WString destDir; List<WString> wildcards; int depthLeft = 0; };
 
 	// Methods
 	void				resetWorkState(Log& log);
 	bool				processDir(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats);
 	bool				processFile(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats);
+	bool				processFile(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats);
+	bool				processFileFanOut(LogContext& logContext, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats);
+	void				queueDestinations(const CopyEntry& entry, int firstDestIndex);
+	bool				processFilePart(LogContext& logContext, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats);
+	void				queueFileParts(const CopyEntry& entry, const WString& fullDst, const WString& writeDst, bool useLinks, u64 startTime);
+	bool				processOrderEntries(ClientStats& stats);
+	bool				processSmallFiles(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats, uint& outProcessedCount);
 	bool				processQueues(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats, bool isMainThread);
 	bool				connectToServer(const wchar_t* networkPath, uint connectionIndex, Connection*& outConnection, bool& failedToConnect, ClientStats& stats);
 	int					workerThread(uint connectionIndex, ClientStats& stats);
+	uint				getDeviceIndex(const WString& directory, IOStats& ioStats);
+	bool				acquireDevices(const CopyEntry& entry);
+	void				releaseDevices(const CopyEntry& entry);
+	void				queueWrittenFile(const CopyEntry& entry, const WString& fullDst);
+	int					verifyThread(ClientStats& stats);
+	bool				verifyFile(LogContext& logContext, const VerifyEntry& entry, CopyContext& copyContext, ClientStats& stats);
+	void				dedupeWrittenFiles(ClientStats& stats);
+	bool				isContentEqual(const WString& fileA, const WString& fileB, CopyContext& copyContext, IOStats& ioStats);
 	bool				traverseFilesInDirectory(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, const WString& sourcePath, const WString& destPath, const WString& wildcard, int depthLeft, ClientStats& stats);
+	void				addWatchDirectory(const WString& sourcePath, const WString& destPath, const WString& wildcard, int depthLeft);
+	bool				watchSourceChanges(LogContext& logContext, ClientStats& stats);
+	bool				traverseFilesInDirectoryCached(LogContext& logContext, Connection* destConnection, const WString& sourcePath, const WString& destPath, const WString& wildcard, int depthLeft, ClientStats& stats, bool& outHandled);
+	uint				getDestFileInfo(FileInfo& outInfo, const WString& fullDst, IOStats& ioStats);
+	bool				snapshotDestDirectory(Vector<NameAndFileInfo>& outEntries, const WString& directory, IOStats& ioStats);
 	bool				findFilesInDirectory(Vector<NameAndFileInfo>& outEntries, LogContext& logContext, Connection* connection, NetworkCopyContext& copyContext, const WString& path, ClientStats& stats);
 	bool				addDirectoryToHandledFiles(LogContext& logContext, Connection* destConnection, const WString& destFullPath, uint attributes, ClientStats& stats);
 	bool				handleFile(LogContext& logContext, Connection* destConnection, const WString& sourcePath, const WString& destPath, const wchar_t* fileName, const FileInfo& fileInfo, uint attributes, ClientStats& stats);
@@ -171,6 +245,7 @@ private:
 	bool				processQueuedWildcardFileEntries(LogContext& logContext, ClientStats& stats, CachedFindFileEntries& findFileCache, const WString& rootSourcePath, const WString& rootDestPath);
 	bool				purgeFilesInDirectory(const WString& destPath, uint destPathAttributes, int depthLeft, ClientStats& stats);
 	bool				ensureDirectory(Connection* destConnection, const WString& directory, uint attributes, IOStats& ioStats);
+	const WString&		getDestDirectory(int destIndex) const;
 	const wchar_t*		getRelativeSourceFile(const WString& sourcePath) const;
 	const wchar_t*		getFileKeyPath(const WString& relativePath) const;
 	Connection*			createConnection(const wchar_t* networkPath, uint connectionIndex, ClientStats& stats, bool& failedToConnect, bool doProtocolCheck);
@@ -188,14 +263,36 @@ private:
 	bool				m_useDestServerFailed;
 	Event				m_workDone;
 	bool				m_tryCopyFirst;
+	bool				m_useFanOut; // Files going to additional destinations are read once and written to all destinations in one pass
 	NetworkCopyContext	m_copyContext;
 	Connection*			m_sourceConnection;
 	Connection*			m_destConnection;
 	CriticalSection		m_copyEntriesCs;
 	CopyEntries			m_copyEntries;
-	CriticalSection		m_dirEntriesCs;
-	DirEntries			m_dirEntries;
-	uint				m_processDirActive;
+	uint				m_processFileActive; // Files taken off the queue but not finished. These can queue more entries (split parts, fan-out destinations etc)
+	CriticalSection		m_orderEntriesCs;
+	CopyEntries			m_orderEntries;
+	uint				m_processOrderActive;
+	CriticalSection		m_devicesCs;
+	Map<WString, uint>	m_deviceDirectories;
+	Map<u64, uint>		m_deviceIndices;
+	Vector<uint>		m_deviceActive; // Files in flight per device. Index zero is for unknown devices which are not limited
+	uint				m_deviceMaxActive;
+	uint				m_deviceReleaseCount; // Bumped by releaseDevices. Lets workers know if a device freed up while they looked through the queue
+	Event				m_deviceReleased;
+	Vector<DirQueue>	m_dirQueues; // Index zero is main thread, rest are worker threads
+	CriticalSection		m_verifyEntriesCs;
+	VerifyEntries		m_verifyEntries;
+	Event				m_verifyEntriesQueued; // Set when m_verifyEntries is non-empty or copying is done. Reset under m_verifyEntriesCs
+	Event				m_copyDone;
+	CriticalSection		m_writtenFilesCs;
+	WrittenFiles		m_writtenFiles;
+	std::atomic<uint>	m_processDirActive; // Dir entries queued or being processed. Changed by every worker for every directory so it has no lock
+	CriticalSection		m_destDirSnapshotsCs;
+	DestDirSnapshots	m_destDirSnapshots;
+	WildcardSetMatcher	m_excludeWildcards; // Compiled from settings, matched for every file
+	WildcardSetMatcher	m_excludeWildcardDirectories;
+	WildcardSetMatcher	m_optionalWildcards;
 	FilesSet			m_handledFiles;
 	CriticalSection		m_handledFilesCs;
 	FilesSet			m_createdDirs;
@@ -210,6 +307,13 @@ private:
 	Guid				m_secretGuid;
 	CriticalSection		m_secretGuidCs;
 	FileDatabase		m_fileDatabase;
+	ScanCache			m_scanCache;
+	int					m_watchHandle; // inotify descriptor while watching source, -1 otherwise
+	std::atomic<bool>	m_watching; // Set when first pass is done and workers only wait for watch events
+	std::atomic<bool>	m_watchStop; // Atomic instead of Event so stopWatch is safe in signal handlers
+	CriticalSection		m_watchDirsCs;
+	Map<int, WatchDir>	m_watchDirs; // Watched source directories by watch descriptor
+	CopyTuner			m_copyTuner;
 
 	CompressionStats	m_compressionStats;
 
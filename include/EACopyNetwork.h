@@ -21,7 +21,7 @@ namespace eacopy
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-enum : uint { ProtocolVersion = 20 };	// Network protocol version.. must match EACopy and EACopyService otherwise it will fallback to non-server copy behavior
+enum : uint { ProtocolVersion = 21 };	// Network protocol version.. must match EACopy and EACopyService otherwise it will fallback to non-server copy behavior
 enum : uint { DefaultPort = 18099 };	// Default port for client and server to connect. Can be overridden with command line
 
 
@@ -92,7 +92,8 @@ enum WriteFileType : u8
 {
 	WriteFileType_TransmitFile,
 	WriteFileType_Send,
-	WriteFileType_Compressed
+	WriteFileType_Compressed,
+	WriteFileType_Sparse		// Stream of FileExtent followed by extent data. Holes are not sent. Terminated by extent with size zero
 };
 
 // TODO: write file attributes?
@@ -239,7 +240,7 @@ struct SendFileStats
 	u64			compressionLevelSum = 0;
 };
 
-bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, IOStats& ioStats, SendFileStats& sendStats);
+bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, bool useMappedIO, IOStats& ioStats, SendFileStats& sendStats, HashBuilder* hashBuilder = nullptr); // All file content is added to hashBuilder if provided
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -250,7 +251,7 @@ struct RecvFileStats
 	u64			decompressTime = 0;
 };
 
-bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useUnbufferedIO, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats);
+bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useUnbufferedIO, bool useTempFile, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats, HashBuilder* hashBuilder = nullptr); // All file content is added to hashBuilder if provided
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
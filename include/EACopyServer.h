@@ -38,6 +38,8 @@ struct ServerSettings
 	bool			useOdx						= false;
 	bool			logDebug					= false;
 	UseBufferedIO	useBufferedIO				= UseBufferedIO_Auto;
+	UseMappedIO		useMappedIO					= UseMappedIO_Auto;
+	bool			useTempFiles				= false; // Write files to temp file and move them in place when complete
 	WString			primingDirectory;
 	uint			maxConcurrentDownloadCount	= 100;
 	WString			user;
@@ -5,9 +5,12 @@
 #define WIN32_LEAN_AND_MEAN
 #define _HAS_EXCEPTIONS 0
 
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
@@ -21,8 +24,21 @@ namespace eacopy
 // Global Constants
 
 enum { CopyContextBufferSize = 8*1024*1024 }; // This is the chunk size used when reading/writing/copying files
+enum { CopyContextBufferAlignment = 4096 }; // Buffers must be aligned to be usable with unbuffered io
 enum { MaxPath = 4096 }; // Max path for EACopy
 enum { LogBufferSize = 10000 }; // Size of buffer used when printing log messages
+enum { DefaultIoRingQueueDepth = 6 }; // Number of reads/writes in flight per file when io_uring copy is used (linux only)
+enum { MaxIoRingQueueDepth = 24 }; // All in-flight requests share the CopyContext buffers so this can't be too high
+enum { SmallFileBatchCount = 32 }; // Max number of files copied in one io_uring submission (linux only)
+enum { SmallFileMaxSize = 64*1024 }; // Files up to this size can be copied in batches
+enum { IoRingEntryCount = 256 }; // Must fit all linked requests of a small file batch
+enum { DedupeMinFileSize = 64*1024 }; // Smaller files are not worth hashing and linking when deduping destination
+enum { FanOutMaxLagFactor = 4 }; // Destination that spent this many times longer writing than the fastest one is detached from a fan-out copy
+enum { FanOutMinLagMs = 2000 }; // ..as long as it is at least this much behind
+enum { DeviceQueueSearchCount = 256 }; // Number of queued files a worker looks through to find one on devices with spare capacity
+enum { DeviceWaitMs = 10 }; // Max time a worker waits for a device to free up before looking at the queue again. Files on other devices might have been queued
+enum { CopyOrderBatchCount = 4096 }; // Number of discovered files sorted together when copy order is not discovery order
+enum { ScanCacheRacyTimeMs = 2000 }; // Directories modified this close to being listed are not saved in scan cache
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Types
@@ -39,6 +55,7 @@ using								u64			= unsigned long long;
 using								String		= std::string;
 using								WString		= std::wstring;
 template<class T> using				List		= std::list<T>;
+template<class T> using				Deque		= std::deque<T>;
 template<class K, class V> using	Map			= std::map<K, V>;
 template<class K, class L> using	Set			= std::set<K, L>;
 template<class T> using				Vector		= std::vector<T>;
@@ -168,6 +185,7 @@ WString					getProcessesUsingResource(const wchar_t* resourceName);
 WString					toPretty(u64 bytes, uint alignment = 0);
 WString					toHourMinSec(u64 time, uint alignment = 0);
 String					toString(const wchar_t* str);
+WString					toWString(const char* str);
 void					itow(int value, wchar_t* dst, uint dstCapacity);
 int						stringEquals(const wchar_t* a, const wchar_t* b);
 int						stringEquals(const char* a, const char* b);
@@ -201,13 +219,26 @@ struct FileInfo
 	// TODO: add attributes here? It will require fixes in server, but can copy things like hidden attr.
 };
 
+struct FileExtent
+{
+	u64					offset;
+	u64					size;
+};
+
+struct IoRing;
+
 struct CopyContext
 {
 						CopyContext();
 						~CopyContext();
-	u8*					buffers[3];
+	u8*					buffers[3]; // Aligned to CopyContextBufferAlignment
+	u8*					bufferMemory;
+	IoRing*				ioRing = nullptr; // Lazily created first time copyFile is asked to use io_uring (linux only)
+	uint				chunkSize = 0; // Zero means each copy path uses its own default chunk size. Multiple of 4096 and not bigger than CopyContextBufferSize
 };
 
+inline uint				getChunkSize(const CopyContext& copyContext, uint defaultChunkSize) { return copyContext.chunkSize ? copyContext.chunkSize : defaultChunkSize; }
+
 struct IOStats
 {
 	u64					createReadTime = 0;
@@ -228,21 +259,41 @@ struct IOStats
 	u64					createLinkTime = 0;
 	u64					deleteFileTime = 0;
 	u64					moveFileTime = 0;
+	u64					flushFileTime = 0;
 	u64					removeDirTime = 0;
 	u64					setLastWriteTime = 0;
 	u64					findFileTime = 0;
 	u64					fileInfoTime = 0;
 	u64					createDirTime = 0;
 	u64					copyFileTime = 0;
+	u64					allocateFileTime = 0;
+	u64					cloneFileTime = 0;
+	u64					sparseCopyTime = 0;
+	u64					mapFileTime = 0;
+	u64					copyFileRangeTime = 0;
+	u64					ioRingCopyTime = 0;
+	u64					ioRingSubmitCount = 0;
+	u64					ioRingQueueDepthSum = 0;
 	uint				createLinkCount = 0;
 	uint				deleteFileCount = 0;
 	uint				moveFileCount = 0;
+	uint				flushFileCount = 0;
 	uint				removeDirCount = 0;
 	uint				setLastWriteTimeCount = 0;
 	uint				findFileCount = 0;
 	uint				fileInfoCount = 0;
 	uint				createDirCount = 0;
 	uint				copyFileCount = 0;
+	uint				allocateFileCount = 0;
+	uint				cloneFileCount = 0;
+	uint				sparseCopyCount = 0;
+	uint				mapFileCount = 0;
+	uint				copyFileRangeCount = 0;
+	uint				ioRingCopyCount = 0;
+	uint				ioRingMaxQueueDepth = 0;
+	u64					ioRingBatchTime = 0;
+	uint				ioRingBatchCount = 0;
+	uint				ioRingBatchFileCount = 0;
 };
 
 
@@ -255,8 +306,50 @@ enum AccessType
 struct					NoCaseWStringLess { bool operator()(const WString& a, const WString& b) const { return lessIgnoreCase(a.c_str(), b.c_str()); } };
 using					FilesSet = Set<WString, NoCaseWStringLess>;
 
+// Wildcard pattern compiled once and then matched against many names. Same rules as PathMatchSpec, * and ? are wildcards,
+// matching is case insensitive and ';' separates alternatives. Common forms (*, exact name, prefix*, *.ext) skip generic matching
+class WildcardMatcher
+{
+public:
+						WildcardMatcher(const wchar_t* pattern = L"*.*");
+	bool				match(const wchar_t* name) const;
+	bool				matchesAll() const { return m_kind == Kind_All; }
+
+	enum Kind : u8		{ Kind_All, Kind_Exact, Kind_Prefix, Kind_Suffix, Kind_Generic };
+	Kind				getKind() const { return m_kind; }
+	const WString&		getPattern() const { return m_pattern; }
+
+private:
+	Kind				m_kind;
+	WString				m_pattern; // Literal part for exact/prefix/suffix. Full pattern for generic
+};
+bool					matchWildcard(const wchar_t* name, const wchar_t* pattern); // Matching without compiling, used for one-off matches
+
+// Many wildcard patterns compiled in to one matcher so a match costs O(name length) instead of O(patterns * name length).
+// Exact names and prefixes are found by walking a trie from start of name, suffixes by walking a trie from end of name.
+// Only patterns that are none of these are matched one by one
+class WildcardSetMatcher
+{
+public:
+	void				add(const wchar_t* pattern);
+	bool				match(const wchar_t* name) const;
+	bool				empty() const { return !m_matchAll && m_forward.size() <= 1 && m_backward.size() <= 1 && m_generic.empty(); }
+
+private:
+	struct				Node { Vector<std::pair<wchar_t, uint>> children; bool exact = false; bool any = false; }; // Children sorted on lower case char. 'any' matches regardless of rest of name
+	static Node&		insert(Vector<Node>& trie, const wchar_t* str, const wchar_t* strEnd, bool reverse);
+	static const Node*	findChild(const Vector<Node>& trie, const Node& node, wchar_t c);
+
+	bool				m_matchAll = false;
+	Vector<Node>		m_forward = Vector<Node>(1); // Exact and prefix patterns. Root at index zero
+	Vector<Node>		m_backward = Vector<Node>(1); // Suffix patterns, reversed
+	Vector<WildcardMatcher> m_generic;
+};
+
 enum					UseBufferedIO { UseBufferedIO_Auto, UseBufferedIO_Enabled, UseBufferedIO_Disabled };
 bool					getUseBufferedIO(UseBufferedIO use, u64 fileSize);
+enum					UseMappedIO { UseMappedIO_Auto, UseMappedIO_Enabled, UseMappedIO_Disabled };
+bool					getUseMappedIO(UseMappedIO use, u64 fileSize);
 
 uint					getFileInfo(FileInfo& outInfo, const wchar_t* fullFileName, IOStats& ioStats);
 bool					getFileHash(Hash& outHash, const wchar_t* fullFileName, CopyContext& copyContext, IOStats& ioStats, HashContext& hashContext, u64& hashTime);
@@ -271,13 +364,31 @@ bool					writeFile(const wchar_t* fullPath, FileHandle& file, const void* data,
 bool					readFile(const wchar_t* fullPath, FileHandle& file, void* destData, u64 toRead, u64& read, IOStats& ioStats);
 bool					setFileLastWriteTime(const wchar_t* fullPath, FileHandle& file, FileTime lastWriteTime, IOStats& ioStats);
 bool					setFilePosition(const wchar_t* fullPath, FileHandle& file, u64 position, IOStats& ioStats);
+bool					allocateFile(const wchar_t* fullPath, FileHandle& file, u64 fileSize, IOStats& ioStats); // Only fails when there is not enough space for file
+bool					isSparseFile(const wchar_t* fullPath, IOStats& ioStats);
+bool					getFileExtents(const wchar_t* fullPath, FileHandle& file, u64 fileSize, Vector<FileExtent>& outExtents, IOStats& ioStats); // Data extents in file. Whole file is one extent if file system can't tell
+bool					getFileLocation(const wchar_t* fullPath, bool usePhysicalOffset, u64& outLocation, IOStats& ioStats); // File id (inode) or physical offset of first extent. Used to sort reads on rotational storage. Fails silently
+bool					setFileSparse(const wchar_t* fullPath, FileHandle& file, u64 fileSize, IOStats& ioStats); // Empties file and sets its size. Everything not written afterwards is a hole
+bool					mapFileRead(const wchar_t* fullPath, FileHandle& file, u64 fileSize, const u8*& outData, IOStats& ioStats); // Fails silently, caller is expected to fall back to readFile
+void					unmapFile(const u8* data, u64 fileSize);
 bool					closeFile(const wchar_t* fullPath, FileHandle& file, AccessType accessType, IOStats& ioStats);
 bool					createFile(const wchar_t* fullPath, const FileInfo& info, const void* data, IOStats& ioStats, bool useBufferedIO, bool hidden = false);
 bool					createFileLink(const wchar_t* fullPath, const FileInfo& info, const wchar_t* sourcePath, bool& outSkip, IOStats& ioStats, bool deleteAndRetry = true);
-bool					copyFile(const wchar_t* source, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, IOStats& ioStats, UseBufferedIO useBufferedIO);
-bool					copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttributes, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, CopyContext& copyContext, IOStats& ioStats, UseBufferedIO useBufferedIO);
+bool					cloneFileData(const wchar_t* fullPath, const wchar_t* sourcePath, IOStats& ioStats); // Makes existing file share data with source (reflink). Content must already be the same. Fails silently when not supported
+bool					supportsFileCloning(const wchar_t* directory); // Probes with two scratch files if file system of directory supports cloneFileData
+bool					copyFile(const wchar_t* source, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, IOStats& ioStats, UseBufferedIO useBufferedIO, uint ioRingQueueDepth = 0, UseMappedIO useMappedIO = UseMappedIO_Auto, bool useTempFile = false);
+bool					copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttributes, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, CopyContext& copyContext, IOStats& ioStats, UseBufferedIO useBufferedIO, uint ioRingQueueDepth = 0, UseMappedIO useMappedIO = UseMappedIO_Auto, bool useTempFile = false); // useTempFile writes to dot prefixed temp file next to dest, flushes it and moves it in place when complete
+struct					SmallFileCopyEntry { const wchar_t* source; const wchar_t* dest; FileInfo sourceInfo; bool success; bool existed; };
+bool					copySmallFiles(SmallFileCopyEntry* entries, uint entryCount, CopyContext& copyContext, IOStats& ioStats); // Returns false if not supported. Entries without success must be copied with copyFile
+struct					FanOutCopyEntry { const wchar_t* dest; bool success; bool detached; u64 written; };
+bool					copyFileFanOut(const wchar_t* source, const FileInfo& sourceInfo, FanOutCopyEntry* entries, uint entryCount, CopyContext& copyContext, IOStats& ioStats, bool useTempFile = false); // Reads source once and writes it to all entries. Entries falling behind are detached. Entries without success must be copied with copyFile
+bool					createFileWithSize(const wchar_t* fullPath, u64 fileSize, IOStats& ioStats); // Creates or truncates file and sets its size so parts can be written in any order
+bool					copyFilePart(const wchar_t* source, const wchar_t* dest, u64 offset, u64 size, CopyContext& copyContext, IOStats& ioStats); // Dest must exist. Safe to call from multiple threads on same files
 bool					deleteFile(const wchar_t* fullPath, IOStats& ioStats, bool errorOnMissingFile = true);
-bool					moveFile(const wchar_t* source, const wchar_t* dest, IOStats& ioStats);
+bool					moveFile(const wchar_t* source, const wchar_t* dest, IOStats& ioStats, bool failIfExists = false, bool* outExisted = nullptr); // failIfExists is atomic, dest is never replaced
+void					getTempFileName(WString& outTempFileName, const wchar_t* fullPath); // Dot prefixed file in same directory as fullPath, so it can be moved in place without copying. Unique per process and thread
+bool					flushFile(const wchar_t* fullPath, IOStats& ioStats); // Flushes written data and metadata of closed file to disk. Done on temp files before they are moved in place
+bool					getDeviceId(const wchar_t* path, u64& outDeviceId, IOStats& ioStats); // Id of device (volume) that path is stored on. Path must exist
 bool					setFileWritable(const wchar_t* fullPath, bool writable);
 bool					setFileHidden(const wchar_t* fullPath, bool hidden);
 void					convertSlashToBackslash(wchar_t* path);
@@ -349,6 +460,64 @@ public:
 
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// ScanCache - Directory listings from previous run. A directory with the same last write time as when it was listed
+// has the same entries so listing can be reused instead of enumerating the directory again. Note that file content can
+// change without changing directory write time so this is only valid for trees where files are replaced, not modified
+
+class ScanCache
+{
+public:
+	struct			Entry { WString name; FileInfo info; uint attributes = 0; };
+	using			Entries = Vector<Entry>;
+
+	const Entries*	getEntries(const WString& directory, const FileTime& lastWriteTime); // Returns null if directory is not in cache or has changed
+	const Entries*	addEntries(const WString& directory, const FileTime& lastWriteTime, Entries&& entries); // Returns null if directory was already visited with other write time
+	uint			getDirectoryCount();
+
+	void			readFile(const wchar_t* fullPath, IOStats& ioStats);
+	bool			writeFile(const wchar_t* fullPath, IOStats& ioStats); // Written to temp file that replaces fullPath when complete
+
+private:
+	bool			writeEntries(const wchar_t* fullPath, IOStats& ioStats);
+
+	struct			DirRec { FileTime lastWriteTime; Entries entries; bool used = false; bool visited = false; }; // Entries of visited records are never replaced since other threads might iterate them
+
+	CriticalSection	m_cs;
+	Map<WString, DirRec> m_dirs; // Case sensitive since linux paths are
+};
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CopyTuner - Measures throughput of the first copies of a run and converges on chunk size and io_uring queue depth
+
+class CopyTuner
+{
+public:
+	void			init(uint chunkSize, bool tuneChunkSize, uint ioRingQueueDepth, bool tuneIoRingQueueDepth); // Nothing is measured unless one of the tune flags is set
+
+	bool			begin(u64 fileSize, uint& outChunkSize, uint& outIoRingQueueDepth); // Returns true if copy should be measured and reported back with end
+	void			end(uint chunkSize, uint ioRingQueueDepth, u64 size, u64 time);
+
+	uint			getChunkSize();
+	uint			getIoRingQueueDepth();
+
+private:
+	enum			Phase { Phase_ChunkSize, Phase_IoRingQueueDepth, Phase_Done };
+	struct			Sample { u64 size = 0; u64 time = 0; };
+
+	CriticalSection	m_cs;
+	Phase			m_phase = Phase_Done;
+	uint			m_candidateIndex = 0;
+	Sample			m_samples[8];
+	uint			m_chunkSize = 0;
+	uint			m_ioRingQueueDepth = 0;
+	bool			m_tuneIoRingQueueDepth = false;
+};
+
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Hash
 
@@ -372,6 +541,7 @@ public:
 	~HashBuilder();
 
 	bool add(u8* data, u64 size);
+	bool addZeros(u64 size); // For holes in sparse files
 	bool getHash(Hash& outHash);
 
 	HashContext& m_context;
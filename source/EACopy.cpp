@@ -34,6 +34,16 @@ void printHelp()
 	logInfoLinef(L"            /LEV:n :: only copy the top n LEVels of the source directory tree.");
 	logInfoLinef(L"                /J :: Enable unbuffered I/O for all files.");
 	logInfoLinef(L"               /NJ :: Disable unbuffered I/O for all files.");
+	logInfoLinef(L"             /MMAP :: Read all files through memory mappings.");
+	logInfoLinef(L"            /NMMAP :: Never read files through memory mappings.");
+	logInfoLinef(L"           /ATOMIC :: write files to temp name and move them in place when done.");
+	logInfoLinef(L"                      Each file is flushed to disk before it is moved.");
+	logInfoLinef(L"       /VERIFY[:J] :: VERIFY each copied file against source (J to read unbuffered).");
+	logInfoLinef(L"           /DEDUPE :: make identical copied files share data when done (reflink, needs Btrfs or XFS).");
+	logInfoLinef(L"   /SCANCACHE file :: reuse listings of source directories unchanged since last run from file.");
+	logInfoLinef(L"                      Only valid for sources where files are replaced, not modified in place.");
+	logInfoLinef(L"       /WATCH[:ms] :: keep running and copy files as they change in source until ctrl-c (linux only).");
+	logInfoLinef(L"                      Files are copied when they had no changes for ms (default 500).");
 	logInfoLinef();
 	logInfoLinef(L"            /PURGE :: delete dest files/dirs that no longer exist in source.");
     logInfoLinef(L"              /MIR :: MIRror a directory tree (equivalent to /E plus /PURGE).");
@@ -49,12 +59,16 @@ void printHelp()
 	logInfoLinef(L"/XD dir [dir]...   :: eXclude Directories matching given names/paths/wildcards.");
 	logInfoLinef(L"/XF file [file]... :: eXclude Files matching given names/paths/wildcards.");
 	logInfoLinef(L"/OF file [file]... :: Optional Files matching given names/paths/wildcards. Only used for FileLists.");
+	logInfoLinef(L"/DEST dir [dir]... :: additional DESTinations. Source files are read once and written to all.");
+	logInfoLinef(L"                      A destination falling behind is copied on its own. Server is not used.");
 	logInfoLinef();
 	logInfoLinef(L"   /IA:[RASHCNETO] :: Include only files with any of the given Attributes set.");
 	logInfoLinef(L"   /XA:[RASHCNETO] :: eXclude files with any of the given Attributes set.");
 	logInfoLinef();
 	logInfoLinef(L"           /MT[:n] :: do multi-threaded copies with n threads (default 8).");
 	logInfoLinef(L"                      n must be at least 1 and not greater than 128.");
+	logInfoLinef(L"          /DEVMT:n :: copy at most n files at the same time per source/dest device.");
+	logInfoLinef(L"                      Threads pick files on other devices while a device is busy.");
 	logInfoLinef();
 	logInfoLinef(L"         /NOSERVER :: will not try to connect to Server.");
 	logInfoLinef(L"           /SERVER :: must connect to Server. Fails copy if not succeed");
@@ -75,6 +89,13 @@ void printHelp()
 	logInfoLinef(L"       /LINKBYNAME :: Will link based on name only and skip relative path.");
 	logInfoLinef(L"          /OFFLOAD :: when link fails it will try using odx between link source and dest.");
 	logInfoLinef(L"       /SYSTEMCOPY :: copy files using ::CopyFile instead of an hand-rolled read->write loop.");
+	logInfoLinef(L"   /SPLITMIN:bytes :: copy files bigger than bytes in parts using all threads (local copies only).");
+	logInfoLinef(L"      /IOURING[:n] :: copy large files using io_uring with n reads/writes in flight. Linux only.");
+	logInfoLinef(L"                      n must be at least 1 and not greater than %u (default %u).", MaxIoRingQueueDepth, DefaultIoRingQueueDepth);
+	logInfoLinef(L"          /CHUNK:n :: read/write/send files in chunks of n kilobytes.");
+	logInfoLinef(L"             /TUNE :: measure the first large files copied to pick chunk size and io_uring depth not set explicitly.");
+	logInfoLinef(L"      /ORDER:[I|P] :: copy files in batches sorted by Inode/file id or Physical location of source.");
+	logInfoLinef(L"                      Makes reads closer to sequential on rotational storage.");
 	logInfoLinef();
 	logInfoLinef(L"/DCOPY:copyflag[s] :: what to COPY for directories (default is /DCOPY:DA).");
 	logInfoLinef(L"                      (copyflags : D=Data, A=Attributes, T=Timestamps).");
@@ -178,6 +199,31 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 		{
 			outSettings.useBufferedIO = UseBufferedIO_Disabled;
 		}
+		else if (equalsIgnoreCase(arg, L"/MMAP"))
+		{
+			outSettings.useMappedIO = UseMappedIO_Enabled;
+		}
+		else if (equalsIgnoreCase(arg, L"/NMMAP"))
+		{
+			outSettings.useMappedIO = UseMappedIO_Disabled;
+		}
+		else if (equalsIgnoreCase(arg, L"/ATOMIC"))
+		{
+			outSettings.useTempFiles = true;
+		}
+		else if (equalsIgnoreCase(arg, L"/VERIFY"))
+		{
+			outSettings.verifyCopies = true;
+		}
+		else if (equalsIgnoreCase(arg, L"/VERIFY:J"))
+		{
+			outSettings.verifyCopies = true;
+			outSettings.verifyBufferedIO = UseBufferedIO_Disabled;
+		}
+		else if (equalsIgnoreCase(arg, L"/DEDUPE"))
+		{
+			outSettings.dedupeDestination = true;
+		}
 		else if (equalsIgnoreCase(arg, L"/PURGE"))
 		{
 			outSettings.purgeDestination = true;
@@ -221,6 +267,10 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 			if (arg[3] == ':')
 				outSettings.threadCount = max(0, wtoi(arg + 4) - 1);
 		}
+		else if (startsWithIgnoreCase(arg, L"/DEVMT:"))
+		{
+			outSettings.deviceConcurrency = max(1, wtoi(arg + 7));
+		}
 		else if (equalsIgnoreCase(arg, L"/NOSERVER"))
 		{
 			outSettings.useServer = UseServer_Disabled;
@@ -284,6 +334,23 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 		{
 			activeCommand = L"OF";
 		}
+		else if (equalsIgnoreCase(arg, L"/DEST"))
+		{
+			activeCommand = L"DEST";
+		}
+		else if (equalsIgnoreCase(arg, L"/WATCH"))
+		{
+			outSettings.watchSource = true;
+		}
+		else if (startsWithIgnoreCase(arg, L"/WATCH:"))
+		{
+			outSettings.watchSource = true;
+			outSettings.watchDebounceMs = wtoi(arg + 7);
+		}
+		else if (equalsIgnoreCase(arg, L"/SCANCACHE"))
+		{
+			activeCommand = L"SCANCACHE";
+		}
 		else if (equalsIgnoreCase(arg, L"/LINK"))
 		{
 			if (outSettings.useLinksThreshold == ~u64(0))
@@ -312,6 +379,33 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 		{
 			outSettings.useSystemCopy = true;
 		}
+		else if (startsWithIgnoreCase(arg, L"/SPLITMIN:"))
+		{
+			outSettings.splitFileThreshold = wcstoull(arg + 10, nullptr, 10);
+		}
+		else if (startsWithIgnoreCase(arg, L"/IOURING"))
+		{
+			outSettings.ioRingQueueDepth = DefaultIoRingQueueDepth;
+			outSettings.tuneIoRingQueueDepth = arg[8] != ':';
+			if (arg[8] == ':')
+				outSettings.ioRingQueueDepth = min(max(wtoi(arg + 9), 1), int(MaxIoRingQueueDepth));
+		}
+		else if (startsWithIgnoreCase(arg, L"/CHUNK:"))
+		{
+			outSettings.copyChunkSize = uint(min(max(wtoi(arg + 7), 64), int(CopyContextBufferSize/1024)) * 1024) & ~4095u;
+		}
+		else if (equalsIgnoreCase(arg, L"/TUNE"))
+		{
+			outSettings.useCopyTuner = true;
+		}
+		else if (equalsIgnoreCase(arg, L"/ORDER:I"))
+		{
+			outSettings.copyOrder = CopyOrder_FileId;
+		}
+		else if (equalsIgnoreCase(arg, L"/ORDER:P"))
+		{
+			outSettings.copyOrder = CopyOrder_PhysicalOffset;
+		}
 		else if (startsWithIgnoreCase(arg, L"/DCOPY:"))
 		{
 			outSettings.dirCopyFlags = 0;
@@ -404,6 +498,10 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 			{
 				outSettings.excludeWildcardDirectories.push_back(arg);
 			}
+			else if (equalsIgnoreCase(activeCommand, L"DEST"))
+			{
+				outSettings.additionalDestDirectories.push_back(getCleanedupPath(arg));
+			}
 			else if (equalsIgnoreCase(activeCommand, L"link"))
 			{
 				outSettings.additionalLinkDirectories.push_back(getCleanedupPath(arg));
@@ -412,6 +510,10 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 			{
 				outSettings.linkDatabaseFile = arg;
 			}
+			else if (equalsIgnoreCase(activeCommand, L"SCANCACHE"))
+			{
+				outSettings.scanCacheFile = arg;
+			}
 			else if (equalsIgnoreCase(activeCommand, L"OF"))
 			{
 				outSettings.optionalWildcards.push_back(arg);
@@ -447,6 +549,8 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 		outSettings.sourceDirectory = optimizeUncPath(outSettings.sourceDirectory.c_str(), temp, outSettings.useServer != UseServer_Required);
 		#ifndef _DEBUG
 		outSettings.destDirectory = optimizeUncPath(outSettings.destDirectory.c_str(), temp, outSettings.useServer != UseServer_Required);
+		for (WString& dir : outSettings.additionalDestDirectories)
+			dir = optimizeUncPath(dir.c_str(), temp, outSettings.useServer != UseServer_Required);
 		for (WString& dir : outSettings.additionalLinkDirectories)
 			dir = optimizeUncPath(dir.c_str(), temp, outSettings.useServer != UseServer_Required);
 		#endif
@@ -545,6 +649,8 @@ int main(int argc, char* argv_[])
 		logInfoLinef();
 		logInfoLinef(L"  Source : %ls", settings.sourceDirectory.c_str());
 		logInfoLinef(L"    Dest : %ls", settings.destDirectory.c_str());
+		for (auto& dir : settings.additionalDestDirectories)
+			logInfoLinef(L"           %ls", dir.c_str());
 		if (options.length() > (LogBufferSize - 20))
 		{
 			WString optionsSubStr = options.substr(0, (LogBufferSize - 20));
@@ -564,6 +670,8 @@ int main(int argc, char* argv_[])
 	}
 
 	Client client(settings);
+	if (settings.watchSource)
+		client.stopWatchOnSignal(); // Ctrl-C ends watch and prints summary
 
 	ClientStats stats;
 	int res = client.process(log, stats);
@@ -586,7 +694,7 @@ int main(int argc, char* argv_[])
 		// Report results
 		logInfoLinef(L"                 Total    Copied    Linked   Skipped  Mismatch    FAILED    Extras");
 		//logInfoLinef(L"    Dirs:      %7i   %7i   %7i   %7i   %7i   %7i", 1, 2, 3, 4, 5, 6);
-		logInfoLinef(L"   Files:      %7i   %7i   %7i   %7i   %7i   %7i   %7i", totalCount, stats.copyCount, stats.linkCount, stats.skipCount, 0, stats.failCount, stats.createDirCount);
+		logInfoLinef(L"   Files:      %7i   %7i   %7i   %7i   %7i   %7i   %7i", totalCount, stats.copyCount, stats.linkCount, stats.skipCount, stats.verifyFailCount, stats.failCount, stats.createDirCount);
 		logInfoLinef(L"   Bytes:     %ls  %ls  %ls  %ls   %7i   %7i   %7i", toPretty(totalSize, 7).c_str(), toPretty(stats.copySize, 7).c_str(), toPretty(stats.linkSize, 7).c_str(), toPretty(stats.skipSize, 7).c_str(), 0, 0, 0);
 		logInfoLinef(L"   Times:     %ls  %ls  %ls  %ls  %ls  %ls  %ls", toHourMinSec(totalTime, 7).c_str(), toHourMinSec(stats.copyTime, 7).c_str(), toHourMinSec(stats.linkTime, 7).c_str(), toHourMinSec(stats.skipTime, 7).c_str(), toHourMinSec(0, 7).c_str(), toHourMinSec(0, 7).c_str(), toHourMinSec(stats.ioStats.createDirTime, 7).c_str());
 
@@ -607,6 +715,10 @@ int main(int argc, char* argv_[])
 		populateStatsTime(statsVec, L"DecompressFile", stats.decompressTime, 0);
 		populateStatsTime(statsVec, L"DeltaCompress", stats.deltaCompressionTime, 0);
 		populateStatsTime(statsVec, L"HashCalc", stats.hashTime, stats.hashCount);
+		populateStatsTime(statsVec, L"VerifyFile", stats.verifyTime, stats.verifyCount);
+		populateStatsBytes(statsVec, L"VerifyBytes", stats.verifySize);
+		populateStatsTime(statsVec, L"DedupeFile", stats.dedupeTime, stats.dedupeCount);
+		populateStatsBytes(statsVec, L"DedupeBytes", stats.dedupeSize);
 		populateStatsTime(statsVec, L"PurgeDir", stats.purgeTime, 0);
 		populateStatsTime(statsVec, L"NetSecretGuid", stats.netSecretGuid, 0);
 		populateStatsTime(statsVec, L"NetResponseCopy", stats.netWriteResponseTime[WriteResponse_Copy], stats.netWriteResponseCount[WriteResponse_Copy]);
@@ -621,6 +733,20 @@ int main(int argc, char* argv_[])
 		populateStatsTime(statsVec, L"NetFileInfo", stats.netFileInfoTime, stats.netFileInfoCount);
 		populateStatsTime(statsVec, L"ReadLinkDb", stats.readLinkDbTime, stats.readLinkDbEntries);
 		populateStatsTime(statsVec, L"WriteLinkDb", stats.writeLinkDbTime, stats.writeLinkDbEntries);
+		populateStatsTime(statsVec, L"ReadScanCache", stats.readScanCacheTime, stats.readScanCacheEntries);
+		populateStatsTime(statsVec, L"WriteScanCache", stats.writeScanCacheTime, stats.writeScanCacheEntries);
+		populateStatsValue(statsVec, L"ScanCacheHits", uint(stats.scanCacheHitCount));
+		if (settings.watchSource)
+		{
+			populateStatsValue(statsVec, L"WatchEvents", uint(stats.watchEventCount));
+			populateStatsValue(statsVec, L"WatchRescans", uint(stats.watchRescanCount));
+			populateStatsTime(statsVec, L"WatchLatency", stats.watchLatencyTime, stats.watchCopyCount);
+			populateStatsTime(statsVec, L"WatchMaxLatency", stats.watchMaxLatency, 0);
+		}
+		if (stats.chunkSize)
+			populateStatsBytes(statsVec, L"ChunkSize", stats.chunkSize);
+		if (stats.ioRingQueueDepth)
+			populateStatsValue(statsVec, L"IoRingDepth", stats.ioRingQueueDepth);
 		populateStatsTime(statsVec, L"RETRY", stats.retryTime, stats.retryCount);
 
 		logInfoLinef();
@@ -1,6 +1,7 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #include "EACopyClient.h"
+#include <algorithm>
 #include <assert.h>
 #include <utility>
 #if defined(_WIN32)
@@ -17,6 +18,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #endif
 #if defined(EACOPY_ALLOW_RSYNC)
 #include <EACopyRsync.h>
@@ -26,21 +30,10 @@
 #include "EACopyDelta.h"
 #endif
 
-#if defined(_WIN32)
-#pragma comment (lib, "Shlwapi.lib") // PathMatchSpecW
-#endif
-
 #if defined(_WIN32)
 #else
 #define TIMEVAL timeval
 namespace eacopy {
-bool PathMatchSpecW(const wchar_t* file, const wchar_t* spec)
-{
-	if (wcscmp(spec, "*.*") == 0)
-		return true;
-	EACOPY_NOT_IMPLEMENTED
-	return false;
-}
 enum : int { FindExSearchNameMatch, FindExInfoStandard };
 bool RemoveDirectoryW(const wchar_t* dir);
 #define WSAHOST_NOT_FOUND                11001L
@@ -63,9 +56,55 @@ namespace eacopy
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+enum { SplitFilePartSize = 64 * 1024 * 1024 };
+enum { WatchPollTimeMs = 50, WatchIdleSleepMs = 10, WatchEventBufferSize = 64 * 1024 };
+
+thread_local uint t_dirQueueIndex; // Index into m_dirQueues for the thread that is currently traversing
+
+struct Client::SplitFile
+{
+	CriticalSection		cs;
+	WString				fullDst;
+	WString				writeDst; // Same as fullDst unless temp files are used. Then it is moved to fullDst once all parts are written
+	uint				partsLeft = 0;
+	bool				failed = false;
+	bool				useLinks = false;
+	u64					startTime = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 Client::Client(const ClientSettings& settings)
 :	m_settings(settings)
 {
+	for (auto& wildcard : settings.excludeWildcards)
+		m_excludeWildcards.add(wildcard.c_str());
+	for (auto& wildcard : settings.excludeWildcardDirectories)
+		m_excludeWildcardDirectories.add(wildcard.c_str());
+	for (auto& wildcard : settings.optionalWildcards)
+		m_optionalWildcards.add(wildcard.c_str());
+}
+
+#if !defined(_WIN32)
+std::atomic<Client*> g_stopWatchSignalClient; // Set by stopWatchOnSignal
+
+void stopWatchSignalHandler(int)
+{
+	if (Client* client = g_stopWatchSignalClient.load())
+		client->stopWatch();
+}
+#endif
+
+Client::~Client()
+{
+	#if !defined(_WIN32)
+	Client* self = this;
+	if (g_stopWatchSignalClient.compare_exchange_strong(self, nullptr))
+	{
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+	}
+	#endif
 }
 
 int
@@ -99,6 +138,22 @@ Client::process(Log& log, ClientStats& outStats)
 	if (destDir.size() < 5 || destDir[0] != '\\' || destDir[1] != '\\')
 		m_useDestServerFailed = true;
 
+	// Files written to multiple destinations are read once here and written to all of them, server can't help with that
+	if (!m_settings.additionalDestDirectories.empty())
+		m_useDestServerFailed = true;
+
+	// Reading source once only pays off when destinations would be written with a plain read/write loop anyway. Fan-out
+	// writes are buffered and not cloned, so it is not used when io_uring, unbuffered or mapped io is asked for. Nor on
+	// linux when a destination is on the same device as source, FICLONE/copy_file_range can then copy without reading
+	int destCount = 1 + int(m_settings.additionalDestDirectories.size());
+	m_useFanOut = destCount > 1 && !m_settings.ioRingQueueDepth && m_settings.useBufferedIO != UseBufferedIO_Disabled && m_settings.useMappedIO != UseMappedIO_Enabled;
+	#if !defined(_WIN32)
+	if (m_useFanOut)
+		if (uint srcDevice = getDeviceIndex(sourceDir, outStats.ioStats))
+			for (int destIndex=0; destIndex!=destCount && m_useFanOut; ++destIndex)
+				m_useFanOut = getDeviceIndex(getDestDirectory(destIndex), outStats.ioStats) != srcDevice;
+	#endif
+
 	// Try to connect to server (can fail to connect and still return true if settings allow it to fail)
 	if (!connectToServer(destDir.c_str(), true, m_destConnection, m_useDestServerFailed, outStats))
 		return -1;
@@ -113,6 +168,12 @@ Client::process(Log& log, ClientStats& outStats)
 	for (auto& primeDir : m_settings.additionalLinkDirectories)
 		m_fileDatabase.primeDirectory(primeDir, outStats.ioStats, m_settings.useLinksRelativePath, false);
 
+	// Spawn verify thread that will read back copied files while the worker threads move on to the next ones
+	ClientStats verifyStats;
+	Thread verifier;
+	if (m_settings.verifyCopies)
+		verifier.start([&]() -> int { return verifyThread(verifyStats); });
+
 	// Spawn worker threads that will copy the files
 	struct WorkerThreadData { ClientStats stats; Client* client = nullptr; uint connectionIndex = 0; };
 	Vector<WorkerThreadData> workerThreadDataList(m_settings.threadCount);
@@ -136,6 +197,12 @@ Client::process(Log& log, ClientStats& outStats)
 		m_workDone.set();
 		for (auto& thread : workerThreadList)
 			thread.wait();
+
+		// No more files will be queued for verification, let verify thread drain the queue and finish
+		m_copyDone.set();
+		m_verifyEntriesCs.scoped([&]() { m_verifyEntriesQueued.set(); });
+		if (m_settings.verifyCopies)
+			verifier.wait();
 	});
 
 	// Connect to source if no destination is set
@@ -144,6 +211,30 @@ Client::process(Log& log, ClientStats& outStats)
 			return -1;
 	ScopeGuard sourceConnectionCleanup([&] { delete m_sourceConnection; m_sourceConnection = nullptr; });
 
+	// Watches are added while traversing, so it must be possible to add them before first pass starts
+	if (m_settings.watchSource)
+	{
+		if (isValid(m_sourceConnection) || !m_settings.filesOrWildcardsFiles.empty())
+		{
+			logErrorf(L"Watching source is only supported for local source directories and not together with file lists");
+			return -1;
+		}
+		#if defined(_WIN32)
+		logErrorf(L"Watching source is not supported on this platform");
+		return -1;
+		#else
+		m_watchHandle = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_watchHandle == -1)
+		{
+			logErrorf(L"Failed to create inotify instance: %ls", getErrorText(errno).c_str());
+			return -1;
+		}
+		#endif
+	}
+	#if !defined(_WIN32)
+	ScopeGuard watchHandleCleanup([this]() { if (m_watchHandle != -1) close(m_watchHandle); m_watchHandle = -1; });
+	#endif
+
 	// Collect exclusions provided through file
 	for (auto& file : m_settings.filesExcludeFiles)
 		if (!excludeFilesFromFile(logContext, outStats, sourceDir, file, destDir))
@@ -159,7 +250,19 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.readLinkDbEntries = m_fileDatabase.getHistorySize();
 	}
 
+	if (!m_settings.scanCacheFile.empty())
 	{
+		TimerScope _(outStats.readScanCacheTime);
+		m_scanCache.readFile(m_settings.scanCacheFile.c_str(), outStats.ioStats);
+		outStats.readScanCacheEntries = m_scanCache.getDirectoryCount();
+	}
+
+	{
+		// Count this traversal as active dir processing so ordered copy entries are not flushed before it is done
+		t_dirQueueIndex = 0;
+		++m_processDirActive;
+		ScopeGuard processDirGuard([&]() { --m_processDirActive; });
+
 		// Traverse through and collect all files that needs copying (worker threads will handle copying). This code will also generate destination directories needed.
 		if (!m_settings.filesOrWildcardsFiles.empty())
 		{
@@ -181,6 +284,9 @@ Client::process(Log& log, ClientStats& outStats)
 	// Process dirs and files (worker threads are doing the same right now)
 	processQueues(logContext, m_sourceConnection, m_destConnection, m_copyContext, outStats, true);
 	
+	// Keep copying files as they change in source. Worker threads are still alive and help out
+	if (m_watchHandle != -1 && !logContext.getLastError())
+		watchSourceChanges(logContext, outStats);
 
 	// Wait for all worker threads to finish
 	waitThreadsGuard.execute();
@@ -198,6 +304,18 @@ Client::process(Log& log, ClientStats& outStats)
 		if (threadExitCode != 0)
 			return threadExitCode;
 	}
+	if (m_settings.verifyCopies)
+	{
+		uint threadExitCode;
+		if (!verifier.getExitCode(threadExitCode))
+			return -1;
+		if (threadExitCode != 0)
+			return threadExitCode;
+	}
+
+	// Make identical files written by this job share data
+	if (m_settings.dedupeDestination)
+		dedupeWrittenFiles(outStats);
 
 	// If purge feature is enabled.. traverse destination and remove unwanted files/directories
 	if (m_settings.purgeDestination)
@@ -242,6 +360,14 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.writeLinkDbEntries = m_fileDatabase.getHistorySize();
 	}
 
+	// Scan cache is only written when all directories were traversed, a partial cache would be fine but failures are rare
+	if (!m_settings.scanCacheFile.empty() && !logContext.getLastError())
+	{
+		TimerScope _(outStats.writeScanCacheTime);
+		m_scanCache.writeFile(m_settings.scanCacheFile.c_str(), outStats.ioStats);
+		outStats.writeScanCacheEntries = m_scanCache.getDirectoryCount();
+	}
+
 	// Merge stats from all threads
 	for (auto& threadData : workerThreadDataList)
 	{
@@ -286,6 +412,7 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.netCreateDirCount += threadStats.netCreateDirCount;
 		outStats.netFileInfoTime += threadStats.netFileInfoTime;
 		outStats.netFileInfoCount += threadStats.netFileInfoCount;
+		outStats.scanCacheHitCount += threadStats.scanCacheHitCount;
 		outStats.ioStats.createReadTime += threadStats.ioStats.createReadTime;
 		outStats.ioStats.closeReadTime += threadStats.ioStats.closeReadTime;
 		outStats.ioStats.closeReadCount += threadStats.ioStats.closeReadCount;
@@ -304,6 +431,8 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.ioStats.deleteFileCount += threadStats.ioStats.deleteFileCount;
 		outStats.ioStats.moveFileTime += threadStats.ioStats.moveFileTime;
 		outStats.ioStats.moveFileCount += threadStats.ioStats.moveFileCount;
+		outStats.ioStats.flushFileTime += threadStats.ioStats.flushFileTime;
+		outStats.ioStats.flushFileCount += threadStats.ioStats.flushFileCount;
 		outStats.ioStats.createLinkTime += threadStats.ioStats.createLinkTime;
 		outStats.ioStats.createLinkCount += threadStats.ioStats.createLinkCount;
 		outStats.ioStats.setLastWriteTime += threadStats.ioStats.setLastWriteTime;
@@ -316,8 +445,42 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.ioStats.createDirTime += threadStats.ioStats.createDirTime;
 		outStats.ioStats.copyFileCount += threadStats.ioStats.copyFileCount;
 		outStats.ioStats.copyFileTime += threadStats.ioStats.copyFileTime;
+		outStats.ioStats.allocateFileCount += threadStats.ioStats.allocateFileCount;
+		outStats.ioStats.allocateFileTime += threadStats.ioStats.allocateFileTime;
+		outStats.ioStats.cloneFileCount += threadStats.ioStats.cloneFileCount;
+		outStats.ioStats.cloneFileTime += threadStats.ioStats.cloneFileTime;
+		outStats.ioStats.sparseCopyCount += threadStats.ioStats.sparseCopyCount;
+		outStats.ioStats.sparseCopyTime += threadStats.ioStats.sparseCopyTime;
+		outStats.ioStats.mapFileCount += threadStats.ioStats.mapFileCount;
+		outStats.ioStats.mapFileTime += threadStats.ioStats.mapFileTime;
+		outStats.ioStats.copyFileRangeCount += threadStats.ioStats.copyFileRangeCount;
+		outStats.ioStats.copyFileRangeTime += threadStats.ioStats.copyFileRangeTime;
+		outStats.ioStats.ioRingCopyCount += threadStats.ioStats.ioRingCopyCount;
+		outStats.ioStats.ioRingCopyTime += threadStats.ioStats.ioRingCopyTime;
+		outStats.ioStats.ioRingSubmitCount += threadStats.ioStats.ioRingSubmitCount;
+		outStats.ioStats.ioRingQueueDepthSum += threadStats.ioStats.ioRingQueueDepthSum;
+		outStats.ioStats.ioRingMaxQueueDepth = max(outStats.ioStats.ioRingMaxQueueDepth, threadStats.ioStats.ioRingMaxQueueDepth);
+		outStats.ioStats.ioRingBatchTime += threadStats.ioStats.ioRingBatchTime;
+		outStats.ioStats.ioRingBatchCount += threadStats.ioStats.ioRingBatchCount;
+		outStats.ioStats.ioRingBatchFileCount += threadStats.ioStats.ioRingBatchFileCount;
 	}
 
+	// Merge stats from verify thread
+	outStats.verifyCount = verifyStats.verifyCount;
+	outStats.verifySize = verifyStats.verifySize;
+	outStats.verifyTime = verifyStats.verifyTime;
+	outStats.verifyFailCount = verifyStats.verifyFailCount;
+	outStats.ioStats.createReadTime += verifyStats.ioStats.createReadTime;
+	outStats.ioStats.createReadCount += verifyStats.ioStats.createReadCount;
+	outStats.ioStats.readTime += verifyStats.ioStats.readTime;
+	outStats.ioStats.readCount += verifyStats.ioStats.readCount;
+	outStats.ioStats.closeReadTime += verifyStats.ioStats.closeReadTime;
+	outStats.ioStats.closeReadCount += verifyStats.ioStats.closeReadCount;
+
+	outStats.chunkSize = m_copyTuner.getChunkSize();
+	outStats.ioRingQueueDepth = m_copyTuner.getIoRingQueueDepth();
+	outStats.deviceMaxActive = m_deviceMaxActive;
+
 	outStats.compressionAverageLevel = outStats.copySize ? (float)((double)outStats.compressionLevelSum / outStats.copySize) : 0;
 
 	outStats.destServerUsed =  m_settings.useServer != UseServer_Disabled && !m_useDestServerFailed;
@@ -370,6 +533,26 @@ Client::reportServerStatus(Log& log)
 	return 0;
 }
 
+void
+Client::stopWatch()
+{
+	m_watchStop = true;
+}
+
+void
+Client::stopWatchOnSignal()
+{
+	#if !defined(_WIN32)
+	g_stopWatchSignalClient = this;
+	struct sigaction action = {};
+	action.sa_handler = stopWatchSignalHandler;
+	action.sa_flags = SA_RESETHAND; // Second signal uses default handler, for when first pass takes too long
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+	#endif
+}
+
 void
 Client::resetWorkState(Log& log)
 {
@@ -377,17 +560,37 @@ Client::resetWorkState(Log& log)
 	m_useSourceServerFailed = false;
 	m_useDestServerFailed = false;
 	m_workDone.reset();
+	m_copyDone.reset();
+	m_verifyEntriesQueued.reset();
 	m_tryCopyFirst = true;
 	m_networkInitDone = false;
 	m_networkServerName.clear();
 	m_copyEntries.clear();
+	m_orderEntries.clear();
+	m_verifyEntries.clear();
+	m_writtenFiles.clear();
+	m_destDirSnapshots.clear();
 	m_handledFiles.clear();
+	m_watchDirs.clear();
+	m_watchHandle = -1;
+	m_watching = false;
+	m_watchStop = false;
 	m_createdDirs.clear();
 	m_sourceConnection = nullptr;
 	m_destConnection = nullptr;
 	m_secretGuid = {0};
 
 	m_processDirActive = 0;
+	Vector<DirQueue>(m_settings.threadCount + 1).swap(m_dirQueues);
+	m_processOrderActive = 0;
+	m_processFileActive = 0;
+	m_deviceDirectories.clear();
+	m_deviceIndices.clear();
+	m_deviceActive.assign(1, 0);
+	m_deviceMaxActive = 0;
+	m_deviceReleaseCount = 0;
+
+	m_copyTuner.init(m_settings.copyChunkSize, m_settings.useCopyTuner && !m_settings.copyChunkSize, m_settings.ioRingQueueDepth, m_settings.useCopyTuner && m_settings.tuneIoRingQueueDepth);
 
 	// These are used for when sending files to server with compression enabled
 	m_compressionStats.fixedLevel = m_settings.compressionLevel != 255;
@@ -397,26 +600,39 @@ Client::resetWorkState(Log& log)
 bool
 Client::processDir(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats)
 {
-	// Pop first entry off the queue (and increase active count to point out that something is being processed)
+	// Take newest entry from our own queue (depth first keeps directory handles and caches warm).
+	// If empty, steal oldest entry from other queues since those are most likely to have the largest subtrees left
+	// Active count was increased when entry was queued and is not decreased until entry is fully processed
 	DirEntry entry;
-	m_dirEntriesCs.scoped([&]()
-		{
-			if (!m_dirEntries.empty())
+	uint queueCount = uint(m_dirQueues.size());
+	uint queueIndex = t_dirQueueIndex;
+	for (uint i=0; i!=queueCount && entry.destDir.empty(); ++i)
+	{
+		DirQueue& queue = m_dirQueues[(queueIndex + i) % queueCount];
+		queue.cs.scoped([&]()
 			{
-				entry = std::move(m_dirEntries.front());
-				m_dirEntries.pop_front();
-				++m_processDirActive;
-			}
-		});
+				if (queue.entries.empty())
+					return;
+				if (i == 0)
+				{
+					entry = std::move(queue.entries.back());
+					queue.entries.pop_back();
+				}
+				else
+				{
+					entry = std::move(queue.entries.front());
+					queue.entries.pop_front();
+				}
+			});
+	}
 
 	// If no new entry queued
 	if (entry.destDir.empty())
 		return false;
 
-
 	traverseFilesInDirectory(logContext, sourceConnection, destConnection, copyContext, entry.sourceDir, entry.destDir, entry.wildcard, entry.depthLeft, stats);
 
-	m_dirEntriesCs.scoped([&]() { --m_processDirActive; } );
+	--m_processDirActive;
 
 	return true;
 }
@@ -424,17 +640,43 @@ Client::processDir(LogContext& logContext, Connection* sourceConnection, Connect
 bool
 Client::processFile(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats)
 {
-	// Pop first entry off the queue
+	uint deviceReleaseCount = 0;
+	if (m_settings.deviceConcurrency)
+		m_devicesCs.scoped([&]() { deviceReleaseCount = m_deviceReleaseCount; });
+
+	// Pop first entry off the queue that has spare capacity on its devices
 	CopyEntry entry;
+	bool devicesFull = false;
 	m_copyEntriesCs.scoped([&]()
 		{
-			if (!m_copyEntries.empty())
+			uint searchCount = 0;
+			for (auto it=m_copyEntries.begin(); it!=m_copyEntries.end() && searchCount != DeviceQueueSearchCount; ++it, ++searchCount)
 			{
-				entry = std::move(m_copyEntries.front());
-				m_copyEntries.pop_front();
+				if (!acquireDevices(*it))
+					continue;
+				entry = std::move(*it);
+				m_copyEntries.erase(it);
+				++m_processFileActive;
+				break;
 			}
+			devicesFull = entry.src.empty() && !m_copyEntries.empty();
 		});
 
+	if (devicesFull)
+	{
+		// Queued files are all on devices at their limit. Wait for one to be released instead of looking through the queue again
+		bool wait = false;
+		m_devicesCs.scoped([&]()
+			{
+				wait = deviceReleaseCount == m_deviceReleaseCount;
+				if (wait)
+					m_deviceReleased.reset();
+			});
+		if (wait)
+			m_deviceReleased.isSet(DeviceWaitMs);
+		return false;
+	}
+
 	// If no new entry queued, sleep a bit and return in order to try again
 	if (entry.src.empty())
 	{
@@ -442,10 +684,47 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 		return false;
 	}
 
+	ScopeGuard activeGuard([&]()
+		{
+			releaseDevices(entry);
+			m_copyEntriesCs.scoped([&]() { --m_processFileActive; });
+		});
+	return processFile(logContext, sourceConnection, destConnection, copyContext, entry, stats);
+}
+
+bool
+Client::processFile(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats)
+{
+	if (entry.split)
+		return processFilePart(logContext, copyContext, entry, stats);
+
 	bool useLinks = entry.srcInfo.fileSize >= m_settings.useLinksThreshold;
 
+	// Additional destinations are written in the same pass as destDirectory when it is a plain local copy. Otherwise they are copied one by one
+	if (entry.destIndex == -1 && !m_settings.additionalDestDirectories.empty())
+	{
+		if (m_useFanOut && !useLinks && !m_settings.useOdx && !m_settings.useSystemCopy && !isValid(sourceConnection) && entry.srcInfo.fileSize < m_settings.splitFileThreshold)
+			return processFileFanOut(logContext, copyContext, entry, stats);
+		queueDestinations(entry, 1);
+		entry.destIndex = 0;
+	}
+
+	// Additional destinations are always written locally
+	if (entry.destIndex > 0)
+	{
+		sourceConnection = nullptr;
+		destConnection = nullptr;
+	}
+
 	// Get full destination path
-	WString fullDst = m_settings.destDirectory + entry.dst;
+	WString fullDst = getDestDirectory(entry.destIndex) + entry.dst;
+
+	// Let tuner pick chunk size and queue depth for this copy and report back how fast it was
+	uint ioRingQueueDepth;
+	u64 tuneStartTime = getTime();
+	u64 tuneStartSize = stats.copySize;
+	bool tune = m_copyTuner.begin(entry.srcInfo.fileSize, copyContext.chunkSize, ioRingQueueDepth);
+	ScopeGuard tuneGuard([&]() { if (tune) m_copyTuner.end(copyContext.chunkSize, ioRingQueueDepth, stats.copySize - tuneStartSize, getTime() - tuneStartTime); });
 	 
 	// Try to copy file
 	int retryCountLeft = m_settings.retryCount;
@@ -531,13 +810,14 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 					bool existed = false;
 					u64 written;
 					bool failIfExists = m_settings.excludeChangedFiles;
-					if (copyFile(dbFile.name.c_str(), entry.srcInfo, attributes, fullDst.c_str(), useSystemCopy, failIfExists, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
+					if (copyFile(dbFile.name.c_str(), entry.srcInfo, attributes, fullDst.c_str(), useSystemCopy, failIfExists, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO, ioRingQueueDepth, m_settings.useMappedIO, m_settings.useTempFiles))
 					{
 						stats.copyTime += getTime() - startTime;
 						++stats.copyCount;
 						stats.copySize += written;
 
 						m_fileDatabase.addToFilesHistory(key, dbFile.hash, fullDst);
+						queueWrittenFile(entry, fullDst);
 						return true;
 					}
 					else
@@ -564,6 +844,8 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 					(linked ? stats.linkTime : stats.copyTime) += getTime() - startTime;
 					++(linked ? stats.linkCount : stats.copyCount);
 					(linked ? stats.linkSize : stats.copySize) += written;
+					if (!linked)
+						queueWrittenFile(entry, fullDst);
 				}
 				else
 				{
@@ -591,6 +873,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 					stats.copyTime += getTime() - startTime;
 					++stats.copyCount;
 					stats.copySize += size;
+					queueWrittenFile(entry, fullDst);
 				}
 				else
 				{
@@ -632,11 +915,37 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			bool existed = false;
 			u64 written;
 
+			// Huge files are split in to parts that are copied in parallel by all workers. Last part to finish will set time and report file
+			if (entry.srcInfo.fileSize >= m_settings.splitFileThreshold && entry.srcInfo.fileSize > SplitFilePartSize && !useSystemCopy)
+			{
+				FileInfo destInfo;
+				uint fileAttributes = getDestFileInfo(destInfo, fullDst, stats.ioStats);
+				if (fileAttributes && (m_settings.excludeChangedFiles || (!m_settings.forceCopy && equals(entry.srcInfo, destInfo))))
+				{
+					addToDatabase();
+					reportSkip();
+					return true;
+				}
+
+				if (fileAttributes & FILE_ATTRIBUTE_READONLY)
+					setFileWritable(fullDst.c_str(), true);
+
+				WString writeDst = fullDst;
+				if (m_settings.useTempFiles)
+					getTempFileName(writeDst, fullDst.c_str());
+
+				if (createFileWithSize(writeDst.c_str(), entry.srcInfo.fileSize, stats.ioStats))
+				{
+					queueFileParts(entry, fullDst, writeDst, useLinks, startTime);
+					return true;
+				}
+			}
+
 			// Try to copy file first without checking if it is there (we optimize for copying new files)
 			if (tryCopyFirst)
 			{
 				bool failIfExists = true;
-				if (copyFile(entry.src.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, failIfExists, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
+				if (copyFile(entry.src.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, failIfExists, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO, ioRingQueueDepth, m_settings.useMappedIO, m_settings.useTempFiles))
 				{
 					if (m_settings.logProgress)
 						logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
@@ -645,6 +954,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 					stats.copySize += written;
 
 					addToDatabase();
+					queueWrittenFile(entry, fullDst);
 					return true;
 				}
 
@@ -669,7 +979,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			if (existed || !tryCopyFirst)
 			{
 				FileInfo destInfo;
-				uint fileAttributes = getFileInfo(destInfo, fullDst.c_str(), stats.ioStats);
+				uint fileAttributes = getDestFileInfo(destInfo, fullDst, stats.ioStats);
 
 				// If no file attributes it might be that the file doesnt exist
 				if (!fileAttributes)
@@ -696,7 +1006,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 						logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", fullDst.c_str());
 				}
 				
-				if (copyFile(entry.src.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, false, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
+				if (copyFile(entry.src.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, false, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO, ioRingQueueDepth, m_settings.useMappedIO, m_settings.useTempFiles))
 				{
 					if (m_settings.logProgress)
 						logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
@@ -706,6 +1016,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 					stats.copySize += written;
 
 					addToDatabase();
+					queueWrittenFile(entry, fullDst);
 					return true;
 				}
 			}
@@ -730,6 +1041,272 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 	return true;
 }
 
+bool
+Client::processFileFanOut(LogContext& logContext, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats)
+{
+	u64 startTime = getTime();
+
+	// Find destinations that need the file
+	int destCount = 1 + int(m_settings.additionalDestDirectories.size());
+	Vector<WString> fullDsts;
+	Vector<int> destIndices;
+	fullDsts.reserve(destCount);
+	for (int destIndex=0; destIndex!=destCount; ++destIndex)
+	{
+		WString fullDst = getDestDirectory(destIndex) + entry.dst;
+		FileInfo destInfo;
+		uint fileAttributes = getDestFileInfo(destInfo, fullDst, stats.ioStats);
+		if (fileAttributes && (m_settings.excludeChangedFiles || (!m_settings.forceCopy && equals(entry.srcInfo, destInfo))))
+		{
+			++stats.skipCount;
+			stats.skipSize += entry.srcInfo.fileSize;
+			continue;
+		}
+		if (fileAttributes & FILE_ATTRIBUTE_READONLY)
+			setFileWritable(fullDst.c_str(), true);
+		fullDsts.push_back(std::move(fullDst));
+		destIndices.push_back(destIndex);
+	}
+
+	if (fullDsts.empty())
+	{
+		if (m_settings.logProgress)
+			logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(entry.src));
+		stats.skipTime += getTime() - startTime;
+		return true;
+	}
+
+	Vector<FanOutCopyEntry> copyEntries(fullDsts.size());
+	for (uint i=0; i!=fullDsts.size(); ++i)
+		copyEntries[i] = { fullDsts[i].c_str(), false, false, 0 };
+
+	copyFileFanOut(entry.src.c_str(), entry.srcInfo, copyEntries.data(), uint(copyEntries.size()), copyContext, stats.ioStats, m_settings.useTempFiles);
+	stats.copyTime += getTime() - startTime;
+
+	// Destinations that failed or fell behind are queued and copied on their own (with retries and error reporting)
+	bool logged = false;
+	for (uint i=0; i!=copyEntries.size(); ++i)
+	{
+		if (copyEntries[i].success)
+		{
+			if (m_settings.logProgress && !logged)
+				logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
+			logged = true;
+			++stats.copyCount;
+			stats.copySize += copyEntries[i].written;
+			queueWrittenFile(entry, fullDsts[i]);
+			continue;
+		}
+
+		if (copyEntries[i].detached)
+			logDebugLinef(L"Detached %ls from fan-out copy since it fell behind", fullDsts[i].c_str());
+		logContext.resetLastError();
+		CopyEntry destEntry = entry;
+		destEntry.destIndex = destIndices[i];
+		m_copyEntriesCs.scoped([&]() { m_copyEntries.push_back(std::move(destEntry)); });
+	}
+	return true;
+}
+
+void
+Client::queueDestinations(const CopyEntry& entry, int firstDestIndex)
+{
+	int destCount = 1 + int(m_settings.additionalDestDirectories.size());
+	ScopedCriticalSection cs(m_copyEntriesCs);
+	for (int destIndex=firstDestIndex; destIndex!=destCount; ++destIndex)
+	{
+		m_copyEntries.push_back(entry);
+		m_copyEntries.back().destIndex = destIndex;
+	}
+}
+
+bool
+Client::processFilePart(LogContext& logContext, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats)
+{
+	SplitFile& split = *entry.split;
+	u64 partSize = min(u64(SplitFilePartSize), entry.srcInfo.fileSize - entry.partOffset);
+	copyContext.chunkSize = m_copyTuner.getChunkSize();
+
+	bool success = false;
+	int retryCountLeft = m_settings.retryCount;
+	while (true)
+	{
+		u64 startTime = getTime();
+		if (copyFilePart(entry.src.c_str(), split.writeDst.c_str(), entry.partOffset, partSize, copyContext, stats.ioStats))
+		{
+			success = true;
+			break;
+		}
+
+		if (retryCountLeft-- == 0)
+			break;
+
+		// Reset last error and try again!
+		logContext.resetLastError();
+		logInfoLinef(L"Warning - failed to copy part of file %ls to %ls, retrying in %i seconds", entry.src.c_str(), split.fullDst.c_str(), m_settings.retryWaitTimeMs/1000);
+		Sleep(m_settings.retryWaitTimeMs);
+
+		++stats.retryCount;
+		stats.retryTime += getTime() - startTime;
+	}
+
+	bool isLastPart = false;
+	split.cs.scoped([&]() { split.failed |= !success; isLastPart = --split.partsLeft == 0; });
+	if (!isLastPart)
+		return true;
+
+	ScopeGuard splitGuard([&]() { delete &split; });
+
+	// Source might have been rewritten while parts were copied. Dest would then be a mix of old and new content with
+	// the old write time, and later runs would skip it
+	if (!split.failed)
+	{
+		FileInfo sourceInfo;
+		if (!getFileInfo(sourceInfo, entry.src.c_str(), stats.ioStats) || sourceInfo.fileSize != entry.srcInfo.fileSize || memcmp(&sourceInfo.lastWriteTime, &entry.srcInfo.lastWriteTime, sizeof(FileTime)) != 0)
+		{
+			logErrorf(L"Fail reading file %ls: File was changed while being copied", entry.src.c_str());
+			split.failed = true;
+		}
+	}
+
+	// All parts are written, now it is safe to set last write time
+	if (!split.failed)
+	{
+		FileHandle file;
+		if (openFileWrite(split.writeDst.c_str(), file, stats.ioStats, true, nullptr, false, false))
+		{
+			split.failed = !setFileLastWriteTime(split.writeDst.c_str(), file, entry.srcInfo.lastWriteTime, stats.ioStats);
+			split.failed |= !closeFile(split.writeDst.c_str(), file, AccessType_Write, stats.ioStats);
+		}
+		else
+			split.failed = true;
+	}
+
+	if (!split.failed && split.writeDst != split.fullDst)
+		split.failed = !flushFile(split.writeDst.c_str(), stats.ioStats) || !moveFile(split.writeDst.c_str(), split.fullDst.c_str(), stats.ioStats);
+
+	if (split.failed)
+	{
+		++stats.failCount;
+		logErrorf(L"failed to copy file (%ls)", entry.src.c_str());
+		deleteFile(split.writeDst.c_str(), stats.ioStats, false); // Don't leave a file with correct size but wrong content behind
+		return true;
+	}
+
+	if (m_settings.logProgress)
+		logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
+	stats.copyTime += getTime() - split.startTime;
+	++stats.copyCount;
+	stats.copySize += entry.srcInfo.fileSize;
+	queueWrittenFile(entry, split.fullDst);
+
+	if (split.useLinks)
+	{
+		FileKey key{ getFileKeyPath(entry.dst), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize }; // Robocopy style key for uniqueness of file
+		m_fileDatabase.addToFilesHistory(key, Hash(), split.fullDst);
+	}
+	return true;
+}
+
+void
+Client::queueFileParts(const CopyEntry& entry, const WString& fullDst, const WString& writeDst, bool useLinks, u64 startTime)
+{
+	uint partCount = uint((entry.srcInfo.fileSize + SplitFilePartSize - 1) / SplitFilePartSize);
+
+	SplitFile* split = new SplitFile();
+	split->fullDst = fullDst;
+	split->writeDst = writeDst;
+	split->partsLeft = partCount;
+	split->useLinks = useLinks;
+	split->startTime = startTime;
+
+	// Put parts first in queue so idle workers pick them up right away
+	ScopedCriticalSection cs(m_copyEntriesCs);
+	for (uint i=partCount; i!=0; --i)
+	{
+		CopyEntry part = entry;
+		part.split = split;
+		part.partOffset = u64(i - 1) * SplitFilePartSize;
+		m_copyEntries.push_front(std::move(part));
+	}
+}
+
+bool
+Client::processSmallFiles(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats, uint& outProcessedCount)
+{
+	// Small files are only batched when copying locally to one destination using io_uring and destination files are expected to be new
+	if (!m_settings.ioRingQueueDepth || isValid(sourceConnection) || isValid(destConnection) || m_settings.useOdx || m_settings.useSystemCopy || m_settings.useTempFiles || !m_tryCopyFirst || !m_settings.additionalDestDirectories.empty())
+		return false;
+
+	// Pop small entries off the front of the queue. Stop at first entry that needs to go through the normal path
+	CopyEntry entries[SmallFileBatchCount];
+	uint entryCount = 0;
+	m_copyEntriesCs.scoped([&]()
+		{
+			while (entryCount != SmallFileBatchCount && !m_copyEntries.empty())
+			{
+				CopyEntry& front = m_copyEntries.front();
+				if (front.srcInfo.fileSize > SmallFileMaxSize || front.srcInfo.fileSize >= m_settings.useLinksThreshold)
+					break;
+				// Whole batch counts as one file in flight on the devices of the first entry
+				if (entryCount == 0 ? !acquireDevices(front) : (front.srcDevice != entries[0].srcDevice || front.dstDevice != entries[0].dstDevice))
+					break;
+				entries[entryCount++] = std::move(front);
+				m_copyEntries.pop_front();
+			}
+			if (entryCount)
+				++m_processFileActive;
+		});
+
+	if (entryCount == 0)
+		return false;
+
+	ScopeGuard activeGuard([&]()
+		{
+			releaseDevices(entries[0]);
+			m_copyEntriesCs.scoped([&]() { --m_processFileActive; });
+		});
+	outProcessedCount = entryCount;
+
+	if (entryCount == 1)
+		return processFile(logContext, sourceConnection, destConnection, copyContext, entries[0], stats);
+
+	u64 startTime = getTime();
+
+	WString fullDsts[SmallFileBatchCount];
+	SmallFileCopyEntry copyEntries[SmallFileBatchCount];
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		fullDsts[i] = getDestDirectory(entries[i].destIndex) + entries[i].dst;
+		copyEntries[i] = { entries[i].src.c_str(), fullDsts[i].c_str(), entries[i].srcInfo, false, false };
+	}
+
+	bool batched = copySmallFiles(copyEntries, entryCount, copyContext, stats.ioStats);
+	stats.copyTime += getTime() - startTime;
+
+	// Everything that didn't make it through the batch goes through the normal path which handles skipping, retries and errors
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		CopyEntry& entry = entries[i];
+		if (batched && copyEntries[i].success)
+		{
+			if (m_settings.logProgress)
+				logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
+			++stats.copyCount;
+			stats.copySize += entry.srcInfo.fileSize;
+			queueWrittenFile(entry, fullDsts[i]);
+			continue;
+		}
+
+		if (copyEntries[i].existed && !m_settings.excludeChangedFiles)
+			m_tryCopyFirst = false; // Same as in processFile, there are most likely more files in destination
+
+		processFile(logContext, sourceConnection, destConnection, copyContext, entry, stats);
+	}
+
+	return true;
+}
+
 bool
 Client::connectToServer(const wchar_t* networkPath, uint connectionIndex, Connection*& outConnection, bool& failedToConnect, ClientStats& stats)
 {
@@ -761,67 +1338,456 @@ Client::processQueues(LogContext& logContext, Connection* sourceConnection, Conn
 	IOStats ioStats;
 	uint filesProcessedCount = 0;
 
-	// Process file queue
-	while (!m_workDone.isSet(0))
+	// Process file queue
+	while (!m_workDone.isSet(0))
+	{
+		if (m_fileDatabase.primeUpdate(stats.ioStats))
+			continue;
+		if (processDir(logContext, sourceConnection, destConnection, copyContext, stats))
+			continue;
+		if (processOrderEntries(stats))
+			continue;
+		uint smallFilesProcessedCount = 0;
+		if (processSmallFiles(logContext, sourceConnection, destConnection, copyContext, stats, smallFilesProcessedCount))
+		{
+			filesProcessedCount += smallFilesProcessedCount;
+			continue;
+		}
+		if (processFile(logContext, sourceConnection, destConnection, copyContext, stats))
+		{
+			++filesProcessedCount;
+			continue;
+		}
+
+		// If this is the main thread we check if we can leave processing
+		if (!isMainThread)
+		{
+			// Don't spin while waiting for watch events, nothing is queued until main thread flushes them
+			if (m_watching)
+				Sleep(WatchIdleSleepMs);
+			continue;
+		}
+
+		{
+			// If there are no queued or active dir processing in any thread there is no way to add more file entries. (counter is
+			// increased before a dir entry is queued and decreased after the entry has queued all its files)
+			if (m_processDirActive)
+				continue;
+		}
+
+		{
+			// Files waiting to be ordered must be flushed to the copy queue first
+			ScopedCriticalSection cs(m_orderEntriesCs);
+			if (m_processOrderActive || !m_orderEntries.empty())
+				continue;
+		}
+
+		// If there are still copy entries left, keep helping out. 
+		// We can only end up here if dir processing is _fully_ done...
+		// but another thread might just have added the last file entries and m_processDirActive was 0 in the check above
+		// Files being processed can also queue more entries
+		ScopedCriticalSection cs2(m_copyEntriesCs);
+		if (!m_copyEntries.empty() || m_processFileActive)
+			continue;
+
+		break;
+	}
+
+	logDebugLinef(L"Worker done - %u file(s) processed", filesProcessedCount);
+
+	return true;
+}
+
+int
+Client::workerThread(uint connectionIndex, ClientStats& stats)
+{
+	// Try to connect to server (can fail to connect and still return true if settings allow it to fail)
+	Connection* destConnection;
+	if (!connectToServer(m_settings.destDirectory.c_str(), connectionIndex, destConnection, m_useDestServerFailed, stats))
+		return false;
+	ScopeGuard destConnectionGuard([&] { delete destConnection; });
+
+	Connection* sourceConnection = nullptr;
+	if (!destConnection)
+		if (!connectToServer(m_settings.sourceDirectory.c_str(), connectionIndex, sourceConnection, m_useSourceServerFailed, stats))
+			return false;
+	ScopeGuard sourcesConnectionGuard([&] { delete sourceConnection; });
+
+
+	// Help process the files
+	t_dirQueueIndex = connectionIndex;
+	LogContext logContext(*m_log);
+	NetworkCopyContext copyContext;
+	processQueues(logContext, sourceConnection, destConnection, copyContext, stats, false);
+
+	return logContext.getLastError();
+}
+
+bool
+Client::processOrderEntries(ClientStats& stats)
+{
+	if (m_settings.copyOrder == CopyOrder_Discovery)
+		return false;
+
+	// Take a full batch of discovered files. Rest is taken when no more files can be discovered
+	CopyEntries batch;
+	m_orderEntriesCs.scoped([&]()
+		{
+			if (m_orderEntries.empty())
+				return;
+			if (m_orderEntries.size() < CopyOrderBatchCount && m_processDirActive)
+				return;
+			batch.swap(m_orderEntries);
+			++m_processOrderActive;
+		});
+
+	if (batch.empty())
+		return false;
+
+	// Sort on location of source files. Files where location is unknown are kept in discovery order at the end
+	struct OrderEntry { u64 location; CopyEntry* entry; };
+	Vector<OrderEntry> orderEntries;
+	orderEntries.reserve(batch.size());
+	bool usePhysicalOffset = m_settings.copyOrder == CopyOrder_PhysicalOffset;
+	for (auto& entry : batch)
+	{
+		u64 location = ~u64(0);
+		getFileLocation(entry.src.c_str(), usePhysicalOffset, location, stats.ioStats);
+		orderEntries.push_back({ location, &entry });
+	}
+	std::stable_sort(orderEntries.begin(), orderEntries.end(), [](const OrderEntry& a, const OrderEntry& b) { return a.location < b.location; });
+
+	m_copyEntriesCs.scoped([&]()
+		{
+			for (auto& orderEntry : orderEntries)
+				m_copyEntries.push_back(std::move(*orderEntry.entry));
+		});
+
+	m_orderEntriesCs.scoped([&]() { --m_processOrderActive; });
+	return true;
+}
+
+uint
+Client::getDeviceIndex(const WString& directory, IOStats& ioStats)
+{
+	{
+		ScopedCriticalSection cs(m_devicesCs);
+		auto findIt = m_deviceDirectories.find(directory);
+		if (findIt != m_deviceDirectories.end())
+			return findIt->second;
+	}
+
+	// Destination directories might not be created yet. They will end up on the device of their nearest existing parent
+	WString path = directory;
+	u64 deviceId;
+	bool deviceFound;
+	while (!(deviceFound = getDeviceId(path.c_str(), deviceId, ioStats)))
+	{
+		if (path.size() < 2)
+			break;
+		size_t slash = path.find_last_of(L'\\', path.size() - 2);
+		if (slash == WString::npos || slash == 0)
+			break;
+		path.resize(slash + 1);
+	}
+
+	ScopedCriticalSection cs(m_devicesCs);
+	uint index = 0;
+	if (deviceFound)
+	{
+		auto insertRes = m_deviceIndices.insert({ deviceId, uint(m_deviceActive.size()) });
+		if (insertRes.second)
+			m_deviceActive.push_back(0);
+		index = insertRes.first->second;
+	}
+	m_deviceDirectories[directory] = index;
+	return index;
+}
+
+bool
+Client::acquireDevices(const CopyEntry& entry)
+{
+	if (!m_settings.deviceConcurrency)
+		return true;
+
+	// Copies where source and dest are on the same device only count once
+	ScopedCriticalSection cs(m_devicesCs);
+	if (entry.srcDevice && m_deviceActive[entry.srcDevice] >= m_settings.deviceConcurrency)
+		return false;
+	if (entry.dstDevice && m_deviceActive[entry.dstDevice] >= m_settings.deviceConcurrency)
+		return false;
+	++m_deviceActive[entry.srcDevice];
+	if (entry.dstDevice != entry.srcDevice)
+		++m_deviceActive[entry.dstDevice];
+	if (entry.srcDevice)
+		m_deviceMaxActive = max(m_deviceMaxActive, m_deviceActive[entry.srcDevice]);
+	if (entry.dstDevice)
+		m_deviceMaxActive = max(m_deviceMaxActive, m_deviceActive[entry.dstDevice]);
+	return true;
+}
+
+void
+Client::releaseDevices(const CopyEntry& entry)
+{
+	if (!m_settings.deviceConcurrency)
+		return;
+
+	ScopedCriticalSection cs(m_devicesCs);
+	--m_deviceActive[entry.srcDevice];
+	if (entry.dstDevice != entry.srcDevice)
+		--m_deviceActive[entry.dstDevice];
+	++m_deviceReleaseCount;
+	m_deviceReleased.set();
+}
+
+void
+Client::queueWrittenFile(const CopyEntry& entry, const WString& fullDst)
+{
+	if (m_settings.verifyCopies)
+		m_verifyEntriesCs.scoped([&]() { m_verifyEntries.push_back({ entry.src, fullDst, entry.srcInfo.fileSize }); m_verifyEntriesQueued.set(); });
+	if (m_settings.dedupeDestination && entry.srcInfo.fileSize >= DedupeMinFileSize)
+		m_writtenFilesCs.scoped([&]() { m_writtenFiles.push_back({ fullDst, entry.srcInfo, Hash() }); });
+}
+
+int
+Client::verifyThread(ClientStats& stats)
+{
+	LogContext logContext(*m_log);
+	CopyContext copyContext;
+
+	while (true)
+	{
+		bool copyDone = false;
+		VerifyEntry entry;
+		m_verifyEntriesCs.scoped([&]()
+			{
+				if (!m_verifyEntries.empty())
+				{
+					entry = std::move(m_verifyEntries.front());
+					m_verifyEntries.pop_front();
+				}
+				else if (!(copyDone = m_copyDone.isSet(0))) // Checked inside the lock so the set after m_copyDone can't be lost to the reset
+					m_verifyEntriesQueued.reset();
+			});
+
+		if (entry.src.empty())
+		{
+			if (copyDone)
+				break;
+			m_verifyEntriesQueued.isSet(); // Wait for queueWrittenFile or copying to finish
+			continue;
+		}
+
+		++stats.verifyCount;
+		if (!verifyFile(logContext, entry, copyContext, stats))
+			++stats.verifyFailCount;
+	}
+
+	return logContext.getLastError();
+}
+
+bool
+Client::verifyFile(LogContext& logContext, const VerifyEntry& entry, CopyContext& copyContext, ClientStats& stats)
+{
+	TimerScope _(stats.verifyTime);
+
+	// Buffered reads of a file that was just written will most likely be served from the page cache. Unbuffered reads go all the way to the disk
+	bool useBufferedIO = getUseBufferedIO(m_settings.verifyBufferedIO, entry.fileSize);
+
+	FileHandle srcFile;
+	if (!openFileRead(entry.src.c_str(), srcFile, stats.ioStats, useBufferedIO))
+		return false;
+	ScopeGuard srcFileGuard([&]() { closeFile(entry.src.c_str(), srcFile, AccessType_Read, stats.ioStats); });
+
+	FileHandle dstFile;
+	if (!openFileRead(entry.fullDst.c_str(), dstFile, stats.ioStats, useBufferedIO))
+		return false;
+	ScopeGuard dstFileGuard([&]() { closeFile(entry.fullDst.c_str(), dstFile, AccessType_Read, stats.ioStats); });
+
+	while (true)
+	{
+		uint toRead = CopyContextBufferSize;
+		uint toReadAligned = useBufferedIO ? toRead : (((toRead + 4095) / 4096) * 4096);
+
+		u64 srcRead;
+		if (!readFile(entry.src.c_str(), srcFile, copyContext.buffers[0], toReadAligned, srcRead, stats.ioStats))
+			return false;
+		u64 dstRead;
+		if (!readFile(entry.fullDst.c_str(), dstFile, copyContext.buffers[1], toReadAligned, dstRead, stats.ioStats))
+			return false;
+
+		if (srcRead != dstRead || memcmp(copyContext.buffers[0], copyContext.buffers[1], srcRead) != 0)
+		{
+			logErrorf(L"Verification failed, %ls does not match %ls", entry.fullDst.c_str(), entry.src.c_str());
+			return false;
+		}
+
+		if (srcRead == 0)
+			break;
+		stats.verifySize += srcRead;
+	}
+
+	return true;
+}
+
+void
+Client::dedupeWrittenFiles(ClientStats& stats)
+{
+	TimerScope _(stats.dedupeTime);
+
+	if (m_writtenFiles.size() < 2)
+		return;
+
+	// Only reflinks are used (see below). Destinations on file systems without them are skipped before anything is hashed
+	Vector<const WString*> cloneDestDirs;
+	for (int destIndex=0, destCount=1+int(m_settings.additionalDestDirectories.size()); destIndex!=destCount; ++destIndex)
+	{
+		const WString& destDir = getDestDirectory(destIndex);
+		if (supportsFileCloning(destDir.c_str()))
+			cloneDestDirs.push_back(&destDir);
+		else
+			logInfoLinef(L"Warning - Dedupe skipped for %ls, file system does not support reflinks", destDir.c_str());
+	}
+	if (cloneDestDirs.empty())
+		return;
+	auto supportsCloning = [&](const WString& fullDst)
+	{
+		for (auto destDir : cloneDestDirs)
+			if (fullDst.compare(0, destDir->size(), *destDir) == 0)
+				return true;
+		return false;
+	};
+
+	// Only files sharing size with another file can be duplicates
+	Map<u64, uint> sizeCounts;
+	for (auto& file : m_writtenFiles)
+		if (supportsCloning(file.fullDst))
+			++sizeCounts[file.info.fileSize];
+	Vector<WrittenFile*> candidates;
+	for (auto& file : m_writtenFiles)
+		if (sizeCounts[file.info.fileSize] > 1 && supportsCloning(file.fullDst))
+			candidates.push_back(&file);
+	if (candidates.empty())
+		return;
+
+	// Io stats of pool threads are merged into stats when threads are done
+	struct DedupeThreadData { Thread thread; IOStats ioStats; u64 hashTime = 0; u64 hashCount = 0; u64 dedupeCount = 0; u64 dedupeSize = 0; };
+	auto mergeIoStats = [&](const IOStats& threadIoStats)
+	{
+		stats.ioStats.createReadTime += threadIoStats.createReadTime;
+		stats.ioStats.createReadCount += threadIoStats.createReadCount;
+		stats.ioStats.readTime += threadIoStats.readTime;
+		stats.ioStats.readCount += threadIoStats.readCount;
+		stats.ioStats.closeReadTime += threadIoStats.closeReadTime;
+		stats.ioStats.closeReadCount += threadIoStats.closeReadCount;
+		stats.ioStats.cloneFileTime += threadIoStats.cloneFileTime;
+		stats.ioStats.cloneFileCount += threadIoStats.cloneFileCount;
+	};
+
+	// Hash candidates using a pool of threads. Files that fail to hash are left alone
+	Vector<DedupeThreadData> hashThreads(min(max(m_settings.threadCount, 1u), uint(candidates.size())));
+	std::atomic<uint> candidateIndex(0);
+	for (auto& threadData : hashThreads)
 	{
-		if (m_fileDatabase.primeUpdate(stats.ioStats))
-			continue;
-		if (processDir(logContext, sourceConnection, destConnection, copyContext, stats))
-			continue;
-		if (processFile(logContext, sourceConnection, destConnection, copyContext, stats))
-		{
-			++filesProcessedCount;
-			continue;
-		}
+		threadData.thread.start([&]() -> int
+			{
+				LogContext logContext(*m_log);
+				CopyContext copyContext;
+				HashContext hashContext(threadData.hashTime, threadData.hashCount);
+				for (uint index = candidateIndex++; index < candidates.size(); index = candidateIndex++)
+				{
+					WrittenFile& file = *candidates[index];
+					if (!getFileHash(file.hash, file.fullDst.c_str(), copyContext, threadData.ioStats, hashContext, threadData.hashTime))
+						file.hash = Hash();
+				}
+				return 0;
+			});
+	}
+	for (auto& threadData : hashThreads)
+	{
+		threadData.thread.wait();
+		stats.hashTime += threadData.hashTime;
+		stats.hashCount += threadData.hashCount;
+		mergeIoStats(threadData.ioStats);
+	}
 
-		// If this is the main thread we check if we can leave processing
-		if (!isMainThread)
+	// Duplicates are made to share data with first file of same size and hash. Only reflinks are used, writes to one of
+	// the files later on leave the other intact. Hard links would make a later write to one file show up in both
+	Vector<std::pair<WrittenFile*, WrittenFile*>> duplicates; // Duplicate and its original
+	Map<std::pair<u64, Hash>, WrittenFile*> originals;
+	for (WrittenFile* file : candidates)
+	{
+		if (!eacopy::isValid(file->hash))
 			continue;
+		auto insertRes = originals.insert({ { file->info.fileSize, file->hash }, file });
+		if (!insertRes.second)
+			duplicates.push_back({ file, insertRes.first->second });
+	}
+	if (duplicates.empty())
+		return;
 
-		{
-			// If there are no active dir processing in any thread plus dir entries are empty there is no way to add more file entries. (all calls are protected by locks)
-			ScopedCriticalSection cs(m_dirEntriesCs);
-			if (m_processDirActive || !m_dirEntries.empty())
-				continue;
-		}
+	// Compare and clone duplicates using a pool of threads. Originals are only read so several duplicates of one original can run at the same time
+	Vector<DedupeThreadData> cloneThreads(min(max(m_settings.threadCount, 1u), uint(duplicates.size())));
+	std::atomic<uint> duplicateIndex(0);
+	for (auto& threadData : cloneThreads)
+	{
+		threadData.thread.start([&]() -> int
+			{
+				LogContext logContext(*m_log);
+				CopyContext copyContext;
+				for (uint index = duplicateIndex++; index < duplicates.size(); index = duplicateIndex++)
+				{
+					WrittenFile& file = *duplicates[index].first;
+					WrittenFile& original = *duplicates[index].second;
 
-		// If there are still copy entries left, keep helping out. 
-		// We can only end up here if dir processing is _fully_ done...
-		// but another thread might just have added the last file entries and m_dirEntries were empty and m_processDirActive was 0 in the check above
-		ScopedCriticalSection cs2(m_copyEntriesCs);
-		if (!m_copyEntries.empty())
-			continue;
+					// Hash match is not proof of same content
+					if (!isContentEqual(file.fullDst, original.fullDst, copyContext, threadData.ioStats))
+						continue;
 
-		break;
+					if (!cloneFileData(file.fullDst.c_str(), original.fullDst.c_str(), threadData.ioStats))
+						continue;
+					logDebugLinef(L"Dedupe File %ls (same as %ls)", file.fullDst.c_str(), original.fullDst.c_str());
+					++threadData.dedupeCount;
+					threadData.dedupeSize += file.info.fileSize;
+				}
+				return 0;
+			});
+	}
+	for (auto& threadData : cloneThreads)
+	{
+		threadData.thread.wait();
+		stats.dedupeCount += threadData.dedupeCount;
+		stats.dedupeSize += threadData.dedupeSize;
+		mergeIoStats(threadData.ioStats);
 	}
-
-	logDebugLinef(L"Worker done - %u file(s) processed", filesProcessedCount);
-
-	return true;
 }
 
-int
-Client::workerThread(uint connectionIndex, ClientStats& stats)
+bool
+Client::isContentEqual(const WString& fileA, const WString& fileB, CopyContext& copyContext, IOStats& ioStats)
 {
-	// Try to connect to server (can fail to connect and still return true if settings allow it to fail)
-	Connection* destConnection;
-	if (!connectToServer(m_settings.destDirectory.c_str(), connectionIndex, destConnection, m_useDestServerFailed, stats))
+	FileHandle fileHandleA;
+	if (!openFileRead(fileA.c_str(), fileHandleA, ioStats, true))
 		return false;
-	ScopeGuard destConnectionGuard([&] { delete destConnection; });
-
-	Connection* sourceConnection = nullptr;
-	if (!destConnection)
-		if (!connectToServer(m_settings.sourceDirectory.c_str(), connectionIndex, sourceConnection, m_useSourceServerFailed, stats))
-			return false;
-	ScopeGuard sourcesConnectionGuard([&] { delete sourceConnection; });
-
+	ScopeGuard fileGuardA([&]() { closeFile(fileA.c_str(), fileHandleA, AccessType_Read, ioStats); });
 
-	// Help process the files
-	LogContext logContext(*m_log);
-	NetworkCopyContext copyContext;
-	processQueues(logContext, sourceConnection, destConnection, copyContext, stats, false);
+	FileHandle fileHandleB;
+	if (!openFileRead(fileB.c_str(), fileHandleB, ioStats, true))
+		return false;
+	ScopeGuard fileGuardB([&]() { closeFile(fileB.c_str(), fileHandleB, AccessType_Read, ioStats); });
 
-	return logContext.getLastError();
+	while (true)
+	{
+		u64 readA;
+		if (!readFile(fileA.c_str(), fileHandleA, copyContext.buffers[0], CopyContextBufferSize, readA, ioStats))
+			return false;
+		u64 readB;
+		if (!readFile(fileB.c_str(), fileHandleB, copyContext.buffers[1], CopyContextBufferSize, readB, ioStats))
+			return false;
+		if (readA != readB || memcmp(copyContext.buffers[0], copyContext.buffers[1], readA) != 0)
+			return false;
+		if (readA == 0)
+			return true;
+	}
 }
 
 bool
@@ -861,6 +1827,14 @@ Client::addDirectoryToHandledFiles(LogContext& logContext, Connection* destConne
 					++stats.retryCount;
 				}
 				++stats.createDirCount;
+
+				// Additional destinations need the same directory
+				for (auto& additionalDestDir : m_settings.additionalDestDirectories)
+				{
+					WString additionalDestPath = additionalDestDir + (destFullPath2.c_str() + m_settings.destDirectory.size());
+					if (!ensureDirectory(nullptr, additionalDestPath, attributes, stats.ioStats))
+						return false;
+				}
 			}
 			first = false;
 			if (destPath.empty())
@@ -891,9 +1865,8 @@ Client::handleFile(LogContext& logContext, Connection* destConnection, const WSt
 	WString destFullPath = destPath + destFileName;
 
 	// Check if file should be excluded because of wild cards
-	for (auto& excludeWildcard : m_settings.excludeWildcards)
-		if (PathMatchSpecW(destFullPath.c_str(), excludeWildcard.c_str()))
-			return true;
+	if (m_excludeWildcards.match(destFullPath.c_str()))
+		return true;
 
 	// This is the path of the dest file relative root directory
 	WString destFile = destFullPath.c_str() + m_settings.destDirectory.size();
@@ -912,14 +1885,28 @@ Client::handleFile(LogContext& logContext, Connection* destConnection, const WSt
 		return false;
 	WString srcFile = sourcePath + fileName;
 
-	// Add entry (workers will pick this up as soon as possible )
-	ScopedCriticalSection cs(m_copyEntriesCs);
-	m_copyEntries.push_back(CopyEntry());
-	auto& entry = m_copyEntries.back();
+	// Look up devices while traversing so workers can pick files on devices with spare capacity
+	uint srcDevice = 0;
+	uint dstDevice = 0;
+	if (m_settings.deviceConcurrency)
+	{
+		srcDevice = getDeviceIndex(srcFile.substr(0, srcFile.find_last_of(L'\\') + 1), stats.ioStats);
+		if (!isValid(destConnection))
+			dstDevice = getDeviceIndex(destFullPath.substr(0, destFullPath.find_last_of(L'\\') + 1), stats.ioStats);
+	}
+
+	// Add entry (workers will pick this up as soon as possible, unless it needs to be ordered first)
+	bool order = m_settings.copyOrder != CopyOrder_Discovery;
+	ScopedCriticalSection cs(order ? m_orderEntriesCs : m_copyEntriesCs);
+	CopyEntries& entries = order ? m_orderEntries : m_copyEntries;
+	entries.push_back(CopyEntry());
+	auto& entry = entries.back();
 	entry.src = srcFile;
 	entry.dst = destFile;
 	entry.srcInfo = fileInfo;
 	entry.attributes = attributes;
+	entry.srcDevice = srcDevice;
+	entry.dstDevice = dstDevice;
 	return true;
 }
 
@@ -943,9 +1930,13 @@ Client::handleDirectory(LogContext& logContext, Connection* destConnection, cons
 			return false;
 	}
 
-	ScopedCriticalSection cs(m_dirEntriesCs);
-	m_dirEntries.push_back(DirEntry());
-	DirEntry& dirEntry = m_dirEntries.back();
+	// Count entry as active before it is visible to other workers so main thread can't see it as done in between
+	++m_processDirActive;
+
+	DirQueue& queue = m_dirQueues[t_dirQueueIndex];
+	ScopedCriticalSection cs(queue.cs);
+	queue.entries.push_back(DirEntry());
+	DirEntry& dirEntry = queue.entries.back();
 	dirEntry.sourceDir = newSourceDirectory;
 	dirEntry.destDir = newDestDirectory;
 	dirEntry.wildcard = wildcard;
@@ -956,12 +1947,8 @@ Client::handleDirectory(LogContext& logContext, Connection* destConnection, cons
 bool
 Client::handleMissingFile(const wchar_t* fileName)
 	{
-	for (auto& optionalWildcard : m_settings.optionalWildcards)
-		if (PathMatchSpecW(fileName, optionalWildcard.c_str()))
-			return true;
-	for (auto& excludeWildcard : m_settings.excludeWildcards)
-		if (PathMatchSpecW(fileName, excludeWildcard.c_str()))
-			return true;
+	if (m_optionalWildcards.match(fileName) || m_excludeWildcards.match(fileName))
+		return true;
 	ScopedCriticalSection cs(m_handledFilesCs);
 	if (m_handledFiles.find(fileName) != m_handledFiles.end())
 		return true;
@@ -1113,12 +2100,28 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 	}
 	else
 	{
+		// Watch is added before directory is enumerated so changes made in between are not missed
+		if (m_watchHandle != -1)
+			addWatchDirectory(sourcePath, destPath, wildcard, depthLeft);
+
 		WString searchStr = sourcePath;
 		if (wildcard.find('*') == std::string::npos)
 			searchStr += wildcard;
 		else
+		{
 			searchStr += L"*.*";
 
+			// Directories that have not changed since last run are handled from scan cache instead of enumerated
+			if (!m_settings.scanCacheFile.empty())
+			{
+				bool handled;
+				if (!traverseFilesInDirectoryCached(logContext, destConnection, sourcePath, destPath, wildcard, depthLeft, stats, handled))
+					return false;
+				if (handled)
+					return true;
+			}
+		}
+
 		FindFileData fd; 
 		FindFileHandle findFileHandle; 
 
@@ -1156,6 +2159,7 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 		if (findFileHandle != InvalidFindFileHandle)
 		{
 			ScopeGuard _([&]() { findClose(findFileHandle, stats.ioStats); });
+			WildcardMatcher wildcardMatcher(wildcard.c_str());
 
 			do
 			{
@@ -1168,8 +2172,8 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 						continue;
 
 					wchar_t* fileName = getFileName(fd);
-					if (PathMatchSpecW(fileName, wildcard.c_str()))
-						if (!handleFile(logContext, destConnection, sourcePath, destPath, getFileName(fd), fileInfo, fileAttr, stats))
+					if (wildcardMatcher.match(fileName))
+						if (!handleFile(logContext, destConnection, sourcePath, destPath, fileName, fileInfo, fileAttr, stats))
 							return false;
 				}
 				else //if (wildcardIncludesAll)
@@ -1196,6 +2200,256 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 	return true;
 }
 
+bool
+Client::traverseFilesInDirectoryCached(LogContext& logContext, Connection* destConnection, const WString& sourcePath, const WString& destPath, const WString& wildcard, int depthLeft, ClientStats& stats, bool& outHandled)
+{
+	// Anything out of the ordinary is left to the normal path which has retries and error reporting
+	outHandled = false;
+
+	FileInfo dirInfo;
+	if (!getFileInfo(dirInfo, sourcePath.c_str(), stats.ioStats))
+		return true;
+
+	const ScanCache::Entries* entries = m_scanCache.getEntries(sourcePath, dirInfo.lastWriteTime);
+	bool cacheHit = entries != nullptr;
+	if (!entries)
+	{
+		ScanCache::Entries newEntries;
+		WString searchStr = sourcePath + L"*.*";
+		FindFileData fd;
+		FindFileHandle findFileHandle = findFirstFile(searchStr.c_str(), fd, stats.ioStats);
+		if (findFileHandle == InvalidFindFileHandle)
+			return true;
+		ScopeGuard _([&]() { findClose(findFileHandle, stats.ioStats); });
+		do
+		{
+			const wchar_t* fileName = getFileName(fd);
+			if (isDotOrDotDot(fileName))
+				continue;
+			ScanCache::Entry entry;
+			entry.name = fileName;
+			entry.attributes = getFileInfo(entry.info, fd);
+			newEntries.push_back(std::move(entry));
+		}
+		while (findNextFile(findFileHandle, fd, stats.ioStats));
+		if (GetLastError() != ERROR_NO_MORE_FILES)
+			return true;
+		entries = m_scanCache.addEntries(sourcePath, dirInfo.lastWriteTime, std::move(newEntries));
+		if (!entries)
+			return true;
+	}
+
+	outHandled = true;
+	if (cacheHit)
+		++stats.scanCacheHitCount;
+
+	// Cached file info is used as is, a file modified in place does not change write time of its directory (see ScanCache)
+	WildcardMatcher wildcardMatcher(wildcard.c_str());
+	for (auto& entry : *entries)
+	{
+		if (!(entry.attributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			if (isFileWithAttributeAllowed(entry.attributes) && wildcardMatcher.match(entry.name.c_str()))
+				if (!handleFile(logContext, destConnection, sourcePath, destPath, entry.name.c_str(), entry.info, entry.attributes, stats))
+					return false;
+		}
+		else if (depthLeft)
+		{
+			if (!handleDirectory(logContext, destConnection, sourcePath, destPath, entry.name.c_str(), wildcard.c_str(), depthLeft - 1, stats))
+				return false;
+		}
+	}
+	return true;
+}
+
+void
+Client::addWatchDirectory(const WString& sourcePath, const WString& destPath, const WString& wildcard, int depthLeft)
+{
+	#if !defined(_WIN32)
+	String path = toString(sourcePath.c_str());
+	std::replace(path.begin(), path.end(), '\\', '/');
+
+	// Same directory returns same descriptor, so multiple wildcards for one directory end up in one entry
+	int watchDescriptor = inotify_add_watch(m_watchHandle, path.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+	if (watchDescriptor == -1)
+	{
+		logInfoLinef(L"Warning - Failed to watch %ls for changes: %ls", sourcePath.c_str(), getErrorText(errno).c_str());
+		return;
+	}
+
+	ScopedCriticalSection cs(m_watchDirsCs);
+	WatchDir& dir = m_watchDirs[watchDescriptor];
+	dir.sourceDir = sourcePath;
+	dir.destDir = destPath;
+	dir.depthLeft = max(dir.depthLeft, depthLeft);
+	if (std::find(dir.wildcards.begin(), dir.wildcards.end(), wildcard) == dir.wildcards.end())
+		dir.wildcards.push_back(wildcard);
+	#endif
+}
+
+bool
+Client::watchSourceChanges(LogContext& logContext, ClientStats& stats)
+{
+	#if defined(_WIN32)
+	return false;
+	#else
+	struct PendingFile { WString sourceDir; WString destDir; WString name; u64 firstEventTime = 0; u64 lastEventTime = 0; bool handled = false; };
+	Map<WString, PendingFile> pendingFiles; // Keyed on full source path so all events for a file are merged
+	Vector<PendingFile> readyFiles;
+	alignas(inotify_event) char buffer[WatchEventBufferSize];
+	u64 debounceTime = u64(m_settings.watchDebounceMs) * 10000;
+
+	m_watching = true;
+	ScopeGuard watchingGuard([this]() { m_watching = false; });
+
+	logInfoLinef(L"Watching %ls for changes", m_settings.sourceDirectory.c_str());
+
+	while (!m_watchStop)
+	{
+		pollfd pollEntry = { m_watchHandle, POLLIN, 0 };
+		int pollResult = poll(&pollEntry, 1, WatchPollTimeMs);
+		if (pollResult == -1 && errno != EINTR)
+		{
+			logErrorf(L"Failed to poll for source changes: %ls", getErrorText(errno).c_str());
+			return false;
+		}
+
+		bool rescan = false;
+		if (pollResult > 0)
+		{
+			int size = read(m_watchHandle, buffer, sizeof(buffer));
+			u64 eventTime = getTime();
+			for (int pos = 0; pos < size;)
+			{
+				const inotify_event& event = *(const inotify_event*)(buffer + pos);
+				pos += sizeof(inotify_event) + event.len;
+				++stats.watchEventCount;
+
+				// Kernel dropped events, only way to know what changed is to look at everything again
+				if (event.mask & IN_Q_OVERFLOW)
+				{
+					rescan = true;
+					continue;
+				}
+
+				WatchDir dir;
+				bool found = false;
+				m_watchDirsCs.scoped([&]()
+					{
+						auto findIt = m_watchDirs.find(event.wd);
+						if (findIt == m_watchDirs.end())
+							return;
+						if (event.mask & IN_IGNORED) // Directory was removed
+							m_watchDirs.erase(findIt);
+						else
+						{
+							dir = findIt->second;
+							found = true;
+						}
+					});
+				if (!found || !event.len)
+					continue;
+
+				WString name = toWString(event.name);
+
+				// New directories are traversed same way as in first pass, which also adds watches for them
+				if (event.mask & IN_ISDIR)
+				{
+					if ((event.mask & (IN_CREATE | IN_MOVED_TO)) && dir.depthLeft)
+						for (auto& wildcard : dir.wildcards)
+							if (!handleDirectory(logContext, m_destConnection, dir.sourceDir, dir.destDir, name.c_str(), wildcard.c_str(), dir.depthLeft - 1, stats))
+								return false;
+					continue;
+				}
+
+				bool matches = false;
+				for (auto& wildcard : dir.wildcards)
+					matches = matches || matchWildcard(name.c_str(), wildcard.c_str());
+				if (!matches)
+					continue;
+
+				PendingFile& file = pendingFiles[dir.sourceDir + name];
+				if (!file.firstEventTime)
+				{
+					file.sourceDir = dir.sourceDir;
+					file.destDir = dir.destDir;
+					file.name = name;
+					file.firstEventTime = eventTime;
+				}
+				file.lastEventTime = eventTime;
+			}
+		}
+
+		if (rescan)
+		{
+			logInfoLinef(L"Warning - Too many changes in source to keep track of, rescanning all of it");
+			++stats.watchRescanCount;
+			pendingFiles.clear();
+			m_handledFilesCs.scoped([&]() { m_handledFiles.clear(); });
+			m_destDirSnapshotsCs.scoped([&]() { m_destDirSnapshots.clear(); });
+			{
+				++m_processDirActive;
+				ScopeGuard processDirGuard([&]() { --m_processDirActive; });
+				for (auto& fileOrWildcard : m_settings.filesOrWildcards)
+					if (!traverseFilesInDirectory(logContext, m_sourceConnection, m_destConnection, m_copyContext, m_settings.sourceDirectory, m_settings.destDirectory, fileOrWildcard, m_settings.copySubdirDepth, stats))
+						return false;
+			}
+			processQueues(logContext, m_sourceConnection, m_destConnection, m_copyContext, stats, true);
+			continue;
+		}
+
+		// Files that have had no events for a while are most likely done being written
+		u64 time = getTime();
+		readyFiles.clear();
+		for (auto it = pendingFiles.begin(); it != pendingFiles.end();)
+		{
+			if (time - it->second.lastEventTime < debounceTime)
+			{
+				++it;
+				continue;
+			}
+			readyFiles.push_back(std::move(it->second));
+			it = pendingFiles.erase(it);
+		}
+		if (readyFiles.empty())
+			continue;
+
+		// Destination listings taken earlier don't include what has been copied since
+		m_destDirSnapshotsCs.scoped([&]() { m_destDirSnapshots.clear(); });
+
+		for (auto& file : readyFiles)
+		{
+			FileInfo fileInfo;
+			uint fileAttr = getFileInfo(fileInfo, (file.sourceDir + file.name).c_str(), stats.ioStats);
+			if (!fileAttr || (fileAttr & FILE_ATTRIBUTE_DIRECTORY) || !isFileWithAttributeAllowed(fileAttr))
+				continue; // Removed before we got to it. Removals are not propagated to destination
+
+			// File has most likely been handled before, forget about that so it is queued again
+			WString destFile = (file.destDir + file.name).c_str() + m_settings.destDirectory.size();
+			m_handledFilesCs.scoped([&]() { m_handledFiles.erase(destFile); });
+
+			if (!handleFile(logContext, m_destConnection, file.sourceDir, file.destDir, file.name.c_str(), fileInfo, fileAttr, stats))
+				return false;
+			file.handled = true;
+		}
+
+		processQueues(logContext, m_sourceConnection, m_destConnection, m_copyContext, stats, true);
+
+		u64 copiedTime = getTime();
+		for (auto& file : readyFiles)
+		{
+			if (!file.handled)
+				continue;
+			u64 latency = copiedTime - file.firstEventTime;
+			stats.watchLatencyTime += latency;
+			stats.watchMaxLatency = max(stats.watchMaxLatency, latency);
+			++stats.watchCopyCount;
+		}
+	}
+	return true;
+	#endif
+}
+
 bool
 Client::findFilesInDirectory(Vector<NameAndFileInfo>& outEntries, LogContext& logContext, Connection* connection, NetworkCopyContext& copyContext, const WString& path, ClientStats& stats)
 {
@@ -1267,6 +2521,87 @@ Client::findFilesInDirectory(Vector<NameAndFileInfo>& outEntries, LogContext& lo
 	return true;
 }
 
+uint
+Client::getDestFileInfo(FileInfo& outInfo, const WString& fullDst, IOStats& ioStats)
+{
+	// As long as we optimize for new files there is no point enumerating destination directories
+	if (!m_settings.useDestDirectorySnapshot || m_tryCopyFirst)
+		return getFileInfo(outInfo, fullDst.c_str(), ioStats);
+
+	size_t lastSlashIndex = fullDst.find_last_of(L'\\');
+	if (lastSlashIndex == WString::npos)
+		return getFileInfo(outInfo, fullDst.c_str(), ioStats);
+
+	WString directory = fullDst.substr(0, lastSlashIndex + 1);
+	const wchar_t* fileName = fullDst.c_str() + lastSlashIndex + 1;
+
+	DestDirSnapshot entries;
+	m_destDirSnapshotsCs.scoped([&]()
+	{
+		auto findIt = m_destDirSnapshots.find(directory);
+		if (findIt != m_destDirSnapshots.end())
+			entries = findIt->second;
+	});
+
+	if (!entries)
+	{
+		// Enumerate outside lock. If some other thread beat us to it we use theirs
+		auto newEntries = std::make_shared<Vector<NameAndFileInfo>>();
+		if (!snapshotDestDirectory(*newEntries, directory, ioStats))
+			return getFileInfo(outInfo, fullDst.c_str(), ioStats);
+
+		m_destDirSnapshotsCs.scoped([&]()
+		{
+			entries = m_destDirSnapshots.insert({directory, std::move(newEntries)}).first->second;
+		});
+	}
+
+	// Entries are never modified after insert and are kept alive by our reference so it is safe to search without lock
+	auto it = std::lower_bound(entries->begin(), entries->end(), fileName, [&](const NameAndFileInfo& e, const wchar_t* name) { return lessIgnoreCase(e.name.c_str(), name); });
+	for (; it != entries->end() && equalsIgnoreCase(it->name.c_str(), fileName); ++it)
+	{
+		#if !defined(_WIN32)
+		if (it->name != fileName) // Names are case sensitive on linux
+			continue;
+		#endif
+		outInfo = it->info;
+		return it->attributes;
+	}
+
+	outInfo = FileInfo();
+	return 0;
+}
+
+bool
+Client::snapshotDestDirectory(Vector<NameAndFileInfo>& outEntries, const WString& directory, IOStats& ioStats)
+{
+	WString searchStr = directory + L"*.*";
+
+	FindFileData fd;
+	FindFileHandle findFileHandle = findFirstFile(searchStr.c_str(), fd, ioStats);
+	if (findFileHandle == InvalidFindFileHandle)
+		return false;
+
+	ScopeGuard _([&]() { findClose(findFileHandle, ioStats); });
+
+	do
+	{
+		const wchar_t* fileName = getFileName(fd);
+		if (isDotOrDotDot(fileName))
+			continue;
+		FileInfo fileInfo;
+		uint attr = getFileInfo(fileInfo, fd);
+		outEntries.push_back({fileName, fileInfo, attr});
+	}
+	while (findNextFile(findFileHandle, fd, ioStats));
+
+	if (GetLastError() != ERROR_NO_MORE_FILES)
+		return false;
+
+	std::sort(outEntries.begin(), outEntries.end(), [](const NameAndFileInfo& a, const NameAndFileInfo& b) { return lessIgnoreCase(a.name.c_str(), b.name.c_str()); });
+	return true;
+}
+
 bool
 Client::handleFilesOrWildcardsFromFile(LogContext& logContext, ClientStats& stats, const WString& sourcePath, const WString& fileName, const WString& destPath, const HandleFileOrWildcardFunc& func)
 {
@@ -1546,6 +2881,17 @@ Client::processQueuedWildcardFileEntries(LogContext& logContext, ClientStats& st
 			lookup.insert({entry.name.c_str(), &entry});
 		for (auto& e : pe.second)
 		{
+			// Wildcard entries in file list include all matching files in directory
+			if (e.find_first_of(L"*?") != WString::npos)
+			{
+				WildcardMatcher matcher(e.c_str());
+				for (auto& entry : nafvec)
+					if (!(entry.attributes & FILE_ATTRIBUTE_DIRECTORY) && matcher.match(entry.name.c_str()))
+						if (!handlePath(logContext, m_sourceConnection, m_destConnection, stats, rootSourcePath, rootDestPath, (pe.first + entry.name).c_str(), entry.attributes, entry.info))
+							return false;
+				continue;
+			}
+
 			WString relativePath(pe.first + e);
 			auto findIt = lookup.find(e.c_str());
 			if (findIt != lookup.end())
@@ -1702,6 +3048,14 @@ Client::ensureDirectory(Connection* destConnection, const WString& directory, ui
 	return true;
 }
 
+const WString&
+Client::getDestDirectory(int destIndex) const
+{
+	if (destIndex <= 0)
+		return m_settings.destDirectory;
+	return *std::next(m_settings.additionalDestDirectories.begin(), destIndex - 1);
+}
+
 const wchar_t*
 Client::getRelativeSourceFile(const WString& sourcePath) const
 {
@@ -2017,10 +3371,7 @@ bool
 Client::isIgnoredDirectory(const wchar_t *directory)
 {
 	// Check if dir should be excluded because of wild cards
-	for (auto& excludeWildcard : m_settings.excludeWildcardDirectories)
-		if (PathMatchSpecW(directory, excludeWildcard.c_str()))
-			return true;
-	return false;
+	return m_excludeWildcardDirectories.match(directory);
 }
 
 bool
@@ -2096,6 +3447,8 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 	processedByServer = false;
 
 	WriteFileType writeType = m_settings.compressionLevel != 0 ? WriteFileType_Compressed : WriteFileType_Send;
+	if (writeType == WriteFileType_Send && isSparseFile(src, m_stats.ioStats))
+		writeType = WriteFileType_Sparse;
 
 	char buffer[MaxPath*2 + sizeof(WriteFileCommand)];
 	auto& cmd = *(WriteFileCommand*)buffer;
@@ -2178,7 +3531,7 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 		bool useBufferedIO = getUseBufferedIO(m_settings.useBufferedIO, cmd.info.fileSize);
 
 		SendFileStats sendStats;
-		if (!sendFile(m_socket, src, cmd.info.fileSize, writeType, copyContext, m_compressionStats, useBufferedIO, m_stats.ioStats, sendStats))
+		if (!sendFile(m_socket, src, cmd.info.fileSize, writeType, copyContext, m_compressionStats, useBufferedIO, getUseMappedIO(m_settings.useMappedIO, cmd.info.fileSize), m_stats.ioStats, sendStats))
 			return false;
 		m_stats.sendTime += sendStats.sendTime;
 		m_stats.sendSize += sendStats.sendSize;
@@ -2207,7 +3560,7 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 		bool existed;
 		u64 written;
 		WString fullDst = m_settings.destDirectory + dst;
-		bool success = copyFile(src, srcInfo, srcAttributes, fullDst.c_str(), useSystemCopy, false, existed, written, copyContext, m_stats.ioStats, m_settings.useBufferedIO);
+		bool success = copyFile(src, srcInfo, srcAttributes, fullDst.c_str(), useSystemCopy, false, existed, written, copyContext, m_stats.ioStats, m_settings.useBufferedIO, m_settings.ioRingQueueDepth, m_settings.useMappedIO, m_settings.useTempFiles);
 		u8 copyResult = success ? 1 : 0;
 		if (!sendData(m_socket, &copyResult, sizeof(copyResult)))
 			return false;
@@ -2356,14 +3709,18 @@ Client::Connection::sendReadFileCommand(const wchar_t* src, const wchar_t* dst,
 		if (!receiveData(m_socket, &newFileSize, sizeof(newFileSize)))
 			return ReadFileResult_Error;
 
+		// Read how server is going to send the file
+		WriteFileType writeType;
+		if (!receiveData(m_socket, &writeType, sizeof(writeType)))
+			return ReadFileResult_Error;
+
 		bool success = true;
-		WriteFileType writeType = m_settings.compressionLevel != 0 ? WriteFileType_Compressed : WriteFileType_Send;
 		bool useBufferedIO = getUseBufferedIO(m_settings.useBufferedIO, cmd.info.fileSize);
 		uint commandSize = 0;
 
 		// Read actual file from server
 		RecvFileStats recvStats;
-		if (!receiveFile(success, m_socket, fullDest.c_str(), newFileSize, newFileLastWriteTime, writeType, useBufferedIO, copyContext, nullptr, 0, commandSize, m_stats.ioStats, recvStats))
+		if (!receiveFile(success, m_socket, fullDest.c_str(), newFileSize, newFileLastWriteTime, writeType, useBufferedIO, m_settings.useTempFiles, copyContext, nullptr, 0, commandSize, m_stats.ioStats, recvStats))
 			return ReadFileResult_Error;
 		m_stats.recvTime += recvStats.recvTime;
 		m_stats.recvSize += recvStats.recvSize;
@@ -2389,7 +3746,7 @@ Client::Connection::sendReadFileCommand(const wchar_t* src, const wchar_t* dst,
 		u64 written;
 		WString fullSrc = m_settings.sourceDirectory + src;
 		bool useSystemCopy = m_settings.useSystemCopy;
-		if (!copyFile(fullSrc.c_str(), srcInfo, srcAttributes, fullDest.c_str(), useSystemCopy, false, existed, written, copyContext, m_stats.ioStats, m_settings.useBufferedIO))
+		if (!copyFile(fullSrc.c_str(), srcInfo, srcAttributes, fullDest.c_str(), useSystemCopy, false, existed, written, copyContext, m_stats.ioStats, m_settings.useBufferedIO, m_settings.ioRingQueueDepth, m_settings.useMappedIO, m_settings.useTempFiles))
 			return ReadFileResult_Error;
 		outRead = written;
 		outSize = written;
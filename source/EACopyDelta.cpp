@@ -49,18 +49,7 @@ sendDelta(Socket& socket, const wchar_t* referenceFileName, u64 referenceFileSiz
 bool receiveDelta(Socket& socket, const wchar_t* referenceFileName, u64 referenceFileSize, const wchar_t* destFileName, u64 destFileSize, FileTime lastWriteTime, NetworkCopyContext& copyContext, IOStats& ioStats, RecvDeltaStats& recvStats)
 {
 	WString tempFileName;
-	const wchar_t* lastSlash = wcsrchr(destFileName, L'\\');
-	if (lastSlash)
-	{
-		tempFileName.append(destFileName, lastSlash + 1);
-		tempFileName += L'.';
-		tempFileName += lastSlash + 1;
-	}
-	else
-	{
-		tempFileName += L'.';
-		tempFileName += destFileName;
-	}
+	getTempFileName(tempFileName, destFileName);
 
 	FileHandle referenceFile;
 	if (!openFileRead(referenceFileName, referenceFile, ioStats, true, nullptr, false))
@@ -73,6 +62,9 @@ bool receiveDelta(Socket& socket, const wchar_t* referenceFileName, u64 referenc
 	ScopeGuard delTemp([&]() { deleteFile(tempFileName.c_str(), ioStats, false); });
 	ScopeGuard closeTemp([&]() { closeFile(tempFileName.c_str(), tempFile, AccessType_Write, ioStats); });
 
+	if (!allocateFile(tempFileName.c_str(), tempFile, destFileSize, ioStats)) // Fail before receiving anything if there is no room for file
+		return false;
+
 	u8 codecIndex;
 	if (!receiveData(socket, &codecIndex, sizeof(codecIndex)))
 		return false;
@@ -282,7 +282,7 @@ bool isValidSocket(Socket& socket)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, IOStats& ioStats, SendFileStats& sendStats)
+bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, bool useMappedIO, IOStats& ioStats, SendFileStats& sendStats, HashBuilder* hashBuilder)
 {
 	FileHandle sourceFile;
 	if (!openFileRead(src, sourceFile, ioStats, useBufferedIO, nullptr, true))
@@ -290,6 +290,9 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 
 	ScopeGuard closeSourceFile([&]() { closeFile(src, sourceFile, AccessType_Read, ioStats); });
 
+	// Data must pass through user space to be hashed. Receiver treats TransmitFile and Send the same
+	if (hashBuilder && writeType == WriteFileType_TransmitFile)
+		writeType = WriteFileType_Send;
 
 	if (writeType == WriteFileType_TransmitFile)
 	{
@@ -338,10 +341,31 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 	}
 	else if (writeType == WriteFileType_Send)
 	{
+		// Send straight from a mapping of the file if possible, saves a copy through the buffers
+		const u8* mappedData;
+		if (useMappedIO && useBufferedIO && mapFileRead(src, sourceFile, fileSize, mappedData, ioStats))
+		{
+			ScopeGuard unmapGuard([&]() { unmapFile(mappedData, fileSize); });
+			u64 pos = 0;
+			while (pos != fileSize)
+			{
+				uint toSend = (uint)min(u64(fileSize) - pos, u64(getChunkSize(copyContext, NetworkTransferChunkSize)));
+				if (hashBuilder && !hashBuilder->add((u8*)mappedData + pos, toSend))
+					return false;
+				u64 startSendTime = getTime();
+				if (!sendData(socket, mappedData + pos, toSend))
+					return false;
+				sendStats.sendTime += getTime() - startSendTime;
+				sendStats.sendSize += toSend;
+				pos += toSend;
+			}
+			return true;
+		}
+
 		u64 left = fileSize;
 		while (left)
 		{
-			uint toRead = (uint)min(left, u64(NetworkTransferChunkSize));
+			uint toRead = (uint)min(left, u64(getChunkSize(copyContext, NetworkTransferChunkSize)));
 			uint toReadAligned = useBufferedIO ? toRead : (((toRead + 4095) / 4096) * 4096);
 
 			u64 read;
@@ -354,6 +378,9 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 				}
 			}
 
+			if (hashBuilder && !hashBuilder->add(copyContext.buffers[0], read))
+				return false;
+
 			u64 startSendTime = getTime();
 			if (!sendData(socket, copyContext.buffers[0], read))
 				return false;
@@ -374,7 +401,7 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 			// Make sure the amount of data we've read fit in the destination compressed buffer
 			static_assert(ZSTD_COMPRESSBOUND(CompressedNetworkTransferChunkSize - CompressBoundReservation) <= CompressedNetworkTransferChunkSize - 4, "");
 
-			uint toRead = min(left, u64(CompressedNetworkTransferChunkSize - CompressBoundReservation));
+			uint toRead = min(left, u64(min(getChunkSize(copyContext, CompressedNetworkTransferChunkSize), uint(CompressedNetworkTransferChunkSize)) - CompressBoundReservation));
 			uint toReadAligned = useBufferedIO ? toRead : (((toRead + 4095) / 4096) * 4096);
 			u64 read;
 			if (!readFile(src, sourceFile, copyContext.buffers[0], toReadAligned, read, ioStats))
@@ -386,6 +413,9 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 				}
 			}
 
+			if (hashBuilder && !hashBuilder->add(copyContext.buffers[0], read))
+				return false;
+
 			if (!copyContext.compContext)
 				copyContext.compContext = ZSTD_createCCtx();
 			auto cctx = (ZSTD_CCtx*)copyContext.compContext;
@@ -446,6 +476,65 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 			left -= read;
 		}
 	}
+	else if (writeType == WriteFileType_Sparse)
+	{
+		Vector<FileExtent> extents;
+		if (!getFileExtents(src, sourceFile, fileSize, extents, ioStats))
+			return false;
+		extents.push_back({ fileSize, 0 });
+
+		u64 hashedSize = 0;
+		for (const FileExtent& extent : extents)
+		{
+			if (hashBuilder && !hashBuilder->addZeros(extent.offset - hashedSize))
+				return false;
+			hashedSize = extent.offset + extent.size;
+
+			u64 startSendTime = getTime();
+			if (!sendData(socket, &extent, sizeof(extent)))
+				return false;
+			sendStats.sendTime += getTime() - startSendTime;
+			sendStats.sendSize += sizeof(extent);
+
+			if (extent.size && !setFilePosition(src, sourceFile, extent.offset, ioStats))
+				return false;
+
+			u64 left = extent.size;
+			while (left)
+			{
+				uint toRead = (uint)min(left, u64(getChunkSize(copyContext, NetworkTransferChunkSize)));
+				uint toReadAligned = useBufferedIO ? toRead : (((toRead + 4095) / 4096) * 4096);
+
+				u64 read;
+				if (!readFile(src, sourceFile, copyContext.buffers[0], toReadAligned, read, ioStats))
+				{
+					if (GetLastError() != ERROR_IO_PENDING)
+					{
+						logErrorf(L"Fail reading file %ls: %ls", src, getLastErrorText().c_str());
+						return false;
+					}
+				}
+
+				read = min(read, u64(toRead)); // Aligned read can reach into next extent
+				if (read == 0)
+				{
+					logErrorf(L"File %ls was truncated while being sent", src);
+					return false;
+				}
+
+				if (hashBuilder && !hashBuilder->add(copyContext.buffers[0], read))
+					return false;
+
+				u64 startSendTime = getTime();
+				if (!sendData(socket, copyContext.buffers[0], (uint)read))
+					return false;
+				sendStats.sendTime += getTime() - startSendTime;
+				sendStats.sendSize += read;
+
+				left -= read;
+			}
+		}
+	}
 
 	return true;
 }
@@ -458,10 +547,32 @@ NetworkCopyContext::~NetworkCopyContext()
 		ZSTD_freeDCtx((ZSTD_DCtx*)decompContext);
 }
 
-bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useBufferedIO, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats)
+bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useBufferedIO, bool useTempFile, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats, HashBuilder* hashBuilder)
 {
+	#if !defined(_WIN32)
+	useBufferedIO = true; // Data is written in whatever pieces it arrives in, O_DIRECT needs them aligned
+	#endif
+
 	u64 totalReceivedSize = 0;
 
+	// Receive in to temp file and move it in place once everything is written (file handles below are closed before this guard runs)
+	WString tempFileName;
+	const wchar_t* destFileName = fullPath;
+	if (useTempFile)
+	{
+		getTempFileName(tempFileName, destFileName);
+		fullPath = tempFileName.c_str();
+	}
+	bool received = false;
+	ScopeGuard tempFileGuard([&]()
+		{
+			if (!useTempFile)
+				return;
+			outSuccess = outSuccess && received && flushFile(fullPath, ioStats) && moveFile(fullPath, destFileName, ioStats);
+			if (!outSuccess)
+				deleteFile(fullPath, ioStats, false);
+		});
+
 	if (writeType == WriteFileType_TransmitFile || writeType == WriteFileType_Send)
 	{
 		FileHandle file;
@@ -473,6 +584,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 
 		outSuccess = openFileWrite(fullPath, file, ioStats, useBufferedIO);
 		ScopeGuard fileGuard([&]() { CloseHandle(osWrite.hEvent); if (!closeFile(fullPath, file, AccessType_Write, ioStats)) outSuccess = false; });
+		outSuccess = outSuccess && allocateFile(fullPath, file, fileSize, ioStats); // Don't write anything if file doesn't fit. Data still needs to be received
 
 		u64 read = 0;
 
@@ -481,6 +593,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 		{
 			u64 toCopy = min(u64(recvPos - commandSize), u64(fileSize));
 			outSuccess = outSuccess && writeFile(fullPath, file, recvBuffer + commandSize, toCopy, ioStats, &osWrite);
+			outSuccess = outSuccess && (!hashBuilder || hashBuilder->add((u8*)recvBuffer + commandSize, toCopy));
 			read = toCopy;
 			commandSize += (uint)toCopy;
 		}
@@ -491,7 +604,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 		{
 			u64 startRecvTime = getTime();
 			u64 left = fileSize - read;
-			uint toRead = (uint)min(left, u64(NetworkTransferChunkSize));
+			uint toRead = (uint)min(left, u64(getChunkSize(copyContext, NetworkTransferChunkSize)));
 			WSABUF wsabuf;
 			wsabuf.len = toRead;
 			wsabuf.buf = (char*)copyContext.buffers[fileBufIndex];
@@ -514,6 +627,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 			recvStats.recvSize += recvBytes;
 
 			outSuccess = outSuccess && writeFile(fullPath, file, copyContext.buffers[fileBufIndex], recvBytes, ioStats, &osWrite);
+			outSuccess = outSuccess && (!hashBuilder || hashBuilder->add(copyContext.buffers[fileBufIndex], recvBytes));
 
 			read += recvBytes;
 			fileBufIndex = fileBufIndex == 0 ? 1 : 0;
@@ -537,6 +651,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 
 		outSuccess = openFileWrite(fullPath, file, ioStats, useBufferedIO);
 		ScopeGuard fileGuard([&]() { CloseHandle(osWrite.hEvent); if (!closeFile(fullPath, file, AccessType_Write, ioStats)) outSuccess = false; });
+		outSuccess = outSuccess && allocateFile(fullPath, file, fileSize, ioStats); // Don't write anything if file doesn't fit. Data still needs to be received
 
 		u64 read = 0;
 
@@ -545,6 +660,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 		{
 			u64 toCopy = min(u64(recvPos - commandSize), u64(fileSize));
 			outSuccess = outSuccess && writeFile(fullPath, file, recvBuffer + commandSize, toCopy, ioStats, &osWrite);
+			outSuccess = outSuccess && (!hashBuilder || hashBuilder->add((u8*)recvBuffer + commandSize, toCopy));
 			read = toCopy;
 			commandSize += (uint)toCopy;
 		}
@@ -615,6 +731,7 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 			outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
 
 			outSuccess = outSuccess && writeFile(fullPath, file, copyContext.buffers[fileBufIndex], decompressedSize, ioStats, &osWrite);
+			outSuccess = outSuccess && (!hashBuilder || hashBuilder->add(copyContext.buffers[fileBufIndex], decompressedSize));
 
 			read += decompressedSize;
 			fileBufIndex = fileBufIndex == 0 ? 1 : 0;
@@ -625,7 +742,86 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 		ioStats.writeTime = getTime() - startWriteTime;
 		outSuccess = outSuccess && setFileLastWriteTime(fullPath, file, lastWriteTime, ioStats);
 	}
+	else if (writeType == WriteFileType_Sparse)
+	{
+		FileHandle file;
+		_OVERLAPPED osWrite;
+		memset(&osWrite, 0, sizeof(osWrite));
+		osWrite.hEvent = CreateEvent(nullptr, false, true, nullptr);
+
+		outSuccess = openFileWrite(fullPath, file, ioStats, useBufferedIO);
+		ScopeGuard fileGuard([&]() { CloseHandle(osWrite.hEvent); if (!closeFile(fullPath, file, AccessType_Write, ioStats)) outSuccess = false; });
+		outSuccess = outSuccess && setFileSparse(fullPath, file, fileSize, ioStats); // Data still needs to be received if this fails
+
+		// Start of stream might already be in the buffer
+		auto receiveStream = [&](void* dest, uint size)
+		{
+			if (recvPos > commandSize)
+			{
+				uint toCopy = min(recvPos - commandSize, size);
+				memcpy(dest, recvBuffer + commandSize, toCopy);
+				commandSize += toCopy;
+				(char*&)dest += toCopy;
+				size -= toCopy;
+			}
+			if (!size)
+				return true;
+			u64 startRecvTime = getTime();
+			if (!receiveData(socket, dest, size))
+				return false;
+			recvStats.recvTime += getTime() - startRecvTime;
+			recvStats.recvSize += size;
+			return true;
+		};
+
+		int fileBufIndex = 0;
+		u64 hashedSize = 0;
+
+		while (true)
+		{
+			FileExtent extent;
+			if (!receiveStream(&extent, sizeof(extent)))
+				return false;
+			if (extent.offset < hashedSize || extent.offset > fileSize || extent.size > fileSize - extent.offset)
+			{
+				logErrorf(L"Received extent outside of file %ls", fullPath);
+				return false;
+			}
+			outSuccess = outSuccess && (!hashBuilder || hashBuilder->addZeros(extent.offset - hashedSize));
+			hashedSize = extent.offset + extent.size;
+			if (extent.size == 0)
+				break;
+
+			outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
+			outSuccess = outSuccess && setFilePosition(fullPath, file, extent.offset, ioStats);
+
+			u64 offset = extent.offset;
+			u64 left = extent.size;
+			while (left)
+			{
+				uint toRead = (uint)min(left, u64(getChunkSize(copyContext, NetworkTransferChunkSize)));
+				if (!receiveStream(copyContext.buffers[fileBufIndex], toRead))
+					return false;
+
+				outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
+				osWrite.Offset = (uint)offset;
+				osWrite.OffsetHigh = (uint)(offset >> 32);
+				outSuccess = outSuccess && writeFile(fullPath, file, copyContext.buffers[fileBufIndex], toRead, ioStats, &osWrite);
+				outSuccess = outSuccess && (!hashBuilder || hashBuilder->add(copyContext.buffers[fileBufIndex], toRead));
+
+				offset += toRead;
+				left -= toRead;
+				fileBufIndex = fileBufIndex == 0 ? 1 : 0;
+			}
+		}
+
+		u64 startWriteTime = getTime();
+		outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
+		ioStats.writeTime = getTime() - startWriteTime;
+		outSuccess = outSuccess && setFileLastWriteTime(fullPath, file, lastWriteTime, ioStats);
+	}
 
+	received = true;
 	return true;
 }
 
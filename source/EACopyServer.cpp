@@ -284,6 +284,7 @@ Server::connectionThread(ConnectionInfo& info)
 	uint readEntryCount = 0;
 	uint writeEntries[WriteResponse_BadDestination] = { 0 };
 	uint writeEntryCount = 0;
+	bool clientComparesHashes = false; // Set when this client has exchanged a hash with us, only then is it worth hashing files we send to it
 	IOStats ioStats;
 
 	ScopeGuard closeSocket([&]()
@@ -610,7 +611,7 @@ Server::connectionThread(ConnectionInfo& info)
 										}
 										bool existed = false;
 										u64 bytesCopied;
-										if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO))
+										if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO, 0, info.settings.useMappedIO, info.settings.useTempFiles))
 											writeResponse = WriteResponse_Odx;
 									}
 								}
@@ -661,6 +662,7 @@ Server::connectionThread(ConnectionInfo& info)
 							return -1;
 						if (!receiveData(info.socket, &hash, sizeof(hash)))
 							return -1;
+						clientComparesHashes = true;
 						localFile = m_database.getRecord(hash);
 
 						if (!localFile.name.empty()) // File exists on server but with different time stamp.
@@ -686,7 +688,7 @@ Server::connectionThread(ConnectionInfo& info)
 										if (!setFileWritable(localFile.name.c_str(), true))
 											logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", localFile.name.c_str());
 									}
-									if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO))
+									if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO, 0, info.settings.useMappedIO, info.settings.useTempFiles))
 										writeResponse = WriteResponse_Odx;
 								}
 							}
@@ -734,8 +736,23 @@ Server::connectionThread(ConnectionInfo& info)
 					{
 						bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, cmd.info.fileSize);
 						RecvFileStats recvStats;
-						if (!receiveFile(success, info.socket, fullPath.c_str(), cmd.info.fileSize, cmd.info.lastWriteTime, cmd.writeType, useBufferedIO, copyContext, recvBuffer, recvPos, header.commandSize, ioStats, recvStats))
-							return -1;
+						if (info.settings.useHash && !isValid(hash))
+						{
+							// Client was never asked for hash, build it from the received data instead of reading the file again later
+							u64 hashTime = 0;
+							u64 hashCount = 0;
+							HashContext hashContext(hashTime, hashCount);
+							HashBuilder hashBuilder(hashContext);
+							if (!receiveFile(success, info.socket, fullPath.c_str(), cmd.info.fileSize, cmd.info.lastWriteTime, cmd.writeType, useBufferedIO, info.settings.useTempFiles, copyContext, recvBuffer, recvPos, header.commandSize, ioStats, recvStats, &hashBuilder))
+								return -1;
+							if (success)
+								hashBuilder.getHash(hash);
+						}
+						else
+						{
+							if (!receiveFile(success, info.socket, fullPath.c_str(), cmd.info.fileSize, cmd.info.lastWriteTime, cmd.writeType, useBufferedIO, info.settings.useTempFiles, copyContext, recvBuffer, recvPos, header.commandSize, ioStats, recvStats))
+								return -1;
+						}
 					}
 
 					if (success)
@@ -858,7 +875,8 @@ Server::connectionThread(ConnectionInfo& info)
 							u64 hashtime;
 							u64 hashcount;
 							HashContext hashContext(hashtime, hashcount);
-							getFileHash(serverHash, fullPath.c_str(), copyContext, ioStats, hashContext, hashtime);
+							if (getFileHash(serverHash, fullPath.c_str(), copyContext, ioStats, hashContext, hashtime))
+								m_database.addToFilesHistory(serverKey, serverHash, fullPath);
 						}
 						if (isValid(serverHash))
 						{
@@ -871,6 +889,7 @@ Server::connectionThread(ConnectionInfo& info)
 									return -1;
 								if (!receiveData(info.socket, &hash, sizeof(hash)))
 									return -1;
+								clientComparesHashes = true;
 							}
 							if (isValid(hash) && hash == serverHash) // They are actually the same file.. just different time
 							{
@@ -908,10 +927,34 @@ Server::connectionThread(ConnectionInfo& info)
 							else
 								compressionStats.fixedLevel = false;
 						}
+						else if (isSparseFile(fullPath.c_str(), ioStats))
+							writeType = WriteFileType_Sparse;
 
-						bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, fi.fileSize);
-						if (!sendFile(info.socket, fullPath.c_str(), fi.fileSize, writeType, copyContext, compressionStats, useBufferedIO, ioStats, sendStats))
+						if (!sendData(info.socket, &writeType, sizeof(writeType)))
 							return -1;
+
+						bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, fi.fileSize);
+						bool useMappedIO = getUseMappedIO(info.settings.useMappedIO, fi.fileSize);
+						FileKey sendKey{ fileName, fi.lastWriteTime, fi.fileSize };
+						if (info.settings.useHash && clientComparesHashes && !isValid(m_database.getRecord(sendKey).hash))
+						{
+							// Hash the file while it is sent so it never has to be read again just to be hashed. Only done for
+							// clients that compare hashes, hashing keeps sendFile from using TransmitFile and costs cpu for nothing otherwise
+							u64 hashTime = 0;
+							u64 hashCount = 0;
+							HashContext hashContext(hashTime, hashCount);
+							HashBuilder hashBuilder(hashContext);
+							if (!sendFile(info.socket, fullPath.c_str(), fi.fileSize, writeType, copyContext, compressionStats, useBufferedIO, useMappedIO, ioStats, sendStats, &hashBuilder))
+								return -1;
+							Hash hash;
+							if (hashBuilder.getHash(hash))
+								m_database.addToFilesHistory(sendKey, hash, fullPath);
+						}
+						else
+						{
+							if (!sendFile(info.socket, fullPath.c_str(), fi.fileSize, writeType, copyContext, compressionStats, useBufferedIO, useMappedIO, ioStats, sendStats))
+								return -1;
+						}
 					}
 					else if (readResponse == ReadResponse_CopyUsingSmb)
 					{
@@ -56,6 +56,9 @@ void printHelp()
 	logInfoLinef();
 	logInfoLinef(L"                /J :: Enable unbuffered I/O for all files.");
 	logInfoLinef(L"               /NJ :: Disable unbuffered I/O for all files.");
+	logInfoLinef(L"             /MMAP :: Read all files through memory mappings.");
+	logInfoLinef(L"            /NMMAP :: Never read files through memory mappings.");
+	logInfoLinef(L"           /ATOMIC :: write files to temp name and move them in place when done.");
 	logInfoLinef();
 	logInfoLinef(L"         /LOG:file :: output status to LOG file (overwrite existing log).");
 	logInfoLinef(L"          /VERBOSE :: output debug logging.");
@@ -130,6 +133,18 @@ bool readSettings(ServerSettings& outSettings, WString& outLogFileName, uint arg
 		{
 			outSettings.useBufferedIO = UseBufferedIO_Disabled;
 		}
+		else if (equalsIgnoreCase(arg, L"/MMAP"))
+		{
+			outSettings.useMappedIO = UseMappedIO_Enabled;
+		}
+		else if (equalsIgnoreCase(arg, L"/NMMAP"))
+		{
+			outSettings.useMappedIO = UseMappedIO_Disabled;
+		}
+		else if (equalsIgnoreCase(arg, L"/ATOMIC"))
+		{
+			outSettings.useTempFiles = true;
+		}
 		else if(startsWithIgnoreCase(arg, L"/LOG:"))
 		{
 			outLogFileName = arg + 5;
@@ -1,9 +1,11 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #include "EACopyShared.h"
+#include <algorithm>
 #include <utility>
 #include <codecvt>
 #include <assert.h>
+#include <wctype.h>
 #if defined(_WIN32)
 #define NOMINMAX
 #include <shlwapi.h>
@@ -14,19 +16,28 @@
 #pragma comment(lib, "Shlwapi.lib")
 #pragma comment(lib, "Rstrtmgr.lib")
 #else
-#include <algorithm>
 #include <dirent.h>
 #include <fcntl.h>   // open
 #include <limits.h>
 #include <locale>
 #include <stdarg.h>
 #include <string.h>
+#include <linux/fs.h> // FICLONE
+#include <linux/fiemap.h>
+#include <linux/io_uring.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <utime.h>
 #include <pthread.h>
+#if !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 #endif
 
 //#define EACOPY_USE_OUTPUTDEBUGSTRING
@@ -54,6 +65,167 @@ String toLinuxPath(const wchar_t* path)
 	std::replace(str.begin(), str.end(), '\\', '/');
 	return std::move(str);
 }
+timespec toTimespec(const FileTime& fileTime)
+{
+	// Seconds are stored with high bits in dwLowDateTime, see getFileInfo
+	timespec res;
+	res.tv_sec = (time_t)((u64(fileTime.dwLowDateTime) << 32) | fileTime.dwHighDateTime);
+	res.tv_nsec = 0;
+	return res;
+}
+
+// Per thread cache of open directory handles. Lets hot lookups (stat, open for read) use the *at() functions so kernel
+// only resolves last path component instead of walking the full (often very deep) path on every call.
+// A directory renamed or replaced by another process keeps its handle alive. Operations that create, write or remove
+// entries therefore never go through the cache. Lookups that miss check that the handle is still the directory at its
+// path before trusting the miss, and a handle that has not been checked for DirHandleValidateMs is checked before use
+// so long running (watch) jobs don't keep reading a replaced directory
+enum { DirHandleCacheSize = 16, DirHandleValidateMs = 1000 };
+std::atomic<uint> g_dirHandleCount; // Handles cached over all threads. Capped by getDirHandleLimit
+uint getDirHandleLimit()
+{
+	// Leave most of the file descriptors to the files being copied
+	static uint limit = []()
+		{
+			rlimit rl;
+			if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+				return uint(256);
+			return uint(rl.rlim_cur / 4);
+		}();
+	return limit;
+}
+struct DirHandleCache
+{
+	struct Entry { String path; int handle = -1; dev_t dev = 0; ino_t ino = 0; u64 lastUse = 0; u64 validateTimeMs = 0; };
+	Entry entries[DirHandleCacheSize];
+	u64 useCounter = 0;
+
+	bool validate(Entry& e)
+	{
+		struct stat st;
+		if (stat(e.path.c_str(), &st) != 0 || st.st_dev != e.dev || st.st_ino != e.ino)
+			return false;
+		e.validateTimeMs = getTimeMs();
+		return true;
+	}
+	void closeEntry(Entry& e) { if (e.handle != -1) { close(e.handle); --g_dirHandleCount; } e = Entry(); }
+	void clear() { for (Entry& e : entries) closeEntry(e); }
+	~DirHandleCache() { clear(); }
+};
+thread_local DirHandleCache t_dirHandleCache;
+// Returns handle of directory of path and name of path relative to it. Returns AT_FDCWD and path if directory can't be opened
+int getDirHandle(const String& path, const char*& outName, DirHandleCache::Entry*& outEntry)
+{
+	outName = path.c_str();
+	outEntry = nullptr;
+	size_t slash = path.rfind('/');
+	if (slash == String::npos || slash == 0 || slash == path.size() - 1)
+		return AT_FDCWD;
+
+	DirHandleCache& cache = t_dirHandleCache;
+	DirHandleCache::Entry* oldest = cache.entries;
+	for (DirHandleCache::Entry& e : cache.entries)
+	{
+		if (e.handle != -1 && e.path.size() == slash && memcmp(e.path.data(), path.data(), slash) == 0)
+		{
+			if (getTimeMs() - e.validateTimeMs > DirHandleValidateMs && !cache.validate(e))
+			{
+				cache.closeEntry(e); // Directory is gone or another directory is at its path now. Reopen below
+				oldest = &e;
+				break;
+			}
+			e.lastUse = ++cache.useCounter;
+			outName += slash + 1;
+			outEntry = &e;
+			return e.handle;
+		}
+		if (e.lastUse < oldest->lastUse)
+			oldest = &e;
+	}
+
+	if (oldest->handle == -1 && g_dirHandleCount >= getDirHandleLimit())
+	{
+		// All handles we allow are in use, replace least recently used handle of this thread instead of adding one
+		oldest = nullptr;
+		for (DirHandleCache::Entry& e : cache.entries)
+			if (e.handle != -1 && (!oldest || e.lastUse < oldest->lastUse))
+				oldest = &e;
+		if (!oldest)
+			return AT_FDCWD;
+	}
+
+	String dir(path, 0, slash);
+	int handle = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (handle == -1)
+		return AT_FDCWD;
+	struct stat st;
+	if (fstat(handle, &st) != 0)
+	{
+		close(handle);
+		return AT_FDCWD;
+	}
+	cache.closeEntry(*oldest);
+	++g_dirHandleCount;
+	oldest->path = std::move(dir);
+	oldest->handle = handle;
+	oldest->dev = st.st_dev;
+	oldest->ino = st.st_ino;
+	oldest->lastUse = ++cache.useCounter;
+	oldest->validateTimeMs = getTimeMs();
+	outName += slash + 1;
+	outEntry = oldest;
+	return handle;
+}
+// Runs lookup func(dirHandle, name) relative to cached directory handle. Must not be used for operations that modify
+// the directory. If it fails with ENOENT because directory has been renamed or replaced behind our back, the handle is
+// dropped and func is run again with full path
+template<typename Func> int runAtDirHandle(const String& path, Func&& func)
+{
+	const char* name;
+	DirHandleCache::Entry* entry;
+	int dirHandle = getDirHandle(path, name, entry);
+	int res = func(dirHandle, name);
+	if (res != -1 || errno != ENOENT || !entry)
+		return res;
+	if (t_dirHandleCache.validate(*entry))
+	{
+		errno = ENOENT;
+		return res;
+	}
+	t_dirHandleCache.closeEntry(*entry);
+	return func(AT_FDCWD, path.c_str());
+}
+int openFileLinux(const String& path, int flags, mode_t mode, bool useBufferedIO)
+{
+	auto openFunc = [&](int dirHandle, const char* name)
+		{
+			// Not all file systems support O_DIRECT (tmpfs etc).. fall back to buffered io for those
+			if (!useBufferedIO)
+			{
+				int fileHandle = openat(dirHandle, name, flags | O_DIRECT, mode);
+				if (fileHandle != -1 || errno != EINVAL)
+					return fileHandle;
+			}
+			return openat(dirHandle, name, flags, mode);
+		};
+
+	// Files opened for write might be created, that must happen in the directory currently at path
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		return openFunc(AT_FDCWD, path.c_str());
+	return runAtDirHandle(path, openFunc);
+}
+bool clearDirectIOForTail(const wchar_t* fullPath, int fileHandle, const void* data, u64 size, u64 offset)
+{
+	// O_DIRECT needs buffer, size and offset aligned. Only the last block of a file is allowed to be short, that one is
+	// done buffered. Any other EINVAL is a real error and caller reports it
+	if ((uintptr_t(data) % CopyContextBufferAlignment) != 0 || (offset % CopyContextBufferAlignment) != 0 || (size % CopyContextBufferAlignment) == 0)
+		return false;
+	int flags = fcntl(fileHandle, F_GETFL);
+	if (flags == -1 || !(flags & O_DIRECT) || fcntl(fileHandle, F_SETFL, flags & ~O_DIRECT) != 0)
+		return false;
+	logDebugLinef(L"Unaligned tail of %ls (%llu bytes) done with buffered io", fullPath, size);
+	return true;
+}
 int CreateDirectoryW(const wchar_t* path, void* lpSecurityAttributes)
 {
 	String str = toLinuxPath(path);
@@ -82,11 +254,62 @@ bool RemoveDirectoryW(const wchar_t* lpPathName)
 	EACOPY_NOT_IMPLEMENTED
 	return false;
 }
+// Directories are read with getdents64 straight in to the find data and entries are parsed in place. Entry info is
+// fetched relative to directory handle so no paths are built and nothing is allocated per entry
+struct LinuxDirent64 { u64 d_ino; s64 d_off; unsigned short d_reclen; unsigned char d_type; char d_name[1]; };
 struct FindFileDataLinux
 {
-	dirent* entry;
-	wchar_t name[128];
-	char path[1024];
+	int dirHandle;
+	uint bufferPos;
+	uint bufferSize;
+	wchar_t name[256];
+	char buffer[6*1024];
+
+	LinuxDirent64& entry() { return *(LinuxDirent64*)(buffer + bufferPos); }
+	int fill() { bufferPos = 0; int res = syscall(SYS_getdents64, dirHandle, buffer, sizeof(buffer)); bufferSize = res > 0 ? res : 0; return res; }
+
+	// Decode utf8 in place to match toLinuxPath
+	const wchar_t* decodeName()
+	{
+		const unsigned char* str = (const unsigned char*)entry().d_name;
+		uint i = 0;
+		while (*str && i != eacopy_sizeof_array(name) - 1)
+		{
+			uint c = *str++;
+			int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+			c &= 0xFF >> (extra ? extra + 2 : 0);
+			for (; extra && (*str & 0xC0) == 0x80; --extra)
+				c = (c << 6) | (*str++ & 0x3F);
+			name[i++] = wchar_t(c);
+		}
+		name[i] = 0;
+		return name;
+	}
+};
+// Find handle owns directory and the compiled wildcard from the search string. Entries not matching are skipped
+struct FindHandleLinux
+{
+	int dirHandle;
+	WildcardMatcher matcher;
+
+	// Moves to next matching entry, refilling buffer when needed. Returns 1 when found, 0 when there are no more and -1 on error
+	int seek(FindFileDataLinux& fd, bool skipCurrent)
+	{
+		while (true)
+		{
+			if (skipCurrent)
+				fd.bufferPos += fd.entry().d_reclen;
+			skipCurrent = true;
+			if (fd.bufferPos >= fd.bufferSize)
+			{
+				int res = fd.fill();
+				if (res <= 0)
+					return res;
+			}
+			if (matcher.matchesAll() || matcher.match(fd.decodeName()))
+				return 1;
+		}
+	}
 };
 }
 #endif
@@ -100,9 +323,20 @@ namespace eacopy
 enum { UseOwnCopyFunction = true };
 enum { UseOverlappedCopy = false };
 enum { CopyFileWriteThrough = false }; // Enabling this makes all tests slower in our test environment
+enum { UseFileAllocation = true }; // Allocate full size of destination files before writing. Reduces fragmentation and fails early on full disks
+enum { UseSparseCopy = true }; // Linux only. Only copy data extents of files with holes and leave the holes unwritten in destination
+enum { UseCloneFile = true }; // Linux only. Try reflink (FICLONE) first, turns copy into metadata operation on btrfs/xfs
+enum { UseCopyFileRange = true }; // Linux only. Let kernel copy data without bouncing it through user space
+enum { CopyFileRangeChunkSize = 64 * 1024 * 1024 };
+enum { IoRingCopyThreshold = 2 * 1024 * 1024 }; // Linux only. Smaller files than this gain nothing from having multiple requests in flight
+enum { CopyTunerSampleSize = 32 * 1024 * 1024 }; // Bytes that need to be copied with a candidate before tuner moves on to next candidate
+enum { CopyTunerMinFileSize = 1024 * 1024 }; // Copies of smaller files are mostly open/close and tell nothing about chunk size
 
 enum { NoBufferingIOUseTreshold = false }; // Enabling this makes all tests slower in our test environment
 enum { NoBufferingIOTreshold = 16 * 1024 * 1024 }; // Treshold for when unbuffered io is enabled if UseBufferedIO_Auto is used
+enum { MappedIOUseBand = false }; // Reading a mapping of a file that is truncated while copying raises SIGBUS and takes down the process. Only use band when that is acceptable
+enum { MappedIOMinSize = 64 * 1024 }; // Band for when mapped io is used if UseMappedIO_Auto is used. Tune with CopyFileMappedVsRead benchmark
+enum { MappedIOMaxSize = 64 * 1024 * 1024 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -625,7 +859,21 @@ void populateIOStats(Vector<WString>& stats, const IOStats& ioStats)
 	populateStatsTime(stats, L"LinkFile", ioStats.createLinkTime, ioStats.createLinkCount);
 	populateStatsTime(stats, L"DeleteFile", ioStats.deleteFileTime, ioStats.deleteFileCount);
 	populateStatsTime(stats, L"CopyFile", ioStats.copyFileTime, ioStats.copyFileCount);
+	populateStatsTime(stats, L"AllocateFile", ioStats.allocateFileTime, ioStats.allocateFileCount);
+	populateStatsTime(stats, L"CloneFile", ioStats.cloneFileTime, ioStats.cloneFileCount);
+	populateStatsTime(stats, L"SparseCopy", ioStats.sparseCopyTime, ioStats.sparseCopyCount);
+	populateStatsTime(stats, L"MapFile", ioStats.mapFileTime, ioStats.mapFileCount);
+	populateStatsTime(stats, L"CopyFileRange", ioStats.copyFileRangeTime, ioStats.copyFileRangeCount);
+	populateStatsTime(stats, L"IoRingCopy", ioStats.ioRingCopyTime, ioStats.ioRingCopyCount);
+	if (ioStats.ioRingSubmitCount)
+	{
+		populateStatsValue(stats, L"IoRingAvgDepth", float(ioStats.ioRingQueueDepthSum) / ioStats.ioRingSubmitCount);
+		populateStatsValue(stats, L"IoRingMaxDepth", ioStats.ioRingMaxQueueDepth);
+	}
+	populateStatsTime(stats, L"IoRingBatch", ioStats.ioRingBatchTime, ioStats.ioRingBatchCount);
+	populateStatsValue(stats, L"IoRingBatchFiles", ioStats.ioRingBatchFileCount);
 	populateStatsTime(stats, L"MoveFile", ioStats.moveFileTime, ioStats.moveFileCount);
+	populateStatsTime(stats, L"FlushFile", ioStats.flushFileTime, ioStats.flushFileCount);
 	populateStatsTime(stats, L"CreateDir", ioStats.createDirTime, ioStats.createDirCount);
 	populateStatsTime(stats, L"RemoveDir", ioStats.removeDirTime, ioStats.removeDirCount);
 	populateStatsTime(stats, L"FileInfo", ioStats.fileInfoTime, ioStats.fileInfoCount);
@@ -781,13 +1029,18 @@ findFirstFile(const wchar_t* searchStr, FindFileData& findFileData, IOStats& ioS
 	static_assert(sizeof(FindFileDataLinux) <= sizeof(FindFileData), "");
 	String str = toLinuxPath(searchStr);
 	
-	// TODO: BAAAAAAD
-	size_t starPos = str.find_first_of("*");
-	if (starPos != String::npos)
-		str.resize(starPos);
+	// Last path component is the wildcard (or exact name) to find, rest is directory to enumerate
+	const wchar_t* lastSlash = wcsrchr(searchStr, L'\\');
+	if (!lastSlash)
+		lastSlash = wcsrchr(searchStr, L'/');
+	const wchar_t* pattern = lastSlash ? lastSlash + 1 : searchStr;
+	size_t slashPos = str.rfind('/');
+	str.resize(slashPos == String::npos ? 0 : (slashPos ? slashPos : 1));
+	if (str.empty())
+		str = ".";
 	
-	DIR* dir = opendir(str.c_str());
-	if (!dir)
+	int dirHandle = runAtDirHandle(str, [](int parentHandle, const char* name) { return openat(parentHandle, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC); });
+	if (dirHandle == -1)
 	{
 		if (errno == ENOENT)
 		{
@@ -799,12 +1052,21 @@ findFirstFile(const wchar_t* searchStr, FindFileData& findFileData, IOStats& ioS
 	}
 	auto& fd = *(FindFileDataLinux*)&findFileData;
 
-	strcpy(fd.path, str.c_str());
-	fd.entry = readdir(dir);
-	if (fd.entry)
-		return dir;
+	fd.dirHandle = dirHandle;
+	fd.bufferPos = 0;
+	fd.bufferSize = 0;
+	auto handle = new FindHandleLinux{ dirHandle, WildcardMatcher(*pattern ? pattern : L"*.*") };
+	int res = handle->seek(fd, false);
+	if (res > 0)
+		return handle;
+	close(dirHandle);
+	delete handle;
+	if (res == 0)
+	{
+		t_lastError = ERROR_FILE_NOT_FOUND;
+		return InvalidFindFileHandle;
+	}
 	EACOPY_NOT_IMPLEMENTED //  Need to set error codes
-	closedir(dir);
 	return InvalidFindFileHandle;
 #endif
 }
@@ -816,13 +1078,11 @@ findNextFile(FindFileHandle handle, FindFileData& findFileData, IOStats& ioStats
 #if defined(_WIN32)
 	return FindNextFileW(handle, (WIN32_FIND_DATAW*)&findFileData) != 0;
 #else
-	auto dir = (DIR*)handle;
 	auto& fd = *(FindFileDataLinux*)&findFileData;
-	errno = 0;
-	fd.entry = readdir(dir);
-	if (fd.entry)
+	int res = ((FindHandleLinux*)handle)->seek(fd, true);
+	if (res > 0)
 		return true;
-	if (errno == 0)
+	if (res == 0)
 	{
 		t_lastError = ERROR_NO_MORE_FILES;
 		return false;
@@ -841,8 +1101,9 @@ findClose(FindFileHandle handle, IOStats& ioStats)
 #if defined(_WIN32)
 	FindClose(handle);
 #else
-	auto dir = (DIR*)handle;
-	closedir(dir);
+	auto findHandle = (FindHandleLinux*)handle;
+	close(findHandle->dirHandle);
+	delete findHandle;
 #endif
 }
 
@@ -858,10 +1119,7 @@ getFileInfo(FileInfo& outInfo, FindFileData& findFileData)
 #else
 	auto& fd = *(FindFileDataLinux*)&findFileData;
 	struct stat st;
-	char fullPath[1024];
-	strcpy(fullPath, fd.path);
-	strcat(fullPath, fd.entry->d_name);
-	if (stat(fullPath, &st) == -1)
+	if (fstatat(fd.dirHandle, fd.entry().d_name, &st, 0) == -1)
 	{
 		EACOPY_NOT_IMPLEMENTED
 		return 0;
@@ -876,9 +1134,10 @@ getFileInfo(FileInfo& outInfo, FindFileData& findFileData)
 		attr |= FILE_ATTRIBUTE_READONLY;
 
 
-	if (fd.entry->d_type == DT_REG)
+	// Use mode from stat since it follows symlinks and d_type is DT_UNKNOWN on some file systems
+	if (S_ISREG(st.st_mode))
 		attr |= FILE_ATTRIBUTE_NORMAL;
-	else if (fd.entry->d_type == DT_DIR)
+	else if (S_ISDIR(st.st_mode))
 		attr |= FILE_ATTRIBUTE_DIRECTORY;
 	else
 		EACOPY_NOT_IMPLEMENTED;
@@ -922,9 +1181,7 @@ getFileName(FindFileData& findFileData)
 	return fd.cFileName;
 #else
 	auto& fd = *(FindFileDataLinux*)&findFileData;
-	WString temp(fd.entry->d_name, fd.entry->d_name + strlen(fd.entry->d_name));
-	stringCopy(fd.name, 512, temp.c_str());
-	return fd.name;
+	return const_cast<wchar_t*>(fd.decodeName());
 #endif
 }
 
@@ -1021,7 +1278,7 @@ uint getFileInfo(FileInfo& outInfo, const wchar_t* fullFileName, IOStats& ioStat
 		str.resize(str.size()-1);
 
 	struct stat st;
-	if (stat(str.c_str(), &st) == -1)
+	if (runAtDirHandle(str, [&](int dirHandle, const char* name) { return fstatat(dirHandle, name, &st, 0); }) == -1)
 	{
 		if (errno == ENOENT)
 		{
@@ -1351,6 +1608,21 @@ bool getUseBufferedIO(UseBufferedIO use, u64 fileSize)
 	}
 }
 
+bool getUseMappedIO(UseMappedIO use, u64 fileSize)
+{
+	if (fileSize == 0)
+		return false;
+	switch (use)
+	{
+	case UseMappedIO_Enabled:
+		return true;
+	case UseMappedIO_Disabled:
+		return false;
+	default: // UseMappedIO_Auto:
+		return MappedIOUseBand && fileSize >= MappedIOMinSize && fileSize <= MappedIOMaxSize;
+	}
+}
+
 bool openFileRead(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStats, bool useBufferedIO, _OVERLAPPED* overlapped, bool isSequentialScan, bool sharedRead)
 {
 	TimerScope _(ioStats.createReadTime);
@@ -1369,7 +1641,7 @@ bool openFileRead(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStats
 	return false;
 	#else
 	String path = toLinuxPath(fullPath);
-    int fileHandle = open(path.c_str(), O_RDONLY, 0);
+	int fileHandle = openFileLinux(path, O_RDONLY, 0, useBufferedIO);
 	if (fileHandle == -1)
 	{
 		outFile = InvalidFileHandle;
@@ -1416,7 +1688,7 @@ bool openFileWrite(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStat
 	return false;
 	#else
 	String path = toLinuxPath(fullPath);
-    int fileHandle = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+	int fileHandle = openFileLinux(path, O_WRONLY | O_CREAT | (createAlways ? O_TRUNC : 0), 0644, useBufferedIO);
 	if (fileHandle == -1)
 	{
 		outFile = InvalidFileHandle;
@@ -1473,7 +1745,9 @@ bool writeFile(const wchar_t* fullPath, FileHandle& file, const void* data, u64
 		size_t written = write(fileHandle, data, toWrite);
 		if (written == -1)
 		{
-			EACOPY_NOT_IMPLEMENTED
+			if (errno == EINVAL && clearDirectIOForTail(fullPath, fileHandle, data, toWrite, lseek(fileHandle, 0, SEEK_CUR)))
+				continue;
+			logErrorf(L"Trying to write data to %ls: %hs", fullPath, strerror(errno));
 			return false;
 		}
 		(char*&)data += written;
@@ -1502,9 +1776,11 @@ bool readFile(const wchar_t* fullPath, FileHandle& file, void* destData, u64 toR
 	#else
 	int fileHandle = (int)(uintptr_t)file;
 	size_t size = ::read(fileHandle, destData, toRead);
+	if (size == -1 && errno == EINVAL && clearDirectIOForTail(fullPath, fileHandle, destData, toRead, lseek(fileHandle, 0, SEEK_CUR)))
+		size = ::read(fileHandle, destData, toRead);
 	if (size == -1)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Fail reading file %ls: %hs", fullPath, strerror(errno));
 		return false;
 	}
 	read = size;
@@ -1547,7 +1823,11 @@ bool setFileLastWriteTime(const wchar_t* fullPath, FileHandle& file, FileTime la
 		file = InvalidFileHandle;
 	return false;
 	#else
-	EACOPY_NOT_IMPLEMENTED
+	int fileHandle = (int)(uintptr_t)file;
+	timespec times[2] = { { 0, UTIME_NOW }, toTimespec(lastWriteTime) };
+	if (futimens(fileHandle, times) == 0)
+		return true;
+	logErrorf(L"Failed to set file time on %ls: %hs", fullPath, strerror(errno));
 	return false;
 	#endif
 }
@@ -1567,11 +1847,250 @@ bool setFilePosition(const wchar_t* fullPath, FileHandle& file, u64 position, IO
 	logErrorf(L"Fail setting file position on file %ls: %ls", fullPath, getErrorText(lastError).c_str());
 	return false;
 	#else
-	EACOPY_NOT_IMPLEMENTED
+	int fileHandle = (int)(uintptr_t)file;
+	if (lseek(fileHandle, position, SEEK_SET) != -1)
+		return true;
+	logErrorf(L"Fail setting file position on file %ls: %hs", fullPath, strerror(errno));
+	return false;
+	#endif
+}
+
+bool allocateFile(const wchar_t* fullPath, FileHandle& file, u64 fileSize, IOStats& ioStats)
+{
+	if (!UseFileAllocation || fileSize == 0)
+		return true;
+
+	++ioStats.allocateFileCount;
+	TimerScope _(ioStats.allocateFileTime);
+	#if defined(_WIN32)
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = fileSize;
+	if (SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info)))
+		return true;
+	uint error = GetLastError();
+	if (error != ERROR_DISK_FULL)
+		return true; // Allocation is just an optimization
+	logErrorf(L"Failed to allocate %ls for file %ls: %ls", toPretty(fileSize).c_str(), fullPath, getErrorText(error).c_str());
+	return false;
+	#else
+	// Keep size so a file that is not fully written never looks complete
+	int fileHandle = (int)(uintptr_t)file;
+	if (fallocate(fileHandle, FALLOC_FL_KEEP_SIZE, 0, fileSize) == 0)
+		return true;
+	if (errno != ENOSPC && errno != EDQUOT)
+		return true; // Allocation is just an optimization, file system might not support it
+	logErrorf(L"Failed to allocate %ls for file %ls: %hs", toPretty(fileSize).c_str(), fullPath, strerror(errno));
+	return false;
+	#endif
+}
+
+bool isSparseFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	++ioStats.fileInfoCount;
+	TimerScope _(ioStats.fileInfoTime);
+
+	#if defined(_WIN32)
+	WString temp;
+	fullPath = convertToShortPath(fullPath, temp);
+	uint attributes = GetFileAttributesW(fullPath);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+	#else
+	// There is no sparse flag, file is sparse when less blocks are allocated than what its size needs
+	struct stat st;
+	if (stat(toLinuxPath(fullPath).c_str(), &st) == -1)
+		return false;
+	return S_ISREG(st.st_mode) && u64(st.st_blocks) * 512 < u64(st.st_size);
+	#endif
+}
+
+bool getFileExtents(const wchar_t* fullPath, FileHandle& file, u64 fileSize, Vector<FileExtent>& outExtents, IOStats& ioStats)
+{
+	outExtents.clear();
+	if (fileSize == 0)
+		return true;
+
+	++ioStats.fileInfoCount;
+	TimerScope _(ioStats.fileInfoTime);
+
+	#if defined(_WIN32)
+	FILE_ALLOCATED_RANGE_BUFFER query;
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = fileSize;
+	while (true)
+	{
+		FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+		DWORD bytesReturned = 0;
+		bool done = DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &bytesReturned, NULL) != 0;
+		if (!done && GetLastError() != ERROR_MORE_DATA)
+		{
+			// Not supported by file system, treat whole file as data
+			outExtents.clear();
+			outExtents.push_back({ 0, fileSize });
+			return true;
+		}
+		uint rangeCount = bytesReturned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+		for (uint i=0; i!=rangeCount; ++i)
+		{
+			u64 offset = ranges[i].FileOffset.QuadPart;
+			u64 end = min(offset + u64(ranges[i].Length.QuadPart), fileSize);
+			if (offset < end)
+				outExtents.push_back({ offset, end - offset });
+		}
+		if (done || rangeCount == 0)
+			return true;
+		u64 next = ranges[rangeCount - 1].FileOffset.QuadPart + ranges[rangeCount - 1].Length.QuadPart;
+		if (next >= fileSize)
+			return true;
+		query.FileOffset.QuadPart = next;
+		query.Length.QuadPart = fileSize - next;
+	}
+	#else
+	int fileHandle = (int)(uintptr_t)file;
+	u64 pos = 0;
+	while (pos < fileSize)
+	{
+		off_t dataPos = lseek(fileHandle, pos, SEEK_DATA);
+		if (dataPos == -1)
+		{
+			if (errno == ENXIO) // No more data, rest of file is a hole
+				break;
+			if (errno != EINVAL && errno != EOPNOTSUPP)
+			{
+				logErrorf(L"Failed to find data in file %ls: %hs", fullPath, strerror(errno));
+				return false;
+			}
+			// Not supported by file system, treat whole file as data
+			outExtents.clear();
+			outExtents.push_back({ 0, fileSize });
+			return true;
+		}
+		if (u64(dataPos) >= fileSize)
+			break;
+		off_t holePos = lseek(fileHandle, dataPos, SEEK_HOLE);
+		u64 end = holePos == -1 ? fileSize : min(u64(holePos), fileSize);
+		outExtents.push_back({ u64(dataPos), end - u64(dataPos) });
+		pos = end;
+	}
+	return true;
+	#endif
+}
+
+bool getFileLocation(const wchar_t* fullPath, bool usePhysicalOffset, u64& outLocation, IOStats& ioStats)
+{
+	++ioStats.fileInfoCount;
+	TimerScope _(ioStats.fileInfoTime);
+
+	#if defined(_WIN32)
+	WString temp;
+	fullPath = convertToShortPath(fullPath, temp);
+	HANDLE handle = CreateFileW(fullPath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	ScopeGuard handleGuard([&]() { CloseHandle(handle); });
+
+	if (usePhysicalOffset)
+	{
+		// First logical cluster of the file. Fails for files small enough to be stored in the mft
+		STARTING_VCN_INPUT_BUFFER query;
+		query.StartingVcn.QuadPart = 0;
+		RETRIEVAL_POINTERS_BUFFER pointers;
+		DWORD bytesReturned = 0;
+		if (!DeviceIoControl(handle, FSCTL_GET_RETRIEVAL_POINTERS, &query, sizeof(query), &pointers, sizeof(pointers), &bytesReturned, NULL) && GetLastError() != ERROR_MORE_DATA)
+			return false;
+		if (pointers.ExtentCount == 0 || pointers.Extents[0].Lcn.QuadPart == -1)
+			return false;
+		outLocation = pointers.Extents[0].Lcn.QuadPart;
+		return true;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(handle, &info))
+		return false;
+	outLocation = ((u64)info.nFileIndexHigh << 32) + info.nFileIndexLow;
+	return true;
+	#else
+	String str = toLinuxPath(fullPath);
+	if (!usePhysicalOffset)
+	{
+		struct stat st;
+		if (runAtDirHandle(str, [&](int dirHandle, const char* name) { return fstatat(dirHandle, name, &st, 0); }) == -1)
+			return false;
+		outLocation = st.st_ino;
+		return true;
+	}
+
+	int fileHandle = openFileLinux(str, O_RDONLY | O_CLOEXEC, 0, true);
+	if (fileHandle == -1)
+		return false;
+	ScopeGuard handleGuard([&]() { close(fileHandle); });
+
+	// Only need first extent. Fails for empty files and file systems without fiemap (tmpfs, nfs etc)
+	u64 buffer[(sizeof(fiemap) + sizeof(fiemap_extent)) / sizeof(u64)] = { 0 };
+	fiemap& query = *(fiemap*)buffer;
+	query.fm_length = FIEMAP_MAX_OFFSET;
+	query.fm_extent_count = 1;
+	if (ioctl(fileHandle, FS_IOC_FIEMAP, &query) == -1 || query.fm_mapped_extents == 0)
+		return false;
+	outLocation = query.fm_extents[0].fe_physical;
+	return true;
+	#endif
+}
+
+bool setFileSparse(const wchar_t* fullPath, FileHandle& file, u64 fileSize, IOStats& ioStats)
+{
+	#if defined(_WIN32)
+	// File is not sparse on volumes that doesn't support it, holes are then filled with zeros by file system instead
+	DWORD bytesReturned;
+	DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL);
+	FILE_END_OF_FILE_INFO info;
+	info.EndOfFile.QuadPart = 0;
+	bool success = SetFileInformationByHandle(file, FileEndOfFileInfo, &info, sizeof(info)) != 0;
+	info.EndOfFile.QuadPart = fileSize;
+	success = success && SetFileInformationByHandle(file, FileEndOfFileInfo, &info, sizeof(info)) != 0;
+	if (success)
+		return true;
+	logErrorf(L"Failed to set size of file %ls: %ls", fullPath, getLastErrorText().c_str());
+	return false;
+	#else
+	int fileHandle = (int)(uintptr_t)file;
+	if (ftruncate(fileHandle, 0) == 0 && ftruncate(fileHandle, fileSize) == 0)
+		return true;
+	logErrorf(L"Failed to set size of file %ls: %hs", fullPath, strerror(errno));
 	return false;
 	#endif
 }
 
+bool mapFileRead(const wchar_t* fullPath, FileHandle& file, u64 fileSize, const u8*& outData, IOStats& ioStats)
+{
+	++ioStats.mapFileCount;
+	TimerScope _(ioStats.mapFileTime);
+	#if defined(_WIN32)
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+		return false;
+	outData = (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); // View keeps mapping alive
+	return outData != nullptr;
+	#else
+	int fileHandle = (int)(uintptr_t)file;
+	void* data = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fileHandle, 0);
+	if (data == MAP_FAILED)
+		return false;
+	madvise(data, fileSize, MADV_SEQUENTIAL);
+	outData = (const u8*)data;
+	return true;
+	#endif
+}
+
+void unmapFile(const u8* data, u64 fileSize)
+{
+	#if defined(_WIN32)
+	UnmapViewOfFile(data);
+	#else
+	munmap((void*)data, fileSize);
+	#endif
+}
+
 bool closeFile(const wchar_t* fullPath, FileHandle& file, AccessType accessType, IOStats& ioStats)
 {
 	if (file == InvalidFileHandle)
@@ -1657,34 +2176,663 @@ bool createFileLink(const wchar_t* fullPath, const FileInfo& info, const wchar_t
 
 	return false;
 	#else
-	EACOPY_NOT_IMPLEMENTED
+	String dest = toLinuxPath(fullPath);
+	String source = toLinuxPath(sourcePath);
+	do
+	{
+		int error;
+		{
+			++ioStats.createLinkCount;
+			TimerScope _(ioStats.createLinkTime);
+			if (link(source.c_str(), dest.c_str()) == 0)
+				return true;
+
+			error = errno;
+			if (error != EEXIST)
+			{
+				logDebugLinef(L"Failed creating hardlink from %ls to %ls: %hs", fullPath, sourcePath, strerror(error));
+				return false;
+			}
+
+			// Destination might already be a link to the same inode (happens when linking same file again)
+			struct stat destStat;
+			struct stat sourceStat;
+			if (stat(dest.c_str(), &destStat) == 0 && stat(source.c_str(), &sourceStat) == 0 && destStat.st_dev == sourceStat.st_dev && destStat.st_ino == sourceStat.st_ino)
+			{
+				outSkip = true;
+				return true;
+			}
+
+			FileInfo other;
+			getFileInfo(other, fullPath, ioStats);
+			if (equals(info, other))
+			{
+				outSkip = true;
+				return true;
+			}
+		}
+
+		if (!deleteAndRetry)
+		{
+			logDebugLinef(L"Failed creating hardlink from %ls to %ls: %hs", fullPath, sourcePath, strerror(error));
+			return false;
+		}
+
+		// Delete file and try again
+		if (!deleteFile(fullPath, ioStats))
+			return false;
+
+	} while (true); // Should only really get here once
+
 	return false;
 	#endif
 }
 
-#if defined(_WIN32)
-uint internalCopyProgressRoutine(LARGE_INTEGER TotalFileSize, LARGE_INTEGER TotalBytesTransferred, LARGE_INTEGER StreamSize, LARGE_INTEGER StreamBytesTransferred, uint dwStreamNumber, uint dwCallbackReason, HANDLE hSourceFile, HANDLE hDestinationFile, LPVOID lpData)
+bool cloneFileData(const wchar_t* fullPath, const wchar_t* sourcePath, IOStats& ioStats)
 {
-	if (TotalBytesTransferred.QuadPart == TotalFileSize.QuadPart)
-		*(u64*)lpData = TotalBytesTransferred.QuadPart;
-	return PROGRESS_CONTINUE;
-}
-#endif
+	#if defined(_WIN32)
+	// Block cloning (FSCTL_DUPLICATE_EXTENTS_TO_FILE) only exists on ReFS and needs cluster aligned ranges. Not supported yet
+	return false;
+	#else
+	TimerScope _(ioStats.cloneFileTime);
+	int sourceHandle = openFileLinux(toLinuxPath(sourcePath), O_RDONLY | O_CLOEXEC, 0, true);
+	if (sourceHandle == -1)
+		return false;
+	ScopeGuard sourceGuard([&]() { close(sourceHandle); });
 
-CopyContext::CopyContext()
-{
-	u8* data = new u8[CopyContextBufferSize * 3];
-	buffers[0] = data + CopyContextBufferSize*0;
-	buffers[1] = data + CopyContextBufferSize*1;
-	buffers[2] = data + CopyContextBufferSize*2;
+	int destHandle = openFileLinux(toLinuxPath(fullPath), O_WRONLY | O_CLOEXEC, 0, true);
+	if (destHandle == -1)
+		return false;
+	ScopeGuard destGuard([&]() { close(destHandle); });
+
+	// Cloning touches last write time of dest. Put it back so dest still matches the file it was copied from
+	struct stat destStat;
+	if (fstat(destHandle, &destStat) == -1)
+		return false;
+	if (ioctl(destHandle, FICLONE, sourceHandle) == -1)
+		return false;
+	++ioStats.cloneFileCount;
+	timespec times[2] = { { 0, UTIME_OMIT }, destStat.st_mtim };
+	return futimens(destHandle, times) == 0;
+	#endif
+}
+
+bool supportsFileCloning(const wchar_t* directory)
+{
+	#if defined(_WIN32)
+	return false;
+	#else
+	// Only way to know is to try. Scratch files are written with plain syscalls so a failing probe does not log errors
+	WString probePaths[2];
+	getTempFileName(probePaths[0], (WString(directory) + L"EACopyCloneProbeA").c_str());
+	getTempFileName(probePaths[1], (WString(directory) + L"EACopyCloneProbeB").c_str());
+	ScopeGuard deleteGuard([&]() { for (auto& probePath : probePaths) unlink(toLinuxPath(probePath.c_str()).c_str()); });
+
+	static const char probeData[4096] = {};
+	for (auto& probePath : probePaths)
+	{
+		int fd = open(toLinuxPath(probePath.c_str()).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd == -1)
+			return false;
+		bool written = write(fd, probeData, sizeof(probeData)) == sizeof(probeData);
+		close(fd);
+		if (!written)
+			return false;
+	}
+
+	IOStats ioStats;
+	return cloneFileData(probePaths[1].c_str(), probePaths[0].c_str(), ioStats);
+	#endif
+}
+
+#if defined(_WIN32)
+uint internalCopyProgressRoutine(LARGE_INTEGER TotalFileSize, LARGE_INTEGER TotalBytesTransferred, LARGE_INTEGER StreamSize, LARGE_INTEGER StreamBytesTransferred, uint dwStreamNumber, uint dwCallbackReason, HANDLE hSourceFile, HANDLE hDestinationFile, LPVOID lpData)
+{
+	if (TotalBytesTransferred.QuadPart == TotalFileSize.QuadPart)
+		*(u64*)lpData = TotalBytesTransferred.QuadPart;
+	return PROGRESS_CONTINUE;
+}
+#endif
+
+#if !defined(_WIN32)
+
+// Minimal io_uring wrapper on top of the raw syscalls (we don't want a dependency on liburing)
+struct IoRing
+{
+	int					fd = -1;
+	io_uring_params		params;
+	void*				sqRing = MAP_FAILED;
+	void*				cqRing = MAP_FAILED;
+	io_uring_sqe*		sqes = (io_uring_sqe*)MAP_FAILED;
+	size_t				sqRingSize = 0;
+	size_t				cqRingSize = 0;
+	uint*				sqHead;
+	uint*				sqTail;
+	uint*				sqMask;
+	uint*				sqArray;
+	uint*				cqHead;
+	uint*				cqTail;
+	uint*				cqMask;
+	io_uring_cqe*		cqes;
+	uint				toSubmit = 0;
+	bool				filesRegistered = false;
+	bool				smallFileBatchUnsupported = false;
+};
+
+void destroyIoRing(IoRing* ring)
+{
+	if (!ring)
+		return;
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->params.sq_entries * sizeof(io_uring_sqe));
+	if (ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+		munmap(ring->cqRing, ring->cqRingSize);
+	if (ring->sqRing != MAP_FAILED)
+		munmap(ring->sqRing, ring->sqRingSize);
+	if (ring->fd != -1)
+		close(ring->fd);
+	delete ring;
+}
+
+bool createIoRing(IoRing& ring, uint entries)
+{
+	memset(&ring.params, 0, sizeof(ring.params));
+	ring.fd = (int)syscall(__NR_io_uring_setup, entries, &ring.params);
+	if (ring.fd == -1)
+		return false;
+
+	io_uring_params& p = ring.params;
+	ring.sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint);
+	ring.cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.sqRingSize = ring.cqRingSize = max(ring.sqRingSize, ring.cqRingSize);
+
+	ring.sqRing = mmap(0, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sqRing == MAP_FAILED)
+		return false;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.cqRing = ring.sqRing;
+	else
+	{
+		ring.cqRing = mmap(0, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cqRing == MAP_FAILED)
+			return false;
+	}
+	ring.sqes = (io_uring_sqe*)mmap(0, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return false;
+
+	u8* sq = (u8*)ring.sqRing;
+	ring.sqHead = (uint*)(sq + p.sq_off.head);
+	ring.sqTail = (uint*)(sq + p.sq_off.tail);
+	ring.sqMask = (uint*)(sq + p.sq_off.ring_mask);
+	ring.sqArray = (uint*)(sq + p.sq_off.array);
+	u8* cq = (u8*)ring.cqRing;
+	ring.cqHead = (uint*)(cq + p.cq_off.head);
+	ring.cqTail = (uint*)(cq + p.cq_off.tail);
+	ring.cqMask = (uint*)(cq + p.cq_off.ring_mask);
+	ring.cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+	return true;
+}
+
+IoRing* getIoRing(CopyContext& copyContext)
+{
+	if (!copyContext.ioRing)
+	{
+		copyContext.ioRing = new IoRing();
+		if (!createIoRing(*copyContext.ioRing, IoRingEntryCount)) // Not supported by kernel or blocked by seccomp. Keep the empty ring around so we don't try again
+		{
+			logDebugLinef(L"io_uring not available (%hs), falling back to synchronous copy", strerror(errno));
+			IoRing* failed = copyContext.ioRing;
+			copyContext.ioRing = new IoRing();
+			destroyIoRing(failed);
+		}
+	}
+	return copyContext.ioRing->fd != -1 ? copyContext.ioRing : nullptr;
+}
+
+void queueIoRingRequest(IoRing& ring, u8 opcode, int fd, u8* buffer, uint size, u64 offset, u64 userData)
+{
+	uint tail = *ring.sqTail;
+	uint index = tail & *ring.sqMask;
+	io_uring_sqe& sqe = ring.sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	sqe.addr = (u64)(uintptr_t)buffer;
+	sqe.len = size;
+	sqe.off = offset;
+	sqe.user_data = userData;
+	ring.sqArray[index] = index;
+	__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+	++ring.toSubmit;
+}
+
+bool submitAndWaitIoRing(IoRing& ring, uint waitCount)
+{
+	while (true)
+	{
+		int res = (int)syscall(__NR_io_uring_enter, ring.fd, ring.toSubmit, waitCount, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (res >= 0)
+		{
+			ring.toSubmit -= res;
+			return true;
+		}
+		if (errno != EINTR && errno != EAGAIN)
+			return false;
+	}
+}
+
+// Removes requests from submission queue that kernel has not seen yet. Returns number of requests removed
+uint takeBackIoRingRequests(IoRing& ring)
+{
+	uint count = ring.toSubmit;
+	__atomic_store_n(ring.sqTail, *ring.sqTail - count, __ATOMIC_RELEASE);
+	ring.toSubmit = 0;
+	return count;
+}
+
+// Waits for completions without submitting anything. Used to drain ring after submit failed, completions
+// are posted even if we can't enter the ring so we just give the kernel some time in that case
+void waitIoRing(IoRing& ring)
+{
+	if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+		Sleep(1);
+}
+
+// Copies fileSize bytes with up to queueDepth reads/writes in flight. The three CopyContext buffers are one allocation
+// so they are treated as one big buffer split in queueDepth slots. A slot is read into and then written from.
+bool copyFileIoRing(IoRing& ring, int sourceHandle, int destHandle, const wchar_t* source, const wchar_t* dest, u64 fileSize, u64& outWritten, CopyContext& copyContext, IOStats& ioStats, uint queueDepth)
+{
+	TimerScope _(ioStats.ioRingCopyTime);
+
+	queueDepth = min(max(queueDepth, 1u), uint(MaxIoRingQueueDepth));
+	uint slotSize = min(((CopyContextBufferSize * 3) / queueDepth) & ~4095u, getChunkSize(copyContext, CopyContextBufferSize));
+
+	struct Slot { u64 offset; uint size; uint done; bool isWrite; };
+	Slot slots[MaxIoRingQueueDepth];
+	uint freeSlots[MaxIoRingQueueDepth];
+	uint freeSlotCount = queueDepth;
+	for (uint i=0; i!=queueDepth; ++i)
+		freeSlots[i] = queueDepth - i - 1;
+
+	auto queueSlot = [&](uint slotIndex)
+	{
+		Slot& slot = slots[slotIndex];
+		u8* buffer = copyContext.buffers[0] + slotIndex*slotSize + slot.done;
+		if (slot.isWrite)
+			++ioStats.writeCount;
+		else
+			++ioStats.readCount;
+		queueIoRingRequest(ring, slot.isWrite ? IORING_OP_WRITE : IORING_OP_READ, slot.isWrite ? destHandle : sourceHandle, buffer, slot.size - slot.done, slot.offset + slot.done, slotIndex);
+	};
+
+	u64 readOffset = 0;
+	uint inFlight = 0;
+	int error = 0;
+	const wchar_t* errorFile = nullptr;
+
+	while (true)
+	{
+		// Fill all free slots with reads. Stop as soon as something failed, we just need to drain what is in flight
+		while (!error && freeSlotCount && readOffset < fileSize)
+		{
+			uint slotIndex = freeSlots[--freeSlotCount];
+			Slot& slot = slots[slotIndex];
+			slot.offset = readOffset;
+			slot.size = (uint)min(u64(slotSize), fileSize - readOffset);
+			slot.done = 0;
+			slot.isWrite = false;
+			readOffset += slot.size;
+			queueSlot(slotIndex);
+			++inFlight;
+		}
+
+		if (!inFlight)
+			break;
+
+		++ioStats.ioRingSubmitCount;
+		ioStats.ioRingQueueDepthSum += inFlight;
+		ioStats.ioRingMaxQueueDepth = max(ioStats.ioRingMaxQueueDepth, inFlight);
+
+		if (!submitAndWaitIoRing(ring, 1))
+		{
+			// We can't return while kernel might still write into our buffers. Take back what was never submitted and drain the rest
+			if (!error)
+			{
+				error = errno;
+				errorFile = dest;
+			}
+			inFlight -= takeBackIoRingRequests(ring);
+			if (!inFlight)
+				break;
+			waitIoRing(ring);
+		}
+
+		uint head = *ring.cqHead;
+		uint tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head)
+		{
+			io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+			uint slotIndex = (uint)cqe.user_data;
+			Slot& slot = slots[slotIndex];
+			int res = cqe.res;
+
+			if (res < 0 || (res == 0 && !error))
+			{
+				if (!error)
+				{
+					error = res < 0 ? -res : EIO; // Zero bytes read means file was truncated while we were copying it
+					errorFile = slot.isWrite ? dest : source;
+				}
+			}
+			else if (!error)
+			{
+				slot.done += res;
+				if (slot.done != slot.size) // Partial read or write, queue rest of slot
+				{
+					queueSlot(slotIndex);
+					continue;
+				}
+
+				if (!slot.isWrite)
+				{
+					slot.isWrite = true;
+					slot.done = 0;
+					queueSlot(slotIndex);
+					continue;
+				}
+
+				outWritten += slot.size;
+			}
+
+			--inFlight;
+			freeSlots[freeSlotCount++] = slotIndex;
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	if (error)
+	{
+		logErrorf(L"Failed to copy %ls to %ls using io_uring. Error on %ls: %hs", source, dest, errorFile, strerror(error));
+		return false;
+	}
+
+	++ioStats.ioRingCopyCount;
+	return true;
+}
+
+static_assert(SmallFileBatchCount*SmallFileMaxSize <= CopyContextBufferSize*3, "Small file batch must fit in CopyContext buffers");
+static_assert(SmallFileBatchCount*7 <= IoRingEntryCount, "Small file batch must fit in io_uring submission queue");
+
+bool copySmallFilesIoRing(IoRing& ring, SmallFileCopyEntry* entries, uint entryCount, CopyContext& copyContext, IOStats& ioStats)
+{
+	// Files are opened as direct descriptors in to registered file slots since we don't know the fds when the chain is submitted
+	if (!ring.filesRegistered)
+	{
+		int slots[SmallFileBatchCount*2];
+		for (int& slot : slots)
+			slot = -1;
+		if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, slots, SmallFileBatchCount*2) != 0)
+		{
+			logDebugLinef(L"io_uring file registration not supported (%hs), small files will be copied one by one", strerror(errno));
+			ring.smallFileBatchUnsupported = true;
+			return false;
+		}
+		ring.filesRegistered = true;
+	}
+
+	TimerScope _(ioStats.ioRingBatchTime);
+	++ioStats.ioRingBatchCount;
+
+	// Source is stat'ed after the read so we can see if it changed after it was found. Read length is the size we found
+	enum { OpOpenRead, OpOpenWrite, OpRead, OpStat, OpWrite, OpCloseRead, OpCloseWrite, OpCount };
+
+	String paths[SmallFileBatchCount*2];
+	int results[SmallFileBatchCount][OpCount];
+	struct statx sourceStats[SmallFileBatchCount];
+
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		SmallFileCopyEntry& entry = entries[i];
+		entry.success = false;
+		entry.existed = false;
+		paths[i*2] = toLinuxPath(entry.source);
+		paths[i*2+1] = toLinuxPath(entry.dest);
+
+		uint readSlot = i*2;
+		uint writeSlot = i*2 + 1;
+		uint size = (uint)entry.sourceInfo.fileSize;
+		u8* buffer = copyContext.buffers[0] + i*SmallFileMaxSize;
+
+		auto queue = [&](uint op, u8 opcode, int fd, u64 addr, uint len, uint flags, uint fileIndex, uint openFlags, u64 addr2 = 0)
+		{
+			uint tail = *ring.sqTail;
+			uint index = tail & *ring.sqMask;
+			io_uring_sqe& sqe = ring.sqes[index];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = opcode;
+			sqe.flags = flags | (op != OpCloseWrite ? IOSQE_IO_LINK : 0);
+			sqe.fd = fd;
+			sqe.addr = addr;
+			sqe.len = len;
+			sqe.addr2 = addr2;
+			sqe.open_flags = openFlags;
+			sqe.file_index = fileIndex;
+			sqe.user_data = i*OpCount + op;
+			ring.sqArray[index] = index;
+			__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+			++ring.toSubmit;
+			results[i][op] = -ECANCELED;
+		};
+
+		queue(OpOpenRead, IORING_OP_OPENAT, AT_FDCWD, (u64)(uintptr_t)paths[i*2].c_str(), 0, 0, readSlot + 1, O_RDONLY);
+		queue(OpOpenWrite, IORING_OP_OPENAT, AT_FDCWD, (u64)(uintptr_t)paths[i*2+1].c_str(), 0644, 0, writeSlot + 1, O_WRONLY | O_CREAT | O_EXCL);
+		queue(OpRead, IORING_OP_READ, readSlot, (u64)(uintptr_t)buffer, size, IOSQE_FIXED_FILE, 0, 0);
+		queue(OpStat, IORING_OP_STATX, AT_FDCWD, (u64)(uintptr_t)paths[i*2].c_str(), STATX_SIZE | STATX_MTIME, 0, 0, 0, (u64)(uintptr_t)&sourceStats[i]);
+		queue(OpWrite, IORING_OP_WRITE, writeSlot, (u64)(uintptr_t)buffer, size, IOSQE_FIXED_FILE, 0, 0);
+		queue(OpCloseRead, IORING_OP_CLOSE, 0, 0, 0, 0, readSlot + 1, 0);
+		queue(OpCloseWrite, IORING_OP_CLOSE, 0, 0, 0, 0, writeSlot + 1, 0);
+	}
+
+	ioStats.createReadCount += entryCount;
+	ioStats.createWriteCount += entryCount;
+	ioStats.readCount += entryCount;
+	ioStats.writeCount += entryCount;
+
+	uint left = entryCount*OpCount;
+	while (left)
+	{
+		if (!submitAndWaitIoRing(ring, 1))
+		{
+			// Requests never submitted keep their canceled result and files are copied one by one instead
+			logDebugLinef(L"io_uring_enter failed while copying small files: %hs", strerror(errno));
+			left -= takeBackIoRingRequests(ring);
+			if (!left)
+				break;
+			waitIoRing(ring);
+			continue;
+		}
+
+		uint head = *ring.cqHead;
+		uint tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head, --left)
+		{
+			io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+			results[cqe.user_data / OpCount][cqe.user_data % OpCount] = cqe.res;
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	// Closes are canceled together with the rest of a broken chain. Files still in registered slots are closed here
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		for (uint op=OpOpenRead; op<=OpOpenWrite; ++op)
+		{
+			if (results[i][op] < 0 || results[i][OpCloseRead + op] >= 0)
+				continue;
+			int fd = -1;
+			io_uring_files_update update = { i*2 + op, 0, (u64)(uintptr_t)&fd };
+			syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+		}
+	}
+
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		SmallFileCopyEntry& entry = entries[i];
+		int* res = results[i];
+		if (res[OpOpenWrite] == -EEXIST)
+		{
+			entry.existed = true;
+			continue;
+		}
+
+		if (res[OpOpenRead] == -EINVAL) // Kernel does not support opening to direct descriptors, don't try again
+			ring.smallFileBatchUnsupported = true;
+
+		int size = (int)entry.sourceInfo.fileSize;
+		// A source that changed since it was found might have been read partially. Fallback copies it using its current size
+		const struct statx& sourceStat = sourceStats[i];
+		bool sourceChanged = res[OpStat] < 0 || sourceStat.stx_size != entry.sourceInfo.fileSize || sourceStat.stx_mtime.tv_sec != toTimespec(entry.sourceInfo.lastWriteTime).tv_sec;
+
+		if (res[OpOpenRead] < 0 || res[OpOpenWrite] < 0 || res[OpRead] != size || sourceChanged || res[OpWrite] != size || res[OpCloseWrite] < 0)
+		{
+			if (res[OpOpenWrite] >= 0) // We created the file but failed to fill it, remove it so the fallback can create it again
+				unlink(paths[i*2+1].c_str());
+			continue;
+		}
+
+		// There is no io_uring opcode for setting file times so this is done by path, same as copyFile does after close
+		++ioStats.setLastWriteTimeCount;
+		TimerScope _(ioStats.setLastWriteTime);
+		timespec times[2] = { { 0, UTIME_NOW }, toTimespec(entry.sourceInfo.lastWriteTime) };
+		if (utimensat(AT_FDCWD, paths[i*2+1].c_str(), times, 0) != 0)
+			continue;
+
+		entry.success = true;
+		++ioStats.ioRingBatchFileCount;
+	}
+
+	return true;
+}
+
+bool copyFileMapped(int sourceHandle, int destHandle, const wchar_t* source, u64 fileSize, u64& inOutWritten, IOStats& ioStats)
+{
+	FileHandle sourceFile = (FileHandle)(uintptr_t)sourceHandle;
+	const u8* data;
+	if (!mapFileRead(source, sourceFile, fileSize, data, ioStats))
+		return false;
+
+	bool success = true;
+	while (inOutWritten < fileSize)
+	{
+		++ioStats.writeCount;
+		TimerScope _(ioStats.writeTime);
+		ssize_t size = write(destHandle, data + inOutWritten, (size_t)min(fileSize - inOutWritten, u64(INT_MAX-1)));
+		if (size <= 0)
+		{
+			success = false;
+			break;
+		}
+		inOutWritten += size;
+	}
+	unmapFile(data, fileSize);
+
+	// Keep source position in sync with destination in case the rest is copied by another tier
+	lseek(sourceHandle, inOutWritten, SEEK_SET);
+	return success;
+}
+
+bool copyFileSparse(int sourceHandle, int destHandle, const wchar_t* source, const wchar_t* dest, u64 fileSize, u64& outWritten, CopyContext& copyContext, IOStats& ioStats)
+{
+	FileHandle sourceFile = (FileHandle)(uintptr_t)sourceHandle;
+	FileHandle destFile = (FileHandle)(uintptr_t)destHandle;
+
+	Vector<FileExtent> extents;
+	if (!getFileExtents(source, sourceFile, fileSize, extents, ioStats))
+		return false;
+
+	++ioStats.sparseCopyCount;
+	TimerScope _(ioStats.sparseCopyTime);
+
+	if (!setFileSparse(dest, destFile, fileSize, ioStats))
+		return false;
+
+	u8* buf = copyContext.buffers[0];
+	for (const FileExtent& extent : extents)
+	{
+		u64 offset = extent.offset;
+		u64 left = extent.size;
+		while (left)
+		{
+			size_t toRead = (size_t)min(left, u64(getChunkSize(copyContext, CopyContextBufferSize)));
+			ssize_t size;
+			{
+				++ioStats.readCount;
+				TimerScope _(ioStats.readTime);
+				size = pread(sourceHandle, buf, toRead, offset);
+				if (size == -1 && errno == EINVAL && clearDirectIOForTail(source, sourceHandle, buf, toRead, offset))
+					size = pread(sourceHandle, buf, toRead, offset);
+			}
+			if (size <= 0)
+			{
+				logErrorf(L"Failed to read %ls at offset %llu: %hs", source, offset, size == 0 ? "Unexpected end of file" : strerror(errno));
+				return false;
+			}
+
+			++ioStats.writeCount;
+			TimerScope _(ioStats.writeTime);
+			ssize_t written = pwrite(destHandle, buf, size, offset);
+			if (written == -1 && errno == EINVAL && clearDirectIOForTail(dest, destHandle, buf, size, offset))
+				written = pwrite(destHandle, buf, size, offset);
+			if (written != size)
+			{
+				logErrorf(L"Failed to write %ls at offset %llu: %hs", dest, offset, strerror(errno));
+				return false;
+			}
+			offset += size;
+			left -= size;
+		}
+	}
+
+	outWritten = fileSize;
+	return true;
+}
+
+#endif
+
+bool copySmallFiles(SmallFileCopyEntry* entries, uint entryCount, CopyContext& copyContext, IOStats& ioStats)
+{
+	#if defined(_WIN32)
+	return false;
+	#else
+	assert(entryCount <= SmallFileBatchCount);
+	IoRing* ring = getIoRing(copyContext);
+	if (!ring || ring->smallFileBatchUnsupported)
+		return false;
+	return copySmallFilesIoRing(*ring, entries, entryCount, copyContext, ioStats);
+	#endif
+}
+
+
+CopyContext::CopyContext()
+{
+	bufferMemory = new u8[CopyContextBufferSize * 3 + CopyContextBufferAlignment];
+	u8* data = (u8*)((uintptr_t(bufferMemory) + CopyContextBufferAlignment - 1) & ~uintptr_t(CopyContextBufferAlignment - 1));
+	buffers[0] = data + CopyContextBufferSize*0;
+	buffers[1] = data + CopyContextBufferSize*1;
+	buffers[2] = data + CopyContextBufferSize*2;
 }
 
 CopyContext::~CopyContext()
 {
-	delete[] buffers[0];
+	delete[] bufferMemory;
+	#if !defined(_WIN32)
+	destroyIoRing(ioRing);
+	#endif
 }
 
-bool copyFile(const wchar_t* source, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, IOStats& ioStats, UseBufferedIO useBufferedIO)
+bool copyFile(const wchar_t* source, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, IOStats& ioStats, UseBufferedIO useBufferedIO, uint ioRingQueueDepth, UseMappedIO useMappedIO, bool useTempFile)
 {
 	CopyContext copyContext;
 	FileInfo sourceInfo;
@@ -1700,14 +2848,41 @@ bool copyFile(const wchar_t* source, const wchar_t* dest, bool useSystemCopy, bo
 		logErrorf(L"Failed to copy source file %ls: File is a directory", source);
 		return false;
 	}
-	return copyFile(source, sourceInfo, sourceAttributes, dest, useSystemCopy, failIfExists, outExisted, outBytesCopied, copyContext, ioStats, useBufferedIO);
+	return copyFile(source, sourceInfo, sourceAttributes, dest, useSystemCopy, failIfExists, outExisted, outBytesCopied, copyContext, ioStats, useBufferedIO, ioRingQueueDepth, useMappedIO, useTempFile);
 }
 
-bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttributes, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, CopyContext& copyContext, IOStats& ioStats, UseBufferedIO useBufferedIO)
+bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttributes, const wchar_t* dest, bool useSystemCopy, bool failIfExists, bool& outExisted, u64& outBytesCopied, CopyContext& copyContext, IOStats& ioStats, UseBufferedIO useBufferedIO, uint ioRingQueueDepth, UseMappedIO useMappedIO, bool useTempFile)
 {
 	outExisted = false;
 	outBytesCopied = 0;
 
+	// Copy to temp file and move it in place once it is complete. Dest is then either the old file or the new file, never a partially written one
+	if (useTempFile)
+	{
+		if (failIfExists) // Cheap early out before copying. The move below is what guarantees dest is never replaced
+		{
+			FileInfo destInfo;
+			if (getFileInfo(destInfo, dest, ioStats))
+			{
+				outExisted = true;
+				return false;
+			}
+		}
+
+		WString tempFileName;
+		getTempFileName(tempFileName, dest);
+		ScopeGuard deleteTempGuard([&]() { deleteFile(tempFileName.c_str(), ioStats, false); });
+		bool tempExisted;
+		if (!copyFile(source, sourceInfo, sourceAttributes, tempFileName.c_str(), useSystemCopy, false, tempExisted, outBytesCopied, copyContext, ioStats, useBufferedIO, ioRingQueueDepth, useMappedIO, false))
+			return false;
+		if (!flushFile(tempFileName.c_str(), ioStats)) // Data must be on disk before the name points to it
+			return false;
+		if (!moveFile(tempFileName.c_str(), dest, ioStats, failIfExists, &outExisted))
+			return false;
+		deleteTempGuard.cancel();
+		return true;
+	}
+
 	#if defined(_WIN32)
 
 	// This kind of sucks but since machines might not have long paths enabled we have to work around it by making a symlink and copy through that
@@ -1760,6 +2935,9 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 		bool result = true;
 		
 		ScopeGuard destGuard([&]() { CloseHandle(osWrite.hEvent); result &= closeFile(dest, destFile, AccessType_Write, ioStats); });
+
+		if (!allocateFile(dest, destFile, sourceInfo.fileSize, ioStats))
+			return false;
 		
 		OVERLAPPED osRead  = {0,0,0};
 		osRead.Offset = 0;
@@ -1830,7 +3008,7 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 				++ioStats.readCount;
 				TimerScope _(ioStats.readTime);
 
-				uint toRead = (uint)min(left, u64(ReadChunkSize));
+				uint toRead = (uint)min(left, u64(getChunkSize(copyContext, ReadChunkSize)));
 				activeBufferIndex = (activeBufferIndex + 1) % 3;
 
 				uint toReadAligned = nobufferingFlag ? (((toRead + 4095) / 4096) * 4096) : toRead;
@@ -1914,11 +3092,14 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 
 	#else
 
+	// Unbuffered io only uses the user space loop since that is the only tier where we control alignment
+	bool useDirectIO = !getUseBufferedIO(useBufferedIO, sourceInfo.fileSize);
+
 	int destFlags = O_WRONLY | O_CREAT;
 	if (failIfExists)
 		destFlags |= O_EXCL;
 	String to = toLinuxPath(dest);
-    int destHandle = open(to.c_str(), destFlags, 0644);
+	int destHandle = openFileLinux(to, destFlags, 0644, !useDirectIO);
 	if (destHandle == -1)
 	{
 		if (errno == EEXIST)
@@ -1932,77 +3113,467 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 			t_lastError = FILE_ATTRIBUTE_READONLY;
 			return false;
 		}
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Failed to create file %ls: %hs", dest, strerror(errno));
 		return false;
 	}
 
 	String from = toLinuxPath(source);
-	int sourceHandle = open(from.c_str(), O_RDONLY, 0);
+	int sourceHandle = openFileLinux(from, O_RDONLY, 0, !useDirectIO);
 	if (sourceHandle == -1)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Failed to open file %ls: %hs", source, strerror(errno));
+		close(destHandle);
 		return false;
 	}
 
+	// Handles are closed on all error paths, success path closes them explicitly to check for errors
+	ScopeGuard closeHandles([&]() { close(sourceHandle); close(destHandle); });
+
 	u64 written = 0;
-	u8* buf = copyContext.buffers[0];
-    while (true)
+	bool copied = false;
+
+	// First tier, ask filesystem to share extents between source and dest
+	if (UseCloneFile)
 	{
-		size_t size = read(sourceHandle, buf, CopyContextBufferSize);
-		if (size == 0)
-			break;
-		if (size == -1)
-		{
-			EACOPY_NOT_IMPLEMENTED
-			break;
-		}
-        if (write(destHandle, buf, size) == -1)
+		TimerScope _(ioStats.cloneFileTime);
+		if (ioctl(destHandle, FICLONE, sourceHandle) == 0)
 		{
-			EACOPY_NOT_IMPLEMENTED
-			break;
+			struct stat destStat;
+			if (fstat(destHandle, &destStat) == 0)
+			{
+				++ioStats.cloneFileCount;
+				written = destStat.st_size;
+				copied = true;
+			}
+		}
+	}
+
+	// Files with holes only get their data extents copied, holes stay unallocated in destination
+	bool sparse = false;
+	if (UseSparseCopy && !copied)
+	{
+		struct stat sourceStat;
+		sparse = fstat(sourceHandle, &sourceStat) == 0 && u64(sourceStat.st_blocks) * 512 < u64(sourceStat.st_size);
+	}
+
+	if (!copied && !sparse)
+	{
+		FileHandle destFile = (FileHandle)(uintptr_t)destHandle;
+		if (!allocateFile(dest, destFile, sourceInfo.fileSize, ioStats))
+			return false;
+	}
+
+	if (sparse)
+	{
+		if (!copyFileSparse(sourceHandle, destHandle, source, dest, sourceInfo.fileSize, written, copyContext, ioStats))
+			return false;
+		copied = true;
+	}
+
+	// Second tier, io_uring with multiple reads and writes in flight. Only used when asked for since it replaces the in-kernel copy
+	if (ioRingQueueDepth && !copied && !useDirectIO && sourceInfo.fileSize >= IoRingCopyThreshold)
+	{
+		if (IoRing* ring = getIoRing(copyContext))
+		{
+			if (!copyFileIoRing(*ring, sourceHandle, destHandle, source, dest, sourceInfo.fileSize, written, copyContext, ioStats, ioRingQueueDepth))
+				return false;
+			copied = true;
+		}
+	}
+
+	// Mapped io writes straight from a mapping of the source instead of bouncing through copy context buffers.
+	// When forced it replaces the in-kernel copy, otherwise it only replaces the user space loop
+	bool useMapped = !useDirectIO && getUseMappedIO(useMappedIO, sourceInfo.fileSize);
+	if (useMapped && useMappedIO == UseMappedIO_Enabled && !copied)
+		copied = copyFileMapped(sourceHandle, destHandle, source, sourceInfo.fileSize, written, ioStats);
+
+	// Third tier, in-kernel copy. File offsets are advanced so user space loop can continue where this stopped
+	if (UseCopyFileRange && !copied && !useDirectIO)
+	{
+		TimerScope _(ioStats.copyFileRangeTime);
+		while (true)
+		{
+			ssize_t size = copy_file_range(sourceHandle, nullptr, destHandle, nullptr, CopyFileRangeChunkSize, 0);
+			if (size == 0)
+			{
+				++ioStats.copyFileRangeCount;
+				copied = true;
+				break;
+			}
+			if (size == -1)
+			{
+				// Not supported for this file system combination (cross-device on older kernels etc), fall back to read/write
+				if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL || errno == EBADF)
+					break;
+				logErrorf(L"Failed to copy file %ls to %ls: %hs", source, dest, strerror(errno));
+				return false;
+			}
+			written += size;
+		}
+	}
+
+	if (useMapped && !copied)
+		copied = copyFileMapped(sourceHandle, destHandle, source, sourceInfo.fileSize, written, ioStats);
+
+	// Last tier, bounce through user space
+	u8* buf = copyContext.buffers[0];
+    while (!copied)
+	{
+		ssize_t size;
+		{
+			++ioStats.readCount;
+			TimerScope _(ioStats.readTime);
+			size = read(sourceHandle, buf, getChunkSize(copyContext, CopyContextBufferSize));
+		}
+		if (size == 0)
+			break;
+		if (size == -1)
+		{
+			logErrorf(L"Fail reading file %ls: %hs", source, strerror(errno));
+			return false;
+		}
+
+		// Unbuffered writes must be aligned. Pad last block with zeros, file is truncated to real size after the loop
+		size_t toWrite = size;
+		if (useDirectIO && (size & (CopyContextBufferAlignment - 1)))
+		{
+			toWrite = (size + CopyContextBufferAlignment - 1) & ~size_t(CopyContextBufferAlignment - 1);
+			memset(buf + size, 0, toWrite - size);
+		}
+
+		++ioStats.writeCount;
+		TimerScope _(ioStats.writeTime);
+		if (write(destHandle, buf, toWrite) == -1)
+		{
+			logErrorf(L"Trying to write data to %ls: %hs", dest, strerror(errno));
+			return false;
 		}
 		written += size;
 	}
 
 	if (ftruncate(destHandle, written) == -1)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Failed to set size of file %ls: %hs", dest, strerror(errno));
 		return false;
 	}
 
 
-	if (close(sourceHandle) == -1)
+	// Set timestamps on the open handles, saves resolving both paths again after close
+	struct stat sourceStat;
+	if (fstat(sourceHandle, &sourceStat) == -1)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Failed to get info of file %ls: %hs", source, strerror(errno));
 		return false;
 	}
 
+	timespec times[2] = { { 0, UTIME_NOW }, { sourceStat.st_mtime, 0 } };
+	if (futimens(destHandle, times) == -1)
+	{
+		logErrorf(L"Failed to set file time on %ls: %hs", dest, strerror(errno));
+		return false;
+	}
+
+	closeHandles.cancel();
+	close(sourceHandle);
 	if (close(destHandle) == -1)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Failed to close file %ls: %hs", dest, strerror(errno));
 		return false;
 	}
 
+	outBytesCopied += written;
 
-	struct stat sourceStat;
-	if (stat(from.c_str(), &sourceStat) == -1)
+	return true;
+	#endif
+}
+
+bool createFileWithSize(const wchar_t* fullPath, u64 fileSize, IOStats& ioStats)
+{
+	++ioStats.createWriteCount;
+	TimerScope _(ioStats.createWriteTime);
+
+	#if defined(_WIN32)
+	WString temp;
+	fullPath = convertToShortPath(fullPath, temp);
+	HANDLE file = CreateFileW(fullPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == InvalidFileHandle)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		logErrorf(L"Trying to create file %ls: %ls", fullPath, getErrorText(fullPath, GetLastError()).c_str());
 		return false;
 	}
+	LARGE_INTEGER li;
+	li.QuadPart = fileSize;
+	bool success = SetFilePointerEx(file, li, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	if (!success)
+		logErrorf(L"Failed to set size of file %ls: %ls", fullPath, getLastErrorText().c_str());
+	CloseHandle(file);
+	return success;
+	#else
+	String path = toLinuxPath(fullPath);
+	int fileHandle = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fileHandle == -1)
+	{
+		logErrorf(L"Trying to create file %ls: %hs", fullPath, strerror(errno));
+		return false;
+	}
+	bool success = true;
+	if (UseFileAllocation && fallocate(fileHandle, 0, 0, fileSize) != 0 && (errno == ENOSPC || errno == EDQUOT))
+	{
+		logErrorf(L"Failed to allocate %ls for file %ls: %hs", toPretty(fileSize).c_str(), fullPath, strerror(errno));
+		success = false;
+	}
+	else if (ftruncate(fileHandle, fileSize) != 0) // No-op if allocation already set the size
+	{
+		logErrorf(L"Failed to set size of file %ls: %hs", fullPath, strerror(errno));
+		success = false;
+	}
+	close(fileHandle);
+	return success;
+	#endif
+}
 
-	utimbuf newTimes;
-	newTimes.actime = time(NULL);
-	newTimes.modtime = sourceStat.st_mtime;
+bool copyFileFanOut(const wchar_t* source, const FileInfo& sourceInfo, FanOutCopyEntry* entries, uint entryCount, CopyContext& copyContext, IOStats& ioStats, bool useTempFile)
+{
+	struct Writer { WString writePath; FileHandle handle = InvalidFileHandle; u64 writeTime = 0; bool active = false; };
+	Vector<Writer> writers(entryCount);
 
-	if (utime(to.c_str(), &newTimes) == -1)
+	// Closes and removes what was written so far. Caller is expected to copy the entries without success on their own
+	auto detach = [&](uint index)
 	{
-		EACOPY_NOT_IMPLEMENTED
+		Writer& writer = writers[index];
+		if (writer.handle != InvalidFileHandle)
+			closeFile(writer.writePath.c_str(), writer.handle, AccessType_Write, ioStats);
+		deleteFile(writer.writePath.c_str(), ioStats, false);
+		writer.active = false;
+	};
+	ScopeGuard detachGuard([&]() { for (uint i=0; i!=entryCount; ++i) if (writers[i].active) detach(i); });
+
+	// Holes would be written out as zeros. Leave sparse files to copyFile which keeps them sparse
+	if (isSparseFile(source, ioStats))
+		return false;
+
+	bool useBufferedIO = true;
+	FileHandle sourceFile;
+	if (!openFileRead(source, sourceFile, ioStats, useBufferedIO))
 		return false;
+	ScopeGuard sourceGuard([&]() { closeFile(source, sourceFile, AccessType_Read, ioStats); });
+
+	uint activeCount = 0;
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		FanOutCopyEntry& entry = entries[i];
+		entry.success = false;
+		entry.detached = false;
+		Writer& writer = writers[i];
+		writer.writePath = entry.dest;
+		if (useTempFile)
+			getTempFileName(writer.writePath, entry.dest);
+		writer.active = openFileWrite(writer.writePath.c_str(), writer.handle, ioStats, useBufferedIO);
+		if (!writer.active)
+			continue;
+		if (!allocateFile(writer.writePath.c_str(), writer.handle, sourceInfo.fileSize, ioStats))
+		{
+			detach(i);
+			continue;
+		}
+		++activeCount;
 	}
 
-	outBytesCopied += written;
+	uint chunkSize = getChunkSize(copyContext, CopyContextBufferSize);
+	u64 fileSize = 0;
+	while (activeCount)
+	{
+		u64 read;
+		if (!readFile(source, sourceFile, copyContext.buffers[0], chunkSize, read, ioStats))
+			return false;
+		if (read == 0)
+			break;
+		fileSize += read;
+
+		u64 fastestWriteTime = ~u64(0);
+		for (uint i=0; i!=entryCount; ++i)
+		{
+			Writer& writer = writers[i];
+			if (!writer.active)
+				continue;
+			u64 startTime = getTime();
+			if (!writeFile(writer.writePath.c_str(), writer.handle, copyContext.buffers[0], read, ioStats))
+			{
+				detach(i);
+				--activeCount;
+				continue;
+			}
+			writer.writeTime += getTime() - startTime;
+			fastestWriteTime = min(fastestWriteTime, writer.writeTime);
+		}
+
+		// Destinations falling too far behind the fastest one are detached so a slow share doesn't stall the others
+		if (activeCount < 2)
+			continue;
+		for (uint i=0; i!=entryCount; ++i)
+		{
+			Writer& writer = writers[i];
+			if (!writer.active || writer.writeTime < fastestWriteTime * FanOutMaxLagFactor || writer.writeTime - fastestWriteTime < u64(FanOutMinLagMs) * 10000)
+				continue;
+			detach(i);
+			entries[i].detached = true;
+			--activeCount;
+		}
+	}
 
+	for (uint i=0; i!=entryCount; ++i)
+	{
+		Writer& writer = writers[i];
+		if (!writer.active)
+			continue;
+		FanOutCopyEntry& entry = entries[i];
+		if (!setFileLastWriteTime(writer.writePath.c_str(), writer.handle, sourceInfo.lastWriteTime, ioStats))
+			continue;
+		if (!closeFile(writer.writePath.c_str(), writer.handle, AccessType_Write, ioStats))
+			continue;
+		if (useTempFile && (!flushFile(writer.writePath.c_str(), ioStats) || !moveFile(writer.writePath.c_str(), entry.dest, ioStats)))
+			continue;
+		writer.active = false;
+		entry.success = true;
+		entry.written = fileSize;
+	}
+	return true;
+}
+
+bool copyFilePart(const wchar_t* source, const wchar_t* dest, u64 offset, u64 size, CopyContext& copyContext, IOStats& ioStats)
+{
+	u8* buffer = copyContext.buffers[0];
+
+	#if defined(_WIN32)
+	WString tempBuffer1;
+	source = convertToShortPath(source, tempBuffer1);
+	WString tempBuffer2;
+	dest = convertToShortPath(dest, tempBuffer2);
+
+	HANDLE sourceFile;
+	{
+		++ioStats.createReadCount;
+		TimerScope _(ioStats.createReadTime);
+		sourceFile = CreateFileW(source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	}
+	if (sourceFile == InvalidFileHandle)
+	{
+		logErrorf(L"Failed to open file %ls for read: %ls", source, getErrorText(source, GetLastError()).c_str());
+		return false;
+	}
+	bool result = true;
+	ScopeGuard sourceGuard([&]() { result &= closeFile(source, sourceFile, AccessType_Read, ioStats); });
+
+	HANDLE destFile;
+	{
+		++ioStats.createWriteCount;
+		TimerScope _(ioStats.createWriteTime);
+		destFile = CreateFileW(dest, FILE_WRITE_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL); // Other parts are written by other threads
+	}
+	if (destFile == InvalidFileHandle)
+	{
+		logErrorf(L"Failed to open file %ls for write: %ls", dest, getErrorText(dest, GetLastError()).c_str());
+		return false;
+	}
+	ScopeGuard destGuard([&]() { result &= closeFile(dest, destFile, AccessType_Write, ioStats); });
+
+	while (size)
+	{
+		uint toCopy = (uint)min(size, u64(getChunkSize(copyContext, CopyContextBufferSize)));
+		OVERLAPPED ov = {0,0,0};
+		ov.Offset = (uint)offset;
+		ov.OffsetHigh = (uint)(offset >> 32);
+
+		DWORD read = 0;
+		{
+			++ioStats.readCount;
+			TimerScope _(ioStats.readTime);
+			if (!ReadFile(sourceFile, buffer, toCopy, &read, &ov))
+			{
+				logErrorf(L"Fail reading file %ls: %ls", source, getLastErrorText().c_str());
+				return false;
+			}
+		}
+		if (read != toCopy)
+		{
+			logErrorf(L"Fail reading file %ls: File was changed while being copied", source);
+			return false;
+		}
+
+		DWORD written = 0;
+		{
+			++ioStats.writeCount;
+			TimerScope _(ioStats.writeTime);
+			if (!WriteFile(destFile, buffer, toCopy, &written, &ov) || written != toCopy)
+			{
+				logErrorf(L"Fail writing file %ls: %ls", dest, getLastErrorText().c_str());
+				return false;
+			}
+		}
+
+		offset += toCopy;
+		size -= toCopy;
+	}
+	return result;
+	#else
+	String from = toLinuxPath(source);
+	int sourceHandle;
+	{
+		++ioStats.createReadCount;
+		TimerScope _(ioStats.createReadTime);
+		sourceHandle = open(from.c_str(), O_RDONLY, 0);
+	}
+	if (sourceHandle == -1)
+	{
+		logErrorf(L"Failed to open file %ls for read: %hs", source, strerror(errno));
+		return false;
+	}
+	ScopeGuard sourceGuard([&]() { close(sourceHandle); });
+
+	String to = toLinuxPath(dest);
+	int destHandle;
+	{
+		++ioStats.createWriteCount;
+		TimerScope _(ioStats.createWriteTime);
+		destHandle = open(to.c_str(), O_WRONLY, 0);
+	}
+	if (destHandle == -1)
+	{
+		logErrorf(L"Failed to open file %ls for write: %hs", dest, strerror(errno));
+		return false;
+	}
+	ScopeGuard destGuard([&]() { close(destHandle); });
+
+	while (size)
+	{
+		ssize_t read;
+		{
+			++ioStats.readCount;
+			TimerScope _(ioStats.readTime);
+			read = pread(sourceHandle, buffer, min(size, u64(getChunkSize(copyContext, CopyContextBufferSize))), offset);
+		}
+		if (read <= 0)
+		{
+			logErrorf(L"Fail reading file %ls: %hs", source, read == 0 ? "File was changed while being copied" : strerror(errno));
+			return false;
+		}
+
+		++ioStats.writeCount;
+		TimerScope _(ioStats.writeTime);
+		for (ssize_t written = 0; written != read;)
+		{
+			ssize_t res = pwrite(destHandle, buffer + written, read - written, offset + written);
+			if (res == -1)
+			{
+				logErrorf(L"Fail writing file %ls: %hs", dest, strerror(errno));
+				return false;
+			}
+			written += res;
+		}
+
+		offset += read;
+		size -= read;
+	}
 	return true;
 	#endif
 }
@@ -2018,35 +3589,183 @@ bool deleteFile(const wchar_t* fullPath, IOStats& ioStats, bool errorOnMissingFi
 	if (DeleteFileW(fullPath) != 0)
 		return true;
 
-	uint error = GetLastError();
-	if (!isError(error, errorOnMissingFile))
-		return true;
+	uint error = GetLastError();
+	if (!isError(error, errorOnMissingFile))
+		return true;
+
+	if (ERROR_FILE_NOT_FOUND == error)
+	{
+		logErrorf(L"File not found. Failed to delete file %ls", fullPath);
+		return false;
+	}
+	logErrorf(L"Failed to delete file %ls. Reason: %ls", fullPath, getErrorText(error).c_str());
+	return false;
+	#else
+
+	String file = toLinuxPath(validFullPath);
+	if (remove(file.c_str()) == 0)
+		return true;
+	if (errno == ENOENT && !errorOnMissingFile)
+		return true;
+	EACOPY_NOT_IMPLEMENTED
+	return false;
+	#endif
+}
+
+bool moveFile(const wchar_t* source, const wchar_t* dest, IOStats& ioStats, bool failIfExists, bool* outExisted)
+{
+	++ioStats.moveFileCount;
+	TimerScope _(ioStats.moveFileTime);
+	#if defined(_WIN32)
+	if (MoveFileExW(source, dest, failIfExists ? 0 : MOVEFILE_REPLACE_EXISTING))
+		return true;
+	uint error = GetLastError();
+	if (failIfExists && (error == ERROR_ALREADY_EXISTS || error == ERROR_FILE_EXISTS))
+	{
+		if (outExisted)
+			*outExisted = true;
+		return false;
+	}
+	logErrorf(L"Failed to move file from %ls to %ls. Reason: %ls", source, dest, getErrorText(error).c_str());
+	return false;
+	#else
+	String from = toLinuxPath(source);
+	String to = toLinuxPath(dest);
+	int res;
+	if (!failIfExists)
+		res = rename(from.c_str(), to.c_str());
+	else
+	{
+		res = (int)syscall(SYS_renameat2, AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE);
+		if (res == -1 && (errno == EINVAL || errno == ENOSYS)) // File system or kernel without RENAME_NOREPLACE. link fails atomically if dest exists
+		{
+			res = link(from.c_str(), to.c_str());
+			if (res == 0)
+				unlink(from.c_str());
+		}
+	}
+	if (res == 0)
+		return true;
+	if (failIfExists && errno == EEXIST)
+	{
+		if (outExisted)
+			*outExisted = true;
+		return false;
+	}
+	logErrorf(L"Failed to move file from %ls to %ls. Reason: %hs", source, dest, strerror(errno));
+	return false;
+	#endif
+}
+
+void getTempFileName(WString& outTempFileName, const wchar_t* fullPath)
+{
+	outTempFileName.clear();
+	const wchar_t* lastSlash = wcsrchr(fullPath, L'\\');
+	const wchar_t* fileName = fullPath;
+	if (lastSlash)
+	{
+		outTempFileName.append(fullPath, lastSlash + 1);
+		fileName = lastSlash + 1;
+	}
+
+	// Process and thread ids make the name unique among writers of the same file, including other EACopy processes
+	#if defined(_WIN32)
+	uint processId = GetCurrentProcessId();
+	uint threadId = GetCurrentThreadId();
+	#else
+	uint processId = (uint)getpid();
+	uint threadId = (uint)syscall(SYS_gettid);
+	#endif
+
+	wchar_t suffix[32];
+	swprintf(suffix, eacopy_sizeof_array(suffix), L".%x.%x.tmp", processId, threadId);
+
+	// File names are limited to 255 (bytes on linux, utf-16 units on windows). Names too long to also fit prefix and
+	// suffix are replaced by a hash of the name, temp files are never looked up by name
+	enum { MaxFileNameLength = 255 };
+	#if defined(_WIN32)
+	size_t nameLength = wcslen(fileName);
+	#else
+	size_t nameLength = toString(fileName).size();
+	#endif
+	outTempFileName += L'.';
+	if (1 + nameLength + wcslen(suffix) <= MaxFileNameLength)
+		outTempFileName += fileName;
+	else
+	{
+		u64 hash = 14695981039346656037ull; // FNV-1a
+		for (const wchar_t* it = fileName; *it; ++it)
+			hash = (hash ^ u64(*it)) * 1099511628211ull;
+		wchar_t hashName[24];
+		swprintf(hashName, eacopy_sizeof_array(hashName), L"%016llx", hash);
+		outTempFileName += hashName;
+	}
+	outTempFileName += suffix;
+}
+
+bool flushFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	++ioStats.flushFileCount;
+	TimerScope _(ioStats.flushFileTime);
+
+	#if defined(_WIN32)
+	WString temp;
+	fullPath = convertToShortPath(fullPath, temp);
+
+	// Flushing needs write access. Copied attributes might have made the file read only
+	DWORD attributes = GetFileAttributesW(fullPath);
+	bool readOnly = attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_READONLY);
+	if (readOnly)
+		SetFileAttributesW(fullPath, attributes & ~FILE_ATTRIBUTE_READONLY);
+	ScopeGuard attributesGuard([&]() { if (readOnly) SetFileAttributesW(fullPath, attributes); });
 
-	if (ERROR_FILE_NOT_FOUND == error)
+	HANDLE handle = CreateFileW(fullPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
 	{
-		logErrorf(L"File not found. Failed to delete file %ls", fullPath);
+		logErrorf(L"Failed to open %ls to flush it: %ls", fullPath, getErrorText(fullPath, GetLastError()).c_str());
 		return false;
 	}
-	logErrorf(L"Failed to delete file %ls. Reason: %ls", fullPath, getErrorText(error).c_str());
+	ScopeGuard closeGuard([&]() { CloseHandle(handle); });
+	if (FlushFileBuffers(handle))
+		return true;
+	logErrorf(L"Failed to flush %ls: %ls", fullPath, getLastErrorText().c_str());
 	return false;
 	#else
-
-	String file = toLinuxPath(validFullPath);
-	if (remove(file.c_str()) == 0)
+	int fd = open(toLinuxPath(fullPath).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		logErrorf(L"Failed to open %ls to flush it: %hs", fullPath, strerror(errno));
+		return false;
+	}
+	ScopeGuard closeGuard([&]() { close(fd); });
+	if (fsync(fd) == 0)
 		return true;
-	EACOPY_NOT_IMPLEMENTED
+	logErrorf(L"Failed to flush %ls: %hs", fullPath, strerror(errno));
 	return false;
 	#endif
 }
 
-bool moveFile(const wchar_t* source, const wchar_t* dest, IOStats& ioStats)
+bool getDeviceId(const wchar_t* path, u64& outDeviceId, IOStats& ioStats)
 {
-	++ioStats.moveFileCount;
-	TimerScope _(ioStats.moveFileTime);
-	if (MoveFileExW(source, dest, MOVEFILE_REPLACE_EXISTING))
-		return true;
-	logErrorf(L"Failed to move file from %ls to %ls. Reason: %ls", source, dest, getLastErrorText().c_str());
-	return false;
+	++ioStats.fileInfoCount;
+	TimerScope _(ioStats.fileInfoTime);
+
+	#if defined(_WIN32)
+	wchar_t volumePath[MAX_PATH];
+	if (!GetVolumePathNameW(path, volumePath, MAX_PATH))
+		return false;
+	DWORD serialNumber;
+	if (!GetVolumeInformationW(volumePath, NULL, 0, &serialNumber, NULL, NULL, NULL, 0))
+		return false;
+	outDeviceId = serialNumber;
+	return true;
+	#else
+	struct stat st;
+	if (stat(toLinuxPath(path).c_str(), &st) == -1)
+		return false;
+	outDeviceId = st.st_dev;
+	return true;
+	#endif
 }
 
 bool setFileWritable(const wchar_t* fullPath, bool writable)
@@ -2108,7 +3827,7 @@ bool setFileHidden(const wchar_t* fullPath, bool hidden)
 	fullPath = convertToShortPath(fullPath, temp);
 	return SetFileAttributesW(fullPath, hidden ? FILE_ATTRIBUTE_HIDDEN : FILE_ATTRIBUTE_NORMAL) != 0;
 #else
-	EACOPY_NOT_IMPLEMENTED
+	return true; // Hidden is part of the file name on linux (leading dot)
 #endif
 }
 
@@ -2180,6 +3899,226 @@ bool startsWithIgnoreCase(const wchar_t* str, const wchar_t* substr)
 	#endif
 }
 
+WildcardMatcher::WildcardMatcher(const wchar_t* pattern)
+{
+	// Spaces around a single pattern are ignored, same as around each alternative in matchWildcard
+	WString trimmed;
+	if (!wcschr(pattern, L';'))
+	{
+		while (*pattern == L' ')
+			++pattern;
+		size_t len = wcslen(pattern);
+		if (len && pattern[len - 1] == L' ')
+		{
+			while (len && pattern[len - 1] == L' ')
+				--len;
+			trimmed.assign(pattern, len);
+			pattern = trimmed.c_str();
+		}
+	}
+
+	// Classify pattern so common forms can be matched with a single compare
+	const wchar_t* firstWildcard = wcspbrk(pattern, L"*?");
+	const wchar_t* lastWildcard = firstWildcard ? wcsrchr(pattern, *firstWildcard) : nullptr;
+	bool singleStar = firstWildcard && *firstWildcard == L'*' && firstWildcard == lastWildcard && !wcschr(pattern, L'?');
+	if (wcschr(pattern, L';'))
+	{
+		m_kind = Kind_Generic;
+		m_pattern = pattern;
+	}
+	else if (stringEquals(pattern, L"*") || stringEquals(pattern, L"*.*"))
+		m_kind = Kind_All;
+	else if (!firstWildcard)
+	{
+		m_kind = Kind_Exact;
+		m_pattern = pattern;
+	}
+	else if (singleStar && !firstWildcard[1])
+	{
+		m_kind = Kind_Prefix;
+		m_pattern.assign(pattern, firstWildcard);
+	}
+	else if (singleStar && firstWildcard == pattern)
+	{
+		m_kind = Kind_Suffix;
+		m_pattern = pattern + 1;
+	}
+	else
+	{
+		m_kind = Kind_Generic;
+		m_pattern = pattern;
+	}
+}
+
+bool WildcardMatcher::match(const wchar_t* name) const
+{
+	switch (m_kind)
+	{
+	case Kind_All:
+		return true;
+	case Kind_Exact:
+		return _wcsicmp(name, m_pattern.c_str()) == 0;
+	case Kind_Prefix:
+		return _wcsnicmp(name, m_pattern.c_str(), m_pattern.size()) == 0;
+	case Kind_Suffix:
+		{
+			size_t nameLen = wcslen(name);
+			return nameLen >= m_pattern.size() && _wcsicmp(name + nameLen - m_pattern.size(), m_pattern.c_str()) == 0;
+		}
+	default:
+		return matchWildcard(name, m_pattern.c_str());
+	}
+}
+
+bool matchWildcardAlternative(const wchar_t* name, const wchar_t* pattern, const wchar_t* patternEnd)
+{
+	if (patternEnd - pattern == 3 && wcsncmp(pattern, L"*.*", 3) == 0)
+		return true;
+
+	// Iterative matching. On mismatch we backtrack to last star and let it eat one more character
+	const wchar_t* starPattern = nullptr;
+	const wchar_t* starName = nullptr;
+	while (*name)
+	{
+		if (pattern != patternEnd && *pattern == L'*')
+		{
+			starPattern = ++pattern;
+			starName = name;
+		}
+		else if (pattern != patternEnd && (*pattern == L'?' || towlower(*pattern) == towlower(*name)))
+		{
+			++pattern;
+			++name;
+		}
+		else if (starPattern)
+		{
+			pattern = starPattern;
+			name = ++starName;
+		}
+		else
+			return false;
+	}
+	while (pattern != patternEnd && *pattern == L'*')
+		++pattern;
+	return pattern == patternEnd;
+}
+
+bool matchWildcard(const wchar_t* name, const wchar_t* pattern)
+{
+	while (true)
+	{
+		while (*pattern == L' ')
+			++pattern;
+		const wchar_t* separator = wcschr(pattern, L';');
+		const wchar_t* patternEnd = separator ? separator : pattern + wcslen(pattern);
+		while (patternEnd != pattern && patternEnd[-1] == L' ')
+			--patternEnd;
+		if (matchWildcardAlternative(name, pattern, patternEnd))
+			return true;
+		if (!separator)
+			return false;
+		pattern = separator + 1;
+	}
+}
+
+void WildcardSetMatcher::add(const wchar_t* pattern)
+{
+	// Split alternatives so each of them can go where it matches fastest
+	while (true)
+	{
+		while (*pattern == L' ')
+			++pattern;
+		const wchar_t* patternEnd = wcschr(pattern, L';');
+		WildcardMatcher matcher(WString(pattern, patternEnd ? patternEnd : pattern + wcslen(pattern)).c_str()); // Trims trailing spaces
+		const WString& literal = matcher.getPattern();
+		switch (matcher.getKind())
+		{
+		case WildcardMatcher::Kind_All:
+			m_matchAll = true;
+			break;
+		case WildcardMatcher::Kind_Exact:
+			insert(m_forward, literal.c_str(), literal.c_str() + literal.size(), false).exact = true;
+			break;
+		case WildcardMatcher::Kind_Prefix:
+			insert(m_forward, literal.c_str(), literal.c_str() + literal.size(), false).any = true;
+			break;
+		case WildcardMatcher::Kind_Suffix:
+			insert(m_backward, literal.c_str(), literal.c_str() + literal.size(), true).any = true;
+			break;
+		default:
+			m_generic.push_back(std::move(matcher));
+			break;
+		}
+		if (!patternEnd)
+			return;
+		pattern = patternEnd + 1;
+	}
+}
+
+bool WildcardSetMatcher::match(const wchar_t* name) const
+{
+	if (m_matchAll)
+		return true;
+
+	const wchar_t* nameEnd = name + wcslen(name);
+
+	const Node* node = &m_forward[0];
+	for (const wchar_t* it = name; node; ++it)
+	{
+		if (node->any || (it == nameEnd && node->exact))
+			return true;
+		if (it == nameEnd)
+			break;
+		node = findChild(m_forward, *node, *it);
+	}
+
+	node = &m_backward[0];
+	for (const wchar_t* it = nameEnd; node; --it)
+	{
+		if (node->any)
+			return true;
+		if (it == name)
+			break;
+		node = findChild(m_backward, *node, it[-1]);
+	}
+
+	for (auto& matcher : m_generic)
+		if (matcher.match(name))
+			return true;
+	return false;
+}
+
+WildcardSetMatcher::Node& WildcardSetMatcher::insert(Vector<Node>& trie, const wchar_t* str, const wchar_t* strEnd, bool reverse)
+{
+	uint nodeIndex = 0;
+	for (uint i=0, e=uint(strEnd - str); i!=e; ++i)
+	{
+		wchar_t c = towlower(reverse ? strEnd[-1 - int(i)] : str[i]);
+		auto& children = trie[nodeIndex].children;
+		auto it = std::lower_bound(children.begin(), children.end(), c, [](const std::pair<wchar_t, uint>& child, wchar_t c) { return child.first < c; });
+		if (it != children.end() && it->first == c)
+		{
+			nodeIndex = it->second;
+			continue;
+		}
+		uint childIndex = uint(trie.size());
+		children.insert(it, { c, childIndex });
+		trie.emplace_back(); // Invalidates children reference
+		nodeIndex = childIndex;
+	}
+	return trie[nodeIndex];
+}
+
+const WildcardSetMatcher::Node* WildcardSetMatcher::findChild(const Vector<Node>& trie, const Node& node, wchar_t c)
+{
+	c = towlower(c);
+	auto& children = node.children;
+	auto it = std::lower_bound(children.begin(), children.end(), c, [](const std::pair<wchar_t, uint>& child, wchar_t c) { return child.first < c; });
+	if (it == children.end() || it->first != c)
+		return nullptr;
+	return &trie[it->second];
+}
+
 WString getErrorText(uint error)
 {
 	#if defined(_WIN32)
@@ -2352,6 +4291,12 @@ String toString(const wchar_t* str)
 	return std::wstring_convert<convert_type, wchar_t>().to_bytes( str );
 }
 
+WString toWString(const char* str)
+{
+	using convert_type = std::codecvt_utf8<wchar_t>;
+	return std::wstring_convert<convert_type, wchar_t>().from_bytes( str );
+}
+
 void itow(int value, wchar_t* dst, uint dstCapacity)
 {
 	#if defined(_WIN32)
@@ -2691,6 +4636,294 @@ FileDatabase::writeFile(const wchar_t* fullPath, IOStats& ioStats)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+constexpr u8 scanCacheCookie[] = "eacopyscan003";
+
+// Converts file time to same unit and epoch as getTime
+u64 fileTimeToTime(const FileTime& fileTime)
+{
+	#if defined(_WIN32)
+	return ((u64(fileTime.dwHighDateTime) << 32) | fileTime.dwLowDateTime) - 116444736000000000LL;
+	#else
+	// Seconds are stored with high bits in dwLowDateTime, see getFileInfo
+	return (((u64(fileTime.dwLowDateTime) << 32) | fileTime.dwHighDateTime) + 11644473600LL) * 10000000LL;
+	#endif
+}
+
+const ScanCache::Entries*
+ScanCache::getEntries(const WString& directory, const FileTime& lastWriteTime)
+{
+	ScopedCriticalSection cs(m_cs);
+	auto findIt = m_dirs.find(directory);
+	if (findIt == m_dirs.end() || memcmp(&findIt->second.lastWriteTime, &lastWriteTime, sizeof(FileTime)) != 0)
+		return nullptr;
+	findIt->second.used |= !findIt->second.visited; // Racy records added this run stay unsaved
+	findIt->second.visited = true;
+	return &findIt->second.entries;
+}
+
+const ScanCache::Entries*
+ScanCache::addEntries(const WString& directory, const FileTime& lastWriteTime, Entries&& entries)
+{
+	// Directory modified just before it was listed might be modified again without write time changing (coarse time
+	// resolution). Those listings are used for this run but not saved
+	bool racy = getTime() < fileTimeToTime(lastWriteTime) + ScanCacheRacyTimeMs * 10000;
+
+	ScopedCriticalSection cs(m_cs);
+	DirRec& rec = m_dirs[directory];
+	if (rec.visited)
+		return memcmp(&rec.lastWriteTime, &lastWriteTime, sizeof(FileTime)) == 0 ? &rec.entries : nullptr;
+	rec.lastWriteTime = lastWriteTime;
+	rec.entries = std::move(entries);
+	rec.used = !racy;
+	rec.visited = true;
+	return &rec.entries;
+}
+
+uint
+ScanCache::getDirectoryCount()
+{
+	ScopedCriticalSection cs(m_cs);
+	return uint(m_dirs.size());
+}
+
+void
+ScanCache::readFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	m_cs.scoped([&]() { m_dirs.clear(); });
+
+	FileInfo fileInfo;
+	if (!getFileInfo(fileInfo, fullPath, ioStats))
+		return;
+
+	// Read all of it in one go, there can be millions of entries
+	Vector<u8> data;
+	data.resize(fileInfo.fileSize);
+	{
+		FileHandle handle;
+		if (!openFileRead(fullPath, handle, ioStats, true))
+			return;
+		ScopeGuard fileGuard([&]() { closeFile(fullPath, handle, AccessType_Read, ioStats); });
+		u64 read = 0;
+		if (!eacopy::readFile(fullPath, handle, data.data(), data.size(), read, ioStats) || read != data.size())
+			return;
+	}
+
+	const u8* pos = data.data();
+	const u8* end = pos + data.size();
+	auto readData = [&](void* dest, u64 size) { if (u64(end - pos) < size) return false; memcpy(dest, pos, size); pos += size; return true; };
+	auto readString = [&](WString& dest)
+	{
+		u16 len;
+		if (!readData(&len, sizeof(len)) || u64(end - pos) < len*sizeof(wchar_t))
+			return false;
+		dest.assign((const wchar_t*)pos, len);
+		pos += len*sizeof(wchar_t);
+		return true;
+	};
+
+	u8 readCookie[sizeof(scanCacheCookie)];
+	if (!readData(readCookie, sizeof(readCookie)) || memcmp(readCookie, scanCacheCookie, sizeof(readCookie)) != 0)
+	{
+		logInfof(L"Scan cache cookie mismatch %ls", fullPath);
+		return;
+	}
+
+	Map<WString, DirRec> dirs;
+	while (true)
+	{
+		WString directory;
+		if (!readString(directory))
+			break;
+		if (directory.empty()) // Terminator
+		{
+			ScopedCriticalSection cs(m_cs);
+			m_dirs.swap(dirs);
+			return;
+		}
+
+		DirRec rec;
+		uint entryCount;
+		if (!readData(&rec.lastWriteTime, sizeof(rec.lastWriteTime)) || !readData(&entryCount, sizeof(entryCount)))
+			break;
+		rec.entries.resize(entryCount);
+		bool success = true;
+		for (auto& entry : rec.entries)
+			success = success && readString(entry.name) && readData(&entry.info, sizeof(entry.info)) && readData(&entry.attributes, sizeof(entry.attributes));
+		if (!success)
+			break;
+		dirs.insert({std::move(directory), std::move(rec)});
+	}
+
+	logInfof(L"Failed to read complete scan cache %ls", fullPath);
+}
+
+bool
+ScanCache::writeFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	// A failed write must not leave a truncated cache behind, next run would read it as valid up to where it stops
+	WString tempPath;
+	getTempFileName(tempPath, fullPath);
+	if (writeEntries(tempPath.c_str(), ioStats) && moveFile(tempPath.c_str(), fullPath, ioStats))
+		return true;
+	deleteFile(tempPath.c_str(), ioStats, false);
+	logErrorf(L"Failed to write scan cache %ls", fullPath);
+	return false;
+}
+
+bool
+ScanCache::writeEntries(const wchar_t* fullPath, IOStats& ioStats)
+{
+	FileHandle handle;
+	if (!openFileWrite(fullPath, handle, ioStats, true))
+		return false;
+	bool closed = false;
+	ScopeGuard fileGuard([&]() { if (!closed) closeFile(fullPath, handle, AccessType_Write, ioStats); });
+
+	// Entries are serialized to a buffer that is written when full
+	Vector<u8> buffer;
+	buffer.reserve(CopyContextBufferSize);
+	bool success = true;
+	auto flush = [&]()
+	{
+		success = success && eacopy::writeFile(fullPath, handle, buffer.data(), buffer.size(), ioStats);
+		buffer.clear();
+	};
+	auto writeData = [&](const void* data, u64 size)
+	{
+		buffer.insert(buffer.end(), (const u8*)data, (const u8*)data + size);
+		if (buffer.size() >= CopyContextBufferSize)
+			flush();
+	};
+	auto writeString = [&](const WString& str)
+	{
+		u16 len = u16(str.size());
+		writeData(&len, sizeof(len));
+		writeData(str.c_str(), len*sizeof(wchar_t));
+	};
+
+	writeData(scanCacheCookie, sizeof(scanCacheCookie));
+
+	// Only directories that were part of this run are kept
+	ScopedCriticalSection cs(m_cs);
+	for (auto& kv : m_dirs)
+	{
+		const DirRec& rec = kv.second;
+		if (!rec.used)
+			continue;
+		writeString(kv.first);
+		writeData(&rec.lastWriteTime, sizeof(rec.lastWriteTime));
+		uint entryCount = uint(rec.entries.size());
+		writeData(&entryCount, sizeof(entryCount));
+		for (auto& entry : rec.entries)
+		{
+			writeString(entry.name);
+			writeData(&entry.info, sizeof(entry.info));
+			writeData(&entry.attributes, sizeof(entry.attributes));
+		}
+	}
+
+	writeString(WString()); // Terminator
+	flush();
+
+	closed = true;
+	return closeFile(fullPath, handle, AccessType_Write, ioStats) && success;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const uint g_chunkSizeCandidates[] = { 256*1024, 512*1024, 1024*1024, 2*1024*1024, 4*1024*1024, 8*1024*1024 };
+static const uint g_ioRingQueueDepthCandidates[] = { 2, 4, 8, 16, MaxIoRingQueueDepth };
+static_assert(eacopy_sizeof_array(g_chunkSizeCandidates) <= 8 && eacopy_sizeof_array(g_ioRingQueueDepthCandidates) <= 8, "CopyTuner::m_samples too small");
+
+void
+CopyTuner::init(uint chunkSize, bool tuneChunkSize, uint ioRingQueueDepth, bool tuneIoRingQueueDepth)
+{
+	ScopedCriticalSection cs(m_cs);
+	m_chunkSize = chunkSize;
+	m_ioRingQueueDepth = ioRingQueueDepth;
+	m_tuneIoRingQueueDepth = tuneIoRingQueueDepth && ioRingQueueDepth;
+	m_phase = tuneChunkSize ? Phase_ChunkSize : (m_tuneIoRingQueueDepth ? Phase_IoRingQueueDepth : Phase_Done);
+	m_candidateIndex = 0;
+	for (Sample& sample : m_samples)
+		sample = Sample();
+}
+
+bool
+CopyTuner::begin(u64 fileSize, uint& outChunkSize, uint& outIoRingQueueDepth)
+{
+	ScopedCriticalSection cs(m_cs);
+	outChunkSize = m_chunkSize;
+	outIoRingQueueDepth = m_ioRingQueueDepth;
+	if (m_phase == Phase_Done || fileSize < CopyTunerMinFileSize)
+		return false;
+	if (m_phase == Phase_ChunkSize)
+		outChunkSize = g_chunkSizeCandidates[m_candidateIndex];
+	else
+		outIoRingQueueDepth = g_ioRingQueueDepthCandidates[m_candidateIndex];
+	return true;
+}
+
+void
+CopyTuner::end(uint chunkSize, uint ioRingQueueDepth, u64 size, u64 time)
+{
+	ScopedCriticalSection cs(m_cs);
+	if (m_phase == Phase_Done || size == 0)
+		return;
+
+	// Copies started with an earlier candidate (other threads might still be working on those) are thrown away
+	const uint* candidates = m_phase == Phase_ChunkSize ? g_chunkSizeCandidates : g_ioRingQueueDepthCandidates;
+	uint candidateCount = m_phase == Phase_ChunkSize ? eacopy_sizeof_array(g_chunkSizeCandidates) : eacopy_sizeof_array(g_ioRingQueueDepthCandidates);
+	uint value = m_phase == Phase_ChunkSize ? chunkSize : ioRingQueueDepth;
+	if (value != candidates[m_candidateIndex])
+		return;
+
+	Sample& sample = m_samples[m_candidateIndex];
+	sample.size += size;
+	sample.time += time;
+	if (sample.size < CopyTunerSampleSize)
+		return;
+
+	if (++m_candidateIndex != candidateCount)
+		return;
+
+	// All candidates measured, pick the one with best throughput
+	uint bestIndex = 0;
+	for (uint i=1; i!=candidateCount; ++i)
+		if (double(m_samples[i].size) * m_samples[bestIndex].time > double(m_samples[bestIndex].size) * m_samples[i].time)
+			bestIndex = i;
+
+	if (m_phase == Phase_ChunkSize)
+	{
+		m_chunkSize = candidates[bestIndex];
+		m_phase = m_tuneIoRingQueueDepth ? Phase_IoRingQueueDepth : Phase_Done;
+	}
+	else
+	{
+		m_ioRingQueueDepth = candidates[bestIndex];
+		m_phase = Phase_Done;
+	}
+
+	m_candidateIndex = 0;
+	for (Sample& s : m_samples)
+		s = Sample();
+}
+
+uint
+CopyTuner::getChunkSize()
+{
+	ScopedCriticalSection cs(m_cs);
+	return m_chunkSize;
+}
+
+uint
+CopyTuner::getIoRingQueueDepth()
+{
+	ScopedCriticalSection cs(m_cs);
+	return m_ioRingQueueDepth;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 HashContext::HashContext(u64& time, u64& count)
 :	m_time(time)
 ,	m_count(count)
@@ -2743,6 +4976,20 @@ HashBuilder::add(u8* data, u64 size)
 	return false;
 }
 
+bool
+HashBuilder::addZeros(u64 size)
+{
+	static u8 zeros[64*1024];
+	while (size)
+	{
+		u64 toAdd = min(size, u64(sizeof(zeros)));
+		if (!add(zeros, toAdd))
+			return false;
+		size -= toAdd;
+	}
+	return true;
+}
+
 bool
 HashBuilder::getHash(Hash& outHash)
 {
@@ -12,6 +12,7 @@
 #else
 #include <algorithm>
 #include <limits.h>
+#include <signal.h>
 #include <unistd.h>
 #endif
 
@@ -53,6 +54,9 @@ WString g_testDestDir = DEFAULT_DEST_DIR;
 // Destination directory used by unit tests. Should be a network share on the local machine.
 WString g_testExternalDestDir = DEFAULT_EXTERNAL_DEST_DIR;
 
+// Benchmarks write a lot of data so they are only run when /BENCHMARK is provided on command line
+bool g_runBenchmarks = false;
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // TestServer
 // Wrapper of the Server with execution happening on another thread to be able to run EAClient on main thread during testing
@@ -304,6 +308,39 @@ struct TestBase
 		return isEqual((testSourceDir + file).c_str(), (testDestDir + file).c_str());
 	}
 
+	bool isContentEqual(const wchar_t* fileA, const wchar_t* fileB)
+	{
+		FileInfo a;
+		FileInfo b;
+		if (!getFileInfo(a, fileA) || !getFileInfo(b, fileB) || a.fileSize != b.fileSize)
+			return false;
+
+		FileHandle handleA;
+		FileHandle handleB;
+		EACOPY_ASSERT(openFileRead(fileA, handleA, ioStats, true));
+		EACOPY_ASSERT(openFileRead(fileB, handleB, ioStats, true));
+		Vector<u8> bufferA(1024*1024);
+		Vector<u8> bufferB(1024*1024);
+		bool equal = true;
+		for (u64 left = a.fileSize; left && equal;)
+		{
+			u64 toRead = min(left, u64(bufferA.size()));
+			u64 readA = 0;
+			u64 readB = 0;
+			equal = readFile(fileA, handleA, bufferA.data(), toRead, readA, ioStats) && readFile(fileB, handleB, bufferB.data(), toRead, readB, ioStats);
+			equal = equal && readA == toRead && readB == toRead && memcmp(bufferA.data(), bufferB.data(), toRead) == 0;
+			left -= toRead;
+		}
+		closeFile(fileA, handleA, AccessType_Read, ioStats);
+		closeFile(fileB, handleB, AccessType_Read, ioStats);
+		return equal;
+	}
+
+	bool isSourceContentEqualDest(const wchar_t* file)
+	{
+		return isContentEqual((testSourceDir + file).c_str(), (testDestDir + file).c_str());
+	}
+
 	void createFileList(const wchar_t* name, const char* fileOrWildcard, bool source = true)
 	{
 		WString dir = source ? testSourceDir : testDestDir;
@@ -379,6 +416,8 @@ uint TestBase::s_skipCount;
 
 #define EACOPY_TEST(name) EACOPY_TEST_LOOP(name, 1)
 
+#define EACOPY_BENCHMARK(name) EACOPY_TEST_LOOP(name, g_runBenchmarks ? 1u : 0u)
+
 
 #define EACOPY_REQUIRE_EXTERNAL_SHARE																\
 	if (g_testExternalDestDir.empty())																\
@@ -407,6 +446,71 @@ EACOPY_TEST(UncPathOptimization)
 }
 #endif
 
+EACOPY_TEST(MatchWildcards)
+{
+	EACOPY_ASSERT(WildcardMatcher(L"*.*").match(L"Foo"));
+	EACOPY_ASSERT(WildcardMatcher(L"*.txt").match(L"Foo.TXT"));
+	EACOPY_ASSERT(!WildcardMatcher(L"*.txt").match(L"Foo.txt2"));
+	EACOPY_ASSERT(WildcardMatcher(L"Foo*").match(L"foobar.txt"));
+	EACOPY_ASSERT(!WildcardMatcher(L"Foo*").match(L"Fo"));
+	EACOPY_ASSERT(WildcardMatcher(L"Foo.txt").match(L"FOO.txt"));
+	EACOPY_ASSERT(!WildcardMatcher(L"Foo.txt").match(L"Foo.txt.bak"));
+	EACOPY_ASSERT(WildcardMatcher(L"F?o*.t*t").match(L"Fxo123.text"));
+	EACOPY_ASSERT(!WildcardMatcher(L"F?o*.t*t").match(L"Fxo123.texts"));
+	EACOPY_ASSERT(WildcardMatcher(L"*.txt; *.h").match(L"Foo.h"));
+	EACOPY_ASSERT(!WildcardMatcher(L"*.txt; *.h").match(L"Foo.cpp"));
+	EACOPY_ASSERT(WildcardMatcher(L"*.txt ;*.h").match(L"Foo.txt"));
+	EACOPY_ASSERT(matchWildcard(L"Foo.txt", L"*.txt ;*.h"));
+	EACOPY_ASSERT(WildcardMatcher(L" *.txt ").match(L"Foo.txt"));
+
+	WildcardSetMatcher setMatcher;
+	EACOPY_ASSERT(!setMatcher.match(L"Foo.txt"));
+	setMatcher.add(L"*.obj");
+	setMatcher.add(L"*.pdb; C:\\Temp\\*");
+	setMatcher.add(L"C:\\Foo.txt");
+	setMatcher.add(L"*\\Gen?rated\\*");
+	EACOPY_ASSERT(setMatcher.match(L"C:\\Dir\\Foo.OBJ"));
+	EACOPY_ASSERT(setMatcher.match(L"C:\\Dir\\Foo.pdb"));
+	EACOPY_ASSERT(setMatcher.match(L"c:\\temp\\Foo.cpp"));
+	EACOPY_ASSERT(setMatcher.match(L"c:\\foo.txt"));
+	EACOPY_ASSERT(!setMatcher.match(L"C:\\Foo.txt2"));
+	EACOPY_ASSERT(setMatcher.match(L"C:\\Generated\\Foo.cpp"));
+	EACOPY_ASSERT(!setMatcher.match(L"C:\\Gen\\Foo.cpp"));
+	setMatcher.add(L"*.lib ;*.exp");
+	EACOPY_ASSERT(setMatcher.match(L"C:\\Dir\\Foo.lib"));
+}
+
+EACOPY_BENCHMARK(MatchWildcardsCompiledVsUncompiled)
+{
+	// Compiled matcher against matching the pattern on every call
+	Vector<WString> names;
+	for (uint i=0; i!=1000; ++i)
+	{
+		wchar_t name[64];
+		swprintf(name, eacopy_sizeof_array(name), L"SomeFileName%u.%ls", i, (i % 3) ? L"cpp" : L"txt");
+		names.push_back(name);
+	}
+	const wchar_t* patterns[] = { L"*.*", L"*.txt", L"SomeFileName1*", L"Some*Name?2*.cpp" };
+	for (const wchar_t* pattern : patterns)
+	{
+		uint compiledCount = 0;
+		uint uncompiledCount = 0;
+		u64 startTime = getTime();
+		WildcardMatcher matcher(pattern);
+		for (uint loop=0; loop!=100; ++loop)
+			for (auto& name : names)
+				compiledCount += matcher.match(name.c_str());
+		u64 compiledTime = getTime() - startTime;
+		startTime = getTime();
+		for (uint loop=0; loop!=100; ++loop)
+			for (auto& name : names)
+				uncompiledCount += matchWildcard(name.c_str(), pattern);
+		u64 uncompiledTime = getTime() - startTime;
+		EACOPY_ASSERT(compiledCount == uncompiledCount);
+		logInfoLinef(L"%ls: Compiled %ls Uncompiled %ls", pattern, toHourMinSec(compiledTime).c_str(), toHourMinSec(uncompiledTime).c_str());
+	}
+}
+
 EACOPY_TEST(CopySmallFile)
 {
 	createTestFile(L"Foo.txt", 100);
@@ -439,6 +543,499 @@ EACOPY_TEST(CopyMediumFile)
 	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
 }
 
+EACOPY_TEST(CopyFilesWithIoRing)
+{
+	createTestFile(L"Foo.txt", 16*1024*1024 + 123); // Does not fill last slot
+	createTestFile(L"Bar.txt", 5*1024*1024);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.ioRingQueueDepth = 4;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 2);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceContentEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceContentEqualDest(L"Bar.txt"));
+}
+
+EACOPY_TEST(CopySmallFilesWithIoRing)
+{
+	// More files than fit in one batch
+	uint fileCount = SmallFileBatchCount + 8;
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t name[64];
+		swprintf(name, eacopy_sizeof_array(name), L"File%u.txt", i);
+		createTestFile(name, 1000 + i*517);
+	}
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.ioRingQueueDepth = 4;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == fileCount);
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t name[64];
+		swprintf(name, eacopy_sizeof_array(name), L"File%u.txt", i);
+		EACOPY_ASSERT(isSourceContentEqualDest(name));
+	}
+
+	// Source that grew after it was found must not be copied using its old size
+	WString sourceFile = testSourceDir + L"Grown.txt";
+	WString destFile = testDestDir + L"Grown.txt";
+	createTestFile(L"Grown.txt", 100);
+	FileInfo sourceInfo;
+	EACOPY_ASSERT(getFileInfo(sourceInfo, sourceFile.c_str()));
+	createTestFile(L"Grown.txt", 200);
+	SmallFileCopyEntry entry = { sourceFile.c_str(), destFile.c_str(), sourceInfo, false, false };
+	CopyContext copyContext;
+	if (copySmallFiles(&entry, 1, copyContext, ioStats)) // Not supported on all platforms/kernels
+	{
+		EACOPY_ASSERT(!entry.success);
+		EACOPY_ASSERT(!getTestFileExists(L"Grown.txt"));
+	}
+}
+
+EACOPY_TEST(CopyFileInParts)
+{
+	// Last part is not a full part
+	u64 fileSize = 64*1024*1024 + 123;
+	createTestFile(L"Foo.txt", fileSize);
+	createTestFile(L"Bar.txt", 100);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.splitFileThreshold = 1024*1024;
+	clientSettings.threadCount = 2;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 2);
+	EACOPY_ASSERT(clientStats.copySize == fileSize + 100);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceContentEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceContentEqualDest(L"Bar.txt"));
+}
+
+EACOPY_TEST(CopyFilesWithVerify)
+{
+	createTestFile(L"Foo.txt", 3*1024*1024 + 123);
+	createTestFile(L"Bar.txt", 100);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.verifyCopies = true;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.verifyCount == 2);
+	EACOPY_ASSERT(clientStats.verifyFailCount == 0);
+	EACOPY_ASSERT(clientStats.verifySize == 3*1024*1024 + 123 + 100);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+}
+
+EACOPY_TEST(CopyFileWithTempFiles)
+{
+	createTestFile(L"Foo.txt", 3*1024*1024 + 123);
+	createTestFile(L"Foo.txt", 100, false); // Old file at destination should be replaced
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useTempFiles = true;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(clientStats.ioStats.flushFileCount == 1);
+
+	// Temp file must have been moved in place, nothing else is left in destination
+	uint destFileCount = 0;
+	FindFileData fd;
+	FindFileHandle findFileHandle = findFirstFile((testDestDir + L"*").c_str(), fd, ioStats);
+	EACOPY_ASSERT(findFileHandle != InvalidFindFileHandle);
+	do
+	{
+		if (!isDotOrDotDot(getFileName(fd)))
+			++destFileCount;
+	}
+	while (findNextFile(findFileHandle, fd, ioStats));
+	findClose(findFileHandle, ioStats);
+	EACOPY_ASSERT(destFileCount == 1);
+}
+
+EACOPY_TEST(MoveFileFailIfExists)
+{
+	createTestFile(L"Foo.txt", 10);
+	createTestFile(L"Bar.txt", 20);
+	WString foo = testSourceDir + L"Foo.txt";
+	WString bar = testSourceDir + L"Bar.txt";
+
+	WString tempFileName;
+	getTempFileName(tempFileName, bar.c_str());
+	EACOPY_ASSERT(tempFileName != testSourceDir + L".Bar.txt"); // Must not collide with other writers of the same file
+
+	// Temp name of a file with longest allowed name must still be a valid name
+	WString longName(255, L'a');
+	WString longTempFileName;
+	getTempFileName(longTempFileName, (testSourceDir + longName).c_str());
+	EACOPY_ASSERT(longTempFileName.size() - testSourceDir.size() <= 255);
+	WString longTempFileName2;
+	getTempFileName(longTempFileName2, (testSourceDir + WString(254, L'a') + L"b").c_str());
+	EACOPY_ASSERT(longTempFileName != longTempFileName2);
+	EACOPY_ASSERT(createFile(longTempFileName.c_str(), FileInfo(), nullptr, ioStats, true));
+	EACOPY_ASSERT(deleteFile(longTempFileName.c_str(), ioStats));
+
+	bool existed = false;
+	EACOPY_ASSERT(!moveFile(foo.c_str(), bar.c_str(), ioStats, true, &existed));
+	EACOPY_ASSERT(existed);
+	FileInfo barInfo;
+	EACOPY_ASSERT(getFileInfo(barInfo, bar.c_str()) && barInfo.fileSize == 20);
+
+	EACOPY_ASSERT(moveFile(foo.c_str(), tempFileName.c_str(), ioStats, true, &existed));
+	EACOPY_ASSERT(moveFile(tempFileName.c_str(), bar.c_str(), ioStats));
+	EACOPY_ASSERT(getFileInfo(barInfo, bar.c_str()) && barInfo.fileSize == 10);
+}
+
+EACOPY_TEST(CopyFilesWithDedupe)
+{
+	u64 fileSize = 256*1024;
+	createTestFile(L"Foo.txt", fileSize);
+	createTestFile(L"Dir\\Foo2.txt", fileSize); // Same content, different path
+	createTestFile(L"Bar.txt", fileSize + 1);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.dedupeDestination = true;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 3);
+	if (supportsFileCloning(testDestDir.c_str()))
+	{
+		EACOPY_ASSERT(clientStats.dedupeCount == 1);
+		EACOPY_ASSERT(clientStats.dedupeSize == fileSize);
+	}
+	else
+		EACOPY_ASSERT(clientStats.dedupeCount == 0);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\Foo2.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Bar.txt"));
+
+	// Modifying one of the deduped files in place must leave its twin intact
+	WString destFile = testDestDir + L"Foo.txt";
+	FileHandle file;
+	EACOPY_ASSERT(openFileWrite(destFile.c_str(), file, ioStats, true, nullptr, false, false));
+	char data[4096];
+	memset(data, 0xcd, sizeof(data));
+	EACOPY_ASSERT(writeFile(destFile.c_str(), file, data, sizeof(data), ioStats));
+	EACOPY_ASSERT(closeFile(destFile.c_str(), file, AccessType_Write, ioStats));
+	EACOPY_ASSERT(!isSourceContentEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceContentEqualDest(L"Dir\\Foo2.txt"));
+}
+
+EACOPY_TEST(CopyFilesInDirectoryTreeWithManyWorkers)
+{
+	// Enough directories for workers to steal from each other
+	uint fileCount = 0;
+	for (uint i=0; i!=4; ++i)
+		for (uint j=0; j!=4; ++j)
+			for (uint k=0; k!=4; ++k)
+			{
+				wchar_t name[64];
+				swprintf(name, eacopy_sizeof_array(name), L"Dir%u\\Dir%u\\Dir%u\\File.txt", i, j, k);
+				createTestFile(name, 10 + fileCount++);
+			}
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.threadCount = 8;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == fileCount);
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir3\\Dir3\\Dir3\\File.txt"));
+}
+
+EACOPY_TEST(CopyFilesWithDestDirectorySnapshot)
+{
+	createTestFile(L"Dir\\Foo.txt", 10);
+	createTestFile(L"Dir\\Bar.txt", 20);
+	createTestFile(L"Dir\\Meh.txt", 30);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 3);
+
+	// Once a destination file is found the rest of the directory is checked from snapshot
+	createTestFile(L"Dir\\Bar.txt", 21);
+	createTestFile(L"Dir\\New.txt", 40);
+	ClientStats clientStats2;
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.copyCount == 2);
+	EACOPY_ASSERT(clientStats2.skipCount == 2);
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\Bar.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\New.txt"));
+}
+
+EACOPY_TEST(CopyFilesWithScanCache)
+{
+	createTestFile(L"Dir\\Foo.txt", 10);
+	createTestFile(L"Dir\\Sub\\Bar.txt", 20);
+	Sleep(ScanCacheRacyTimeMs + 1000); // Directories modified right before being listed are not saved in cache
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.destDirectory = testDestDir + L"Main\\";
+	clientSettings.scanCacheFile = testDestDir + L"ScanCache.bin";
+	clientSettings.copySubdirDepth = 100;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 2);
+	EACOPY_ASSERT(clientStats.scanCacheHitCount == 0);
+
+	// Nothing changed, no directory is enumerated
+	ClientStats clientStats2;
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.skipCount == 2);
+	EACOPY_ASSERT(clientStats2.scanCacheHitCount == 3);
+	EACOPY_ASSERT(clientStats2.ioStats.findFileCount < clientStats.ioStats.findFileCount);
+
+	// Replacing a file changes write time of its directory
+	createTestFile(L"Dir\\Sub\\Bar.tmp", 25);
+	EACOPY_ASSERT(moveFile((testSourceDir + L"Dir\\Sub\\Bar.tmp").c_str(), (testSourceDir + L"Dir\\Sub\\Bar.txt").c_str(), ioStats));
+	Sleep(ScanCacheRacyTimeMs + 1000); // Listing of Sub is saved for next step
+	ClientStats clientStatsReplace;
+	EACOPY_ASSERT(client.process(clientLog, clientStatsReplace) == 0);
+	EACOPY_ASSERT(clientStatsReplace.copyCount == 1);
+	EACOPY_ASSERT(clientStatsReplace.scanCacheHitCount == 2);
+	EACOPY_ASSERT(isEqual((testSourceDir + L"Dir\\Sub\\Bar.txt").c_str(), (testDestDir + L"Main\\Dir\\Sub\\Bar.txt").c_str()));
+
+	// Adding a file changes write time of its directory
+	createTestFile(L"Dir\\New.txt", 30);
+	ClientStats clientStats3;
+	EACOPY_ASSERT(client.process(clientLog, clientStats3) == 0);
+	EACOPY_ASSERT(clientStats3.copyCount == 1);
+	EACOPY_ASSERT(clientStats3.scanCacheHitCount == 2);
+	EACOPY_ASSERT(isEqual((testSourceDir + L"Dir\\New.txt").c_str(), (testDestDir + L"Main\\Dir\\New.txt").c_str()));
+}
+
+#if !defined(_WIN32)
+EACOPY_TEST(FileOperationsFollowReplacedDirectory)
+{
+	// Lookups on linux go through cached directory handles. Neither lookups nor writes may end up in a directory that
+	// has been renamed or removed and replaced by another directory at the same path
+	createTestFile(L"Dir\\Foo.txt", 10);
+	FileInfo info;
+	EACOPY_ASSERT(getFileInfo(info, (testSourceDir + L"Dir\\Foo.txt").c_str()));
+
+	EACOPY_ASSERT(deleteDirectory((testSourceDir + L"Dir").c_str(), ioStats));
+	createTestFile(L"Dir\\Bar.txt", 10);
+	EACOPY_ASSERT(getFileInfo(info, (testSourceDir + L"Dir\\Bar.txt").c_str()));
+
+	EACOPY_ASSERT(moveFile((testSourceDir + L"Dir").c_str(), (testSourceDir + L"Dir2").c_str(), ioStats));
+	createTestFile(L"Dir\\Baz.txt", 10);
+	EACOPY_ASSERT(getFileInfo(info, (testSourceDir + L"Dir\\Baz.txt").c_str()));
+	EACOPY_ASSERT(!getFileInfo(info, (testSourceDir + L"Dir2\\Baz.txt").c_str()));
+}
+
+EACOPY_TEST(CopyFilesWithWatch)
+{
+	createTestFile(L"Foo.txt", 10);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.watchSource = true;
+	clientSettings.watchDebounceMs = 100;
+	Client client(clientSettings);
+
+	auto waitForCopy = [&](const wchar_t* file) { for (uint i=0; i!=500 && !isSourceEqualDest(file); ++i) Sleep(10); };
+
+	Thread thread([&]()
+	{
+		// First pass copies existing file, after that changes are picked up through watch
+		waitForCopy(L"Foo.txt");
+		createTestFile(L"Foo.txt", 30);
+		createTestFile(L"Dir\\Sub\\Bar.txt", 20);
+		waitForCopy(L"Foo.txt");
+		waitForCopy(L"Dir\\Sub\\Bar.txt");
+		client.stopWatch();
+		return 0;
+	});
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\Sub\\Bar.txt"));
+	EACOPY_ASSERT(clientStats.watchEventCount > 0);
+	EACOPY_ASSERT(clientStats.watchCopyCount >= 1);
+}
+
+EACOPY_TEST(CopyFilesWithWatchStoppedBySignal)
+{
+	createTestFile(L"Foo.txt", 10);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.watchSource = true;
+	Client client(clientSettings);
+	client.stopWatchOnSignal();
+
+	// Same path as ctrl-c in command line
+	Thread thread([&]()
+	{
+		for (uint i=0; i!=500 && !isSourceEqualDest(L"Foo.txt"); ++i)
+			Sleep(10);
+		kill(getpid(), SIGTERM);
+		return 0;
+	});
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+}
+#endif
+
+EACOPY_TEST(CopyFilesToAdditionalDestinations)
+{
+	createTestFile(L"Foo.txt", 3*1024*1024 + 123);
+	createTestFile(L"Dir\\Bar.txt", 100);
+	createTestFile(L"Fan2\\Foo.txt", 10, false); // Outdated file in one of the destinations
+
+	WString fanDirs[] = { testDestDir + L"Fan1\\", testDestDir + L"Fan2\\" };
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.destDirectory = testDestDir + L"Main\\";
+	clientSettings.copySubdirDepth = 100;
+	for (auto& fanDir : fanDirs)
+		clientSettings.additionalDestDirectories.push_back(fanDir);
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 6);
+	for (auto& fanDir : fanDirs)
+	{
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Foo.txt").c_str(), (fanDir + L"Foo.txt").c_str()));
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Dir\\Bar.txt").c_str(), (fanDir + L"Dir\\Bar.txt").c_str()));
+	}
+
+	// Second run skips in all destinations
+	ClientStats clientStats2;
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.copyCount == 0);
+	EACOPY_ASSERT(clientStats2.skipCount == 6);
+
+	// Small files must reach every destination also when io_uring batching and temp files are enabled
+	createTestFile(L"Dir\\Small1.txt", 10);
+	createTestFile(L"Dir\\Small2.txt", 20);
+	clientSettings.ioRingQueueDepth = DefaultIoRingQueueDepth;
+	clientSettings.useTempFiles = true;
+	ClientStats clientStats3;
+	EACOPY_ASSERT(client.process(clientLog, clientStats3) == 0);
+	EACOPY_ASSERT(clientStats3.copyCount == 6);
+	WString allDirs[] = { clientSettings.destDirectory, fanDirs[0], fanDirs[1] };
+	for (auto& dir : allDirs)
+	{
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Dir\\Small1.txt").c_str(), (dir + L"Dir\\Small1.txt").c_str()));
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Dir\\Small2.txt").c_str(), (dir + L"Dir\\Small2.txt").c_str()));
+	}
+}
+
+EACOPY_TEST(CopyFilesWithDeviceConcurrency)
+{
+	for (uint i=0; i!=50; ++i)
+	{
+		wchar_t name[64];
+		swprintf(name, eacopy_sizeof_array(name), L"Dir%u\\File%u.txt", i % 4, i);
+		createTestFile(name, 1024 + i);
+	}
+
+	u64 sourceDevice;
+	u64 destDevice;
+	EACOPY_ASSERT(getDeviceId(testSourceDir.c_str(), sourceDevice, ioStats));
+	EACOPY_ASSERT(getDeviceId(testDestDir.c_str(), destDevice, ioStats));
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.threadCount = 4;
+	clientSettings.deviceConcurrency = 1;
+	Client client(clientSettings);
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 50);
+	EACOPY_ASSERT(clientStats.deviceMaxActive == 1);
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir1\\File49.txt"));
+
+	// Destination directory does not exist yet, its device is found through nearest existing parent
+	ClientStats clientStats2;
+	clientSettings.destDirectory = testDestDir + L"New\\Sub\\";
+	clientSettings.deviceConcurrency = 2;
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.copyCount == 50);
+	EACOPY_ASSERT(clientStats2.deviceMaxActive >= 1 && clientStats2.deviceMaxActive <= 2);
+}
+
+EACOPY_TEST(CopyFilesOrderedByLocation)
+{
+	uint fileCount = 64;
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t name[64];
+		swprintf(name, eacopy_sizeof_array(name), L"Dir%u\\File%u.txt", i % 4, i);
+		createTestFile(name, 1024 + i);
+	}
+
+	CopyOrder orders[] = { CopyOrder_Discovery, CopyOrder_FileId, CopyOrder_PhysicalOffset };
+	for (CopyOrder order : orders)
+	{
+		ClientSettings clientSettings(getDefaultClientSettings());
+		clientSettings.copySubdirDepth = 100;
+		clientSettings.forceCopy = true;
+		clientSettings.copyOrder = order;
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == fileCount);
+		for (uint i=0; i!=fileCount; ++i)
+		{
+			wchar_t name[64];
+			swprintf(name, eacopy_sizeof_array(name), L"Dir%u\\File%u.txt", i % 4, i);
+			EACOPY_ASSERT(isSourceEqualDest(name));
+		}
+	}
+}
+
+EACOPY_BENCHMARK(CopyFilesOrderedByLocationTiming)
+{
+	// Files are created round robin over directories so discovery order is far from allocation order
+	uint fileCount = 2000;
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t name[64];
+		swprintf(name, eacopy_sizeof_array(name), L"Dir%u\\File%u.txt", i % 16, i);
+		createTestFile(name, 32*1024 + i);
+	}
+
+	CopyOrder orders[] = { CopyOrder_Discovery, CopyOrder_FileId, CopyOrder_PhysicalOffset };
+	const wchar_t* orderNames[] = { L"Discovery", L"FileId", L"PhysicalOffset" };
+	for (uint orderIndex=0; orderIndex!=eacopy_sizeof_array(orders); ++orderIndex)
+	{
+		ClientSettings clientSettings(getDefaultClientSettings());
+		clientSettings.copySubdirDepth = 100;
+		clientSettings.forceCopy = true;
+		clientSettings.copyOrder = orders[orderIndex];
+		Client client(clientSettings);
+		ClientStats clientStats;
+		u64 startTime = getTime();
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		u64 time = getTime() - startTime;
+		EACOPY_ASSERT(clientStats.copyCount == fileCount);
+		EACOPY_ASSERT(isSourceEqualDest(L"Dir3\\File1523.txt"));
+		logInfoLinef(L"%ls: %ls", orderNames[orderIndex], toHourMinSec(time).c_str());
+	}
+}
+
 EACOPY_TEST(SkipFile)
 {
 	createTestFile(L"Foo.txt", 100);
@@ -745,6 +1342,24 @@ EACOPY_TEST(CopyFileList)
 	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
 }
 
+EACOPY_TEST(CopyFileListWithWildcard)
+{
+	createTestFile(L"Dir\\Foo.txt", 10);
+	createTestFile(L"Dir\\Bar.txt", 20);
+	createTestFile(L"Dir\\Meh.dat", 30);
+	createFileList(L"FileList.txt", "Dir\\*.txt");
+
+	ClientSettings clientSettings = getDefaultClientSettings(nullptr);
+	clientSettings.filesOrWildcardsFiles.push_back(L"FileList.txt");
+
+	Client client(clientSettings);
+	EACOPY_ASSERT(client.process(clientLog) == 0);
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Dir\\Bar.txt"));
+	FileInfo destFile;
+	EACOPY_ASSERT(getFileInfo(destFile, (testDestDir + L"Dir\\Meh.dat").c_str()) == 0);
+}
+
 EACOPY_TEST(CopyFullPathFileList)
 {
 	String fooAbsPath(toString(testSourceDir.c_str()));
@@ -1141,6 +1756,24 @@ EACOPY_TEST(CopyUsingLink)
 	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
 }
 
+EACOPY_TEST(CreateFileLinkTwice)
+{
+	createTestFile(L"Foo.txt", 100);
+	WString sourceFile = testSourceDir + L"Foo.txt";
+	WString destFile = testDestDir + L"Foo.txt";
+	FileInfo sourceInfo;
+	EACOPY_ASSERT(getFileInfo(sourceInfo, sourceFile.c_str()) != 0);
+
+	bool skip;
+	EACOPY_ASSERT(createFileLink(destFile.c_str(), sourceInfo, sourceFile.c_str(), skip, ioStats, false));
+	EACOPY_ASSERT(!skip);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+
+	// Linking again should find the existing link and skip
+	EACOPY_ASSERT(createFileLink(destFile.c_str(), sourceInfo, sourceFile.c_str(), skip, ioStats, false));
+	EACOPY_ASSERT(skip);
+}
+
 EACOPY_TEST(LinkFileWithVeryLongPath)
 {
 	WString longPath;
@@ -1483,6 +2116,81 @@ EACOPY_TEST(ServerCopyLink)
 	EACOPY_ASSERT(clientStats2.linkCount == 1);
 }
 
+EACOPY_TEST(HashBuilderMatchesFileHash)
+{
+	// sendFile and receiveFile hash data chunk by chunk and add holes of sparse files as zeros. Must match hashing the file in one go
+	uint fileSize = 3*1024*1024 + 123;
+	createTestFile(L"Foo.txt", fileSize);
+	WString file = testSourceDir + L"Foo.txt";
+
+	CopyContext copyContext;
+	u64 hashTime = 0;
+	u64 hashCount = 0;
+	HashContext hashContext(hashTime, hashCount);
+	Hash fileHash;
+	EACOPY_ASSERT(getFileHash(fileHash, file.c_str(), copyContext, ioStats, hashContext, hashTime));
+
+	Hash chunkedHash;
+	{
+		HashBuilder builder(hashContext);
+		FileHandle handle;
+		EACOPY_ASSERT(openFileRead(file.c_str(), handle, ioStats, true));
+		Vector<u8> buffer(100*1000);
+		for (u64 left = fileSize; left;)
+		{
+			u64 toRead = min(left, u64(buffer.size()));
+			u64 read = 0;
+			EACOPY_ASSERT(readFile(file.c_str(), handle, buffer.data(), toRead, read, ioStats) && read == toRead);
+			EACOPY_ASSERT(builder.add(buffer.data(), read));
+			left -= read;
+		}
+		closeFile(file.c_str(), handle, AccessType_Read, ioStats);
+		EACOPY_ASSERT(builder.getHash(chunkedHash));
+	}
+	EACOPY_ASSERT(chunkedHash == fileHash);
+
+	uint holeSize = 200*1000; // Larger than the zero buffer used by addZeros
+	Vector<u8> zeros(holeSize);
+	Hash dataHash;
+	Hash zerosHash;
+	{
+		HashBuilder builder(hashContext);
+		EACOPY_ASSERT(builder.add(zeros.data(), holeSize));
+		EACOPY_ASSERT(builder.getHash(dataHash));
+	}
+	{
+		HashBuilder builder(hashContext);
+		EACOPY_ASSERT(builder.addZeros(holeSize));
+		EACOPY_ASSERT(builder.getHash(zerosHash));
+	}
+	EACOPY_ASSERT(dataHash == zerosHash);
+}
+
+EACOPY_TEST(ServerCopyByHashDestIsLocal)
+{
+	std::swap(testSourceDir, testDestDir);
+
+	uint fileSize = 3*1024*1024 + 123;
+	createTestFile(L"Foo.txt", fileSize);
+	createTestFile(L"Foo.txt", fileSize, false);
+	writeRandomData((testDestDir + L"Foo.txt").c_str(), fileSize);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	serverSettings.useHash = true;
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	Client client(clientSettings);
+
+	// Same size but different content, server asks client for hash and then sends the file while hashing it
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 1);
+	EACOPY_ASSERT(isSourceContentEqualDest(L"Foo.txt"));
+}
+
 EACOPY_TEST(ServerCopyByHash)
 {
 	createTestFile(L"Foo.txt", 10);
@@ -2025,6 +2733,141 @@ EACOPY_TEST(CopyLargeFile)
 	}
 }
 
+u64 getPageCacheSize()
+{
+	#if defined(_WIN32)
+	return 0; // Only measured on linux
+	#else
+	u64 cachedKb = 0;
+	if (FILE* f = fopen("/proc/meminfo", "r"))
+	{
+		char line[256];
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "Cached: %llu kB", &cachedKb) == 1)
+				break;
+		fclose(f);
+	}
+	return cachedKb * 1024;
+	#endif
+}
+
+EACOPY_BENCHMARK(CopyLargeFileBufferedVsUnbuffered)
+{
+	// Logs throughput and page cache growth of buffered vs unbuffered copy
+	u64 fileSize = 512*1024*1024 + 123;
+	createTestFile(L"Foo.txt", fileSize);
+
+	UseBufferedIO modes[] = { UseBufferedIO_Enabled, UseBufferedIO_Disabled };
+	for (UseBufferedIO mode : modes)
+	{
+		const wchar_t* modeName = mode == UseBufferedIO_Enabled ? L"Buffered" : L"Unbuffered";
+		WString destFile = testDestDir + modeName + L".txt";
+
+		u64 cacheSizeBefore = getPageCacheSize();
+		u64 startTime = getTime();
+		bool existed;
+		u64 bytesCopied;
+		EACOPY_ASSERT(copyFile((testSourceDir + L"Foo.txt").c_str(), destFile.c_str(), false, false, existed, bytesCopied, ioStats, mode));
+		u64 time = getTime() - startTime;
+		u64 cacheSizeAfter = getPageCacheSize();
+
+		EACOPY_ASSERT(bytesCopied == fileSize);
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Foo.txt").c_str(), destFile.c_str()));
+
+		u64 bytesPerSecond = time ? (fileSize * 10000000) / time : 0;
+		logInfoLinef(L"%ls: %ls/s, page cache grew %ls", modeName, toPretty(bytesPerSecond).c_str(), toPretty(cacheSizeAfter > cacheSizeBefore ? cacheSizeAfter - cacheSizeBefore : 0).c_str());
+	}
+}
+
+EACOPY_BENCHMARK(CopyFileMappedVsRead)
+{
+	// Logs throughput of mapped vs non-mapped copies for different file sizes to find the band where mapping pays off
+	u64 fileSizes[] = { 16*1024, 64*1024, 1024*1024, 16*1024*1024, 64*1024*1024, 256*1024*1024 };
+	for (u64 fileSize : fileSizes)
+	{
+		wchar_t sizeStr[32];
+		itow((int)(fileSize / 1024), sizeStr, eacopy_sizeof_array(sizeStr));
+		WString sourceFile = WString(sizeStr) + L".txt";
+		createTestFile(sourceFile.c_str(), fileSize);
+
+		uint copyCount = (uint)max(u64(1), u64(256*1024*1024) / fileSize);
+
+		UseMappedIO modes[] = { UseMappedIO_Disabled, UseMappedIO_Enabled };
+		u64 times[2];
+		for (uint modeIndex=0; modeIndex!=2; ++modeIndex)
+		{
+			u64 startTime = getTime();
+			for (uint i=0; i!=copyCount; ++i)
+			{
+				bool existed;
+				u64 bytesCopied;
+				WString destFile = testDestDir + sizeStr + L"_" + (modeIndex ? L"Mapped" : L"Read") + L".txt";
+				EACOPY_ASSERT(copyFile((testSourceDir + sourceFile).c_str(), destFile.c_str(), false, false, existed, bytesCopied, ioStats, UseBufferedIO_Enabled, 0, modes[modeIndex]));
+				EACOPY_ASSERT(bytesCopied == fileSize);
+			}
+			times[modeIndex] = getTime() - startTime;
+		}
+
+		u64 totalSize = fileSize * copyCount;
+		logInfoLinef(L"%ls: Read %ls/s, Mapped %ls/s", toPretty(fileSize).c_str(), toPretty(times[0] ? (totalSize * 10000000) / times[0] : 0).c_str(), toPretty(times[1] ? (totalSize * 10000000) / times[1] : 0).c_str());
+	}
+}
+
+EACOPY_TEST(CopySparseFile)
+{
+	u64 fileSize = 64*1024*1024 + 123;
+	WString sourceFile = testSourceDir + L"Foo.txt";
+	WString destFile = testDestDir + L"Foo.txt";
+	{
+		FileHandle file;
+		EACOPY_ASSERT(openFileWrite(sourceFile.c_str(), file, ioStats, true));
+		EACOPY_ASSERT(setFileSparse(sourceFile.c_str(), file, fileSize, ioStats));
+		char data[] = "Data";
+		EACOPY_ASSERT(setFilePosition(sourceFile.c_str(), file, 1024*1024, ioStats));
+		EACOPY_ASSERT(writeFile(sourceFile.c_str(), file, data, sizeof(data), ioStats));
+		EACOPY_ASSERT(setFilePosition(sourceFile.c_str(), file, fileSize - sizeof(data), ioStats));
+		EACOPY_ASSERT(writeFile(sourceFile.c_str(), file, data, sizeof(data), ioStats));
+		EACOPY_ASSERT(closeFile(sourceFile.c_str(), file, AccessType_Write, ioStats));
+	}
+
+	bool existed;
+	u64 bytesCopied;
+	EACOPY_ASSERT(copyFile(sourceFile.c_str(), destFile.c_str(), false, false, existed, bytesCopied, ioStats, UseBufferedIO_Enabled));
+	EACOPY_ASSERT(bytesCopied == fileSize);
+	EACOPY_ASSERT(isEqual(sourceFile.c_str(), destFile.c_str()));
+
+	#if !defined(_WIN32)
+	// Holes can only be kept if source file system supports them in the first place
+	if (isSparseFile(sourceFile.c_str(), ioStats))
+		EACOPY_ASSERT(isSparseFile(destFile.c_str(), ioStats));
+	#endif
+}
+
+EACOPY_TEST(CopyTunerPicksFastestChunkSize)
+{
+	u64 fileSize = 64*1024*1024;
+	uint chunkSize;
+	uint queueDepth;
+
+	CopyTuner tuner;
+	tuner.init(0, false, 0, false);
+	EACOPY_ASSERT(!tuner.begin(fileSize, chunkSize, queueDepth)); // Nothing is tuned unless asked for
+	EACOPY_ASSERT(chunkSize == 0);
+
+	tuner.init(0, true, 0, false);
+	EACOPY_ASSERT(!tuner.begin(100, chunkSize, queueDepth)); // Small files are not measured
+	for (uint i=0; i!=100 && tuner.begin(fileSize, chunkSize, queueDepth); ++i)
+		tuner.end(chunkSize, queueDepth, fileSize, chunkSize == 1024*1024 ? 100 : 200);
+	EACOPY_ASSERT(tuner.getChunkSize() == 1024*1024);
+	EACOPY_ASSERT(!tuner.begin(fileSize, chunkSize, queueDepth));
+	EACOPY_ASSERT(chunkSize == 1024*1024);
+
+	// Chunk size and queue depth provided on command line are never tuned
+	tuner.init(128*1024, false, 4, false);
+	EACOPY_ASSERT(!tuner.begin(fileSize, chunkSize, queueDepth));
+	EACOPY_ASSERT(chunkSize == 128*1024 && queueDepth == 4);
+}
+
 #if defined(_WIN32)
 EACOPY_TEST(ServerCopyLargeFile)
 {
@@ -2345,10 +3188,11 @@ void printHelp()
 	logInfoLinef(L"  EACopyTest (Client v%ls Server v%ls) (c) Electronic Arts.  All Rights Reserved.", getClientVersionString().c_str(), getServerVersionString().c_str());
 	logInfoLinef(L"-------------------------------------------------------------------------------");
 	logInfoLinef();
-	logInfoLinef(L"             Usage :: EACopyTest source destination");
+	logInfoLinef(L"             Usage :: EACopyTest source destination [/BENCHMARK]");
 	logInfoLinef();
 	logInfoLinef(L"            source :: Source Directory (drive:\\path).");
 	logInfoLinef(L"       destination :: Destination Dir  (\\\\localhost\\share\\path). Must be local host");
+	logInfoLinef(L"        /BENCHMARK :: also run benchmarks (writes several gigabytes).");
 	logInfoLinef();
 }
 
@@ -2374,6 +3218,10 @@ int main(int argc, char* argv_[])
 	}
 #endif
 
+	for (int i=1; i<argc; ++i)
+		if (equalsIgnoreCase(argv[i], L"/BENCHMARK"))
+			g_runBenchmarks = true;
+
 	// If source and dest are not hardcoded we use command line
 	if (g_testSourceDir.empty() || g_testDestDir.empty())
 	{